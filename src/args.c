@@ -29,7 +29,7 @@
 static int parse_shebang(int argc, char *argv[],
                   int *_shebang_argc, char ***_shebang_argv) {
     int i = 0;
-    char *p;
+    char *p, *saveptr;
     int shebang_argc;
     char **shebang_argv;
 
@@ -38,10 +38,10 @@ static int parse_shebang(int argc, char *argv[],
 
     shebang_argv[i++] = argv[0];
 
-    p = strtok(argv[1], " ");
+    p = strtok_r(argv[1], " ", &saveptr);
     while (p != NULL) {
         shebang_argv[i++] = p;
-        p = strtok(NULL, " ");
+        p = strtok_r(NULL, " ", &saveptr);
     }
 
     while (i < shebang_argc) {
@@ -149,7 +149,7 @@ static int extract_command_stdin(struct scl_args *args)
         }
         command[len] = '\0';
     } else {
-        free(command);
+        command = _free(command);
         return EDISK;
     }
 
@@ -201,8 +201,8 @@ static int parse_run_args(int argc, char **argv, struct scl_args *args)
         }
 
         if (strcmp(args->command, "-") == 0) {
-            free(args->command);
-            args->command = NULL; /* In case the subsequent call fails */
+            /* NULL in case the subsequent call fails */
+            args->command = _free(args->command);
             ret = extract_command_stdin(args);
             if (ret != EOK) {
                 goto fail;
@@ -217,20 +217,39 @@ fail:
     return ret;
 }
 
+static int parse_env_format(const char *format, int *_env_format)
+{
+    const char *formats[] = {
+        [ENV_FORMAT_SH] = "sh",
+        [ENV_FORMAT_CSH] = "csh",
+        [ENV_FORMAT_JSON] = "json",
+        [ENV_FORMAT_ENV] = "env",
+    };
+
+    for (int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (!strcmp(format, formats[i])) {
+            *_env_format = i;
+            return EOK;
+        }
+    }
+
+    debug("Unknown format \"%s\"!\n", format);
+    return EINPUT;
+}
+
 /**
  * Frees struct scl_args
  */
 void scl_args_free(struct scl_args *args)
 {
     if (args->collections != NULL) {
-        free(args->collections);
+        args->collections = _free(args->collections);
     }
     if (args->colpaths != NULL) {
-        free(args->colpaths);
+        args->colpaths = _free(args->colpaths);
     }
     if (args->command != NULL) {
-        free(args->command);
-        args->command = NULL;
+        args->command = _free(args->command);
     }
 }
 
@@ -259,6 +278,26 @@ int scl_args_get(int argc, char *argv[], struct scl_args **_args)
 
     args = xcalloc(1, sizeof(*args));
 
+    /* Like rpm --root, the option precedes the action */
+    if (!strncmp(argv[1], "--root=", 7)) {
+        args->root = argv[1] + 7;
+        argv++;
+        argc--;
+    } else if (!strcmp(argv[1], "--root") && argc > 2) {
+        args->root = argv[2];
+        argv += 2;
+        argc -= 2;
+    }
+    if (args->root != NULL && args->root[0] != '/') {
+        debug("Root must be specified with absolute path!\n\n");
+        ret = EINPUT;
+        goto fail;
+    }
+    if (argc < 2) {
+        ret = EINPUT;
+        goto fail;
+    }
+
     if (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h")) {
         args->action = ACTION_NONE;
     } else if ( argc == 2 && (
@@ -384,22 +423,83 @@ int scl_args_get(int argc, char *argv[], struct scl_args **_args)
         if (ret != EOK) {
             goto fail;
         }
+    } else if (!strcmp(argv[1], "env")) {
+        int i, i2, removed = 0;
+
+        args->action = ACTION_ENV;
+        args->env_format = ENV_FORMAT_SH;
+
+        /* Remove --format=<format> / --format <format> from argv */
+        for (i = 2; i < argc; i++) {
+            if (!strncmp(argv[i], "--format=", 9)) {
+                ret = parse_env_format(argv[i] + 9, &args->env_format);
+                removed = 1;
+            } else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+                ret = parse_env_format(argv[i + 1], &args->env_format);
+                removed = 2;
+            } else {
+                continue;
+            }
+            if (ret != EOK) {
+                goto fail;
+            }
+            break;
+        }
+
+        if (removed) {
+            for (i2 = i; i2 < argc - removed; i2++) {
+                argv[i2] = argv[i2 + removed];
+            }
+            argc -= removed;
+        }
+
+        ret = extract_collections(argc, argv, args);
+        if (ret != EOK) {
+            goto fail;
+        }
     } else if (!strcmp(argv[1], "--version") || !strcmp(argv[1], "-V")) {
         args->action = ACTION_VERSION;
     } else if (!strcmp(argv[1], "list-enabled")) {
         args->action = ACTION_LIST_ENABLED;
+    } else if (!strcmp(argv[1], "stats") && argc <= 3) {
+        args->action = ACTION_STATS;
+        args->stats_file = argc == 3 ? argv[2] : NULL;
+    } else if (!strcmp(argv[1], "cache") && argc == 3 &&
+        !strcmp(argv[2], "build")) {
+
+        args->action = ACTION_CACHE_BUILD;
+    } else if (!strcmp(argv[1], "cache") && argc == 4 &&
+        (!strcmp(argv[2], "export") || !strcmp(argv[2], "import"))) {
+
+        args->action = !strcmp(argv[2], "export") ?
+            ACTION_CACHE_EXPORT : ACTION_CACHE_IMPORT;
+        args->bundle_file = argv[3];
     } else {
         ret = EINPUT;
         goto fail;
     }
 
-    free(shebang_argv);
+    /* Only actions which don't run anything make sense for another tree */
+    if (args->root != NULL && args->action != ACTION_LIST_COLLECTIONS &&
+        args->action != ACTION_LIST_PACKAGES &&
+        args->action != ACTION_CACHE_BUILD &&
+        args->action != ACTION_CACHE_EXPORT &&
+        args->action != ACTION_CACHE_IMPORT) {
+
+        debug("Option --root can be used only with list-collections, "
+            "list-packages and cache actions!\n\n");
+        scl_args_free(args);
+        ret = EINPUT;
+        goto fail;
+    }
+
+    shebang_argv = _free(shebang_argv);
     *_args = args;
 
     return EOK;
 
 fail:
-    free(args);
-    free(shebang_argv);
+    args = _free(args);
+    shebang_argv = _free(shebang_argv);
     return ret;
 }
@@ -14,6 +14,11 @@
 #define ACTION_UNLOAD 8
 #define ACTION_VERSION 9
 #define ACTION_LIST_ENABLED 10
+#define ACTION_ENV 11
+#define ACTION_STATS 12
+#define ACTION_CACHE_BUILD 13
+#define ACTION_CACHE_EXPORT 14
+#define ACTION_CACHE_IMPORT 15
 
 struct scl_args {
 	int action;
@@ -23,6 +28,10 @@ struct scl_args {
 
 	bool force_flag;    /* if set, the collection deregistration was forced */
     bool exec_flag;     /* if set, exec() is used insted of system() to run command */
+    int env_format;     /* ENV_FORMAT_* used to print the environment */
+    char *stats_file;   /* statistics log to summarize, NULL for SCL_STATS */
+    char *root;         /* tree to work with instead of /, NULL for / */
+    char *bundle_file;  /* cache bundle to export or import */
 };
 
 void scl_args_free(struct scl_args *args);
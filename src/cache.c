@@ -0,0 +1,1106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "errors.h"
+#include "debug.h"
+#include "sclmalloc.h"
+#include "lib_common.h"
+#include "modulefile.h"
+#include "cache.h"
+#include "sclconfig.h"
+
+/*
+ * Cache files live in cache_dir which is writable only by root, other
+ * users store their cache files to $XDG_RUNTIME_DIR/scl. Files are never
+ * modified in place, a new version is written to a temporary file which is
+ * then renamed over the old one. Readers therefore always see a complete
+ * file, no matter how many processes fill the cache at the same time.
+ *
+ * Caches built for a tree under another root (scl --root) are used after
+ * the tree is copied elsewhere, e.g. from an image to a container, where
+ * devices and inodes of files differ. Their ids are therefore portable,
+ * they keep only modification times in seconds and sizes of files.
+ */
+
+#define ENV_CACHE_MAGIC "SCLENV"
+#define ENV_CACHE_VERSION 1
+#define NO_VALUE UINT32_MAX
+
+#define EXEC_CACHE_MAGIC "SCLEXEC"
+#define EXEC_CACHE_VERSION 1
+
+#define BUNDLE_MAGIC "SCLBNDL"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN(len) (((size_t) (len) + 7) & ~(size_t) 7)
+
+#define CACHE_ID_DIR 0      /* directory of MODULEPATH, stat() */
+#define CACHE_ID_FILE 1     /* modulefile, stat() */
+#define CACHE_ID_LINK 2     /* modulefile, lstat() */
+
+/*
+ * Layout of the cache file: header, ids, ops and a pool of NUL-terminated
+ * strings. Offsets of strings are relative to the start of the pool.
+ */
+struct env_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t id_count;
+    uint32_t op_count;
+    uint32_t pool_len;
+    uint32_t modname_off;
+    uint32_t modulepath_off;
+};
+
+struct env_cache_id {
+    struct file_id id;
+    uint32_t path_off;
+    uint32_t type;
+};
+
+struct env_cache_op {
+    uint8_t type;
+    char delim;
+    uint16_t reserved;
+    uint32_t name_off;
+    uint32_t value_off;
+};
+
+/*
+ * Layout of the bundle file: header and entries. An entry is the content
+ * of an environment cache file preceded by its length and the hash of
+ * files of the collection. It is padded, so that the following entry is
+ * aligned as well.
+ */
+struct bundle_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_count;
+};
+
+struct bundle_entry {
+    uint64_t hash;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+/*
+ * Layout of the executable cache file: header, ids of directories of path,
+ * entries and a pool of names. An entry is valid while ids of directories
+ * up to its own one match, no executable of the same name could have
+ * appeared earlier in path then.
+ */
+struct exec_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t dir_count;
+    uint32_t entry_count;
+    uint32_t pool_len;
+    uint32_t path_off;
+    uint32_t reserved;
+};
+
+struct exec_cache_entry {
+    uint32_t name_off;
+    uint32_t dir;
+};
+
+struct exec_entry {
+    const char *name;
+    int dir;
+};
+
+static char *user_cache_dir()
+{
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    char *dir = NULL;
+
+    /* Cache of another tree belongs to the tree */
+    if (scl_config_get()->root[0] != '\0') {
+        return NULL;
+    }
+
+    /* Failed allocation leaves dir NULL, the cache is only an optimization */
+    if (runtime_dir != NULL && runtime_dir[0] == '/') {
+        xasprintf(&dir, "%s/scl", runtime_dir);
+    }
+    return dir;
+}
+
+bool cache_map(const char *name, cache_check check, void *arg, void **_map,
+    size_t *_len)
+{
+    char *dirs[2] = {(char *) scl_config_get()->cache_dir, NULL};
+    char *path = NULL;
+    void *map = NULL;
+    struct stat st;
+    int fd;
+
+    dirs[1] = user_cache_dir();
+
+    for (int i = 0; i < 2 && map == NULL; i++) {
+        if (dirs[i] == NULL ||
+            xasprintf(&path, "%s/%s", dirs[i], name) == -1) {
+
+            continue;
+        }
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        path = _free(path);
+        if (fd == -1) {
+            continue;
+        }
+
+        /* Don't trust files which other users could have tampered with */
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+            (st.st_uid == 0 || st.st_uid == getuid()) &&
+            !(st.st_mode & (S_IWGRP | S_IWOTH))) {
+
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED) {
+                map = NULL;
+            } else if (check != NULL && !check(map, st.st_size, arg)) {
+                munmap(map, st.st_size);
+                map = NULL;
+            } else {
+                *_len = st.st_size;
+            }
+        }
+        close(fd);
+    }
+    dirs[1] = _free(dirs[1]);
+
+    *_map = map;
+    return map != NULL;
+}
+
+bool cache_write(const char *name, const void *data, size_t len)
+{
+    const char *cache_dir = scl_config_get()->cache_dir;
+    char *dir = NULL, *tmp = NULL, *path = NULL;
+    bool written = false;
+    int fd;
+
+    if (access(cache_dir, W_OK) == 0) {
+        dir = xstrdup(cache_dir);
+        if (dir == NULL) {
+            return false;
+        }
+    } else {
+        dir = user_cache_dir();
+        if (dir == NULL) {
+            return false;
+        }
+        if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+            goto exit;
+        }
+    }
+
+    if (xasprintf(&path, "%s/%s", dir, name) == -1 ||
+        xasprintf(&tmp, "%s/.%s.XXXXXX", dir, name) == -1) {
+
+        goto exit;
+    }
+
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        goto exit;
+    }
+
+    if (!write_all(fd, data, len) || fchmod(fd, 0644) == -1) {
+        close(fd);
+        unlink(tmp);
+        goto exit;
+    }
+    close(fd);
+
+    if (rename(tmp, path) == -1) {
+        unlink(tmp);
+    } else {
+        written = true;
+    }
+
+exit:
+    dir = _free(dir);
+    tmp = _free(tmp);
+    path = _free(path);
+
+    return written;
+}
+
+scl_rc env_cache_key_init(struct env_cache_key *key, const char *modname,
+    const char *modulepath)
+{
+    struct arena arena = ARENA_INIT;
+    char *dirs = NULL, **parts = NULL;
+    const char *dir;
+    uint64_t hash;
+    int count;
+    scl_rc ret = EMEM;
+
+    memset(key, 0, sizeof(*key));
+    key->modname = xstrdup(modname);
+    key->modulepath = xstrdup(modulepath != NULL ? modulepath : "");
+    if (key->modname == NULL || key->modulepath == NULL) {
+        goto exit;
+    }
+
+    dirs = xstrdup(key->modulepath);
+    if (dirs == NULL || (parts = split(dirs, ':')) == NULL) {
+        goto exit;
+    }
+    count = string_array_len(parts);
+
+    key->dirs = xcalloc(count + 1, sizeof(*key->dirs));
+    key->dir_ids = xcalloc(count + 1, sizeof(*key->dir_ids));
+    if (key->dirs == NULL || key->dir_ids == NULL) {
+        goto exit;
+    }
+    for (int i = 0; i < count; i++) {
+        key->dirs[i] = xstrdup(parts[i]);
+        dir = root_path(&arena, parts[i]);
+        if (key->dirs[i] == NULL || dir == NULL) {
+            goto exit;
+        }
+        file_id_path(dir, true, &key->dir_ids[i]);
+    }
+
+    /* Module names may contain slashes */
+    hash = hash_bytes(modname, strlen(modname) + 1, HASH_INIT);
+    hash = hash_bytes(key->modulepath, strlen(key->modulepath), hash);
+    if (xasprintf(&key->name, "env-%s-%016llx", modname,
+        (unsigned long long) hash) == -1) {
+
+        goto exit;
+    }
+    for (char *c = key->name; *c != '\0'; c++) {
+        if (*c == '/') {
+            *c = '_';
+        }
+    }
+    ret = EOK;
+
+exit:
+    if (ret != EOK) {
+        env_cache_key_free(key);
+    }
+    parts = _free(parts);
+    dirs = _free(dirs);
+    arena_release(&arena);
+
+    return ret;
+}
+
+void env_cache_key_free(struct env_cache_key *key)
+{
+    key->modname = _free(key->modname);
+    key->modulepath = _free(key->modulepath);
+    key->name = _free(key->name);
+    key->dirs = free_string_array(key->dirs);
+    key->dir_ids = _free(key->dir_ids);
+}
+
+/*
+ * Copy string to pool, only its length is counted when pool is NULL.
+ */
+static uint32_t pool_add(char *pool, uint32_t *pool_len, const char *str)
+{
+    uint32_t off = *pool_len;
+    size_t len;
+
+    if (str == NULL) {
+        return NO_VALUE;
+    }
+
+    len = strlen(str) + 1;
+    if (pool != NULL) {
+        memcpy(pool + off, str, len);
+    }
+    *pool_len += len;
+
+    return off;
+}
+
+static uint32_t count_modules(const struct env_delta *delta)
+{
+    uint32_t count = 0;
+
+    for (int i = 0; i < delta->count; i++) {
+        if (delta->ops[i].type == ENV_OP_MODULE_BEGIN) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/*
+ * Keep only the parts of id which survive copying of the tree.
+ */
+static void make_portable(struct env_cache_id *id)
+{
+    id->id.dev = 0;
+    id->id.ino = 0;
+    id->id.mtime_nsec = 0;
+
+    /* Sizes of directories depend on the filesystem */
+    if (id->type == CACHE_ID_DIR) {
+        id->id.size = 0;
+    }
+}
+
+bool env_cache_encode(const struct env_cache_key *key,
+    const struct env_delta *delta, char **_data, size_t *_len)
+{
+    struct env_cache_header header;
+    struct env_cache_id *ids = NULL;
+    struct env_cache_op *ops = NULL;
+    char *data = NULL, *pool = NULL;
+    uint32_t pool_len;
+    int dir_count = string_array_len(key->dirs);
+    int id = 0;
+    size_t len = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ENV_CACHE_MAGIC, sizeof(ENV_CACHE_MAGIC));
+    header.version = ENV_CACHE_VERSION;
+    header.id_count = dir_count + 2 * count_modules(delta);
+    header.op_count = delta->count;
+
+    /* The first pass computes size of the pool, the second one fills it */
+    for (int pass = 0; pass < 2; pass++) {
+        pool_len = 0;
+        header.modname_off = pool_add(pool, &pool_len, key->modname);
+        header.modulepath_off = pool_add(pool, &pool_len, key->modulepath);
+        for (int i = 0; i < dir_count; i++) {
+            pool_add(pool, &pool_len, key->dirs[i]);
+        }
+        for (int i = 0; i < delta->count; i++) {
+            pool_add(pool, &pool_len, delta->ops[i].name);
+            pool_add(pool, &pool_len, delta->ops[i].value);
+        }
+
+        if (pass == 0) {
+            header.pool_len = pool_len;
+            len = sizeof(header) + header.id_count * sizeof(*ids) +
+                header.op_count * sizeof(*ops) + pool_len;
+            data = xcalloc(len, 1);
+            if (data == NULL) {
+                return false;
+            }
+            ids = (struct env_cache_id *) (data + sizeof(header));
+            ops = (struct env_cache_op *) (ids + header.id_count);
+            pool = (char *) (ops + header.op_count);
+        }
+    }
+    memcpy(data, &header, sizeof(header));
+
+    pool_len = 0;
+    pool_add(NULL, &pool_len, key->modname);
+    pool_add(NULL, &pool_len, key->modulepath);
+    for (int i = 0; i < dir_count; i++) {
+        ids[id].id = key->dir_ids[i];
+        ids[id].type = CACHE_ID_DIR;
+        ids[id++].path_off = pool_add(NULL, &pool_len, key->dirs[i]);
+    }
+
+    for (int i = 0; i < delta->count; i++) {
+        ops[i].type = delta->ops[i].type;
+        ops[i].delim = delta->ops[i].delim;
+        ops[i].name_off = pool_add(NULL, &pool_len, delta->ops[i].name);
+        ops[i].value_off = pool_add(NULL, &pool_len, delta->ops[i].value);
+
+        if (delta->ops[i].type == ENV_OP_MODULE_BEGIN) {
+            ids[id].id = delta->ops[i].id;
+            ids[id].type = CACHE_ID_FILE;
+            ids[id++].path_off = ops[i].value_off;
+            ids[id].id = delta->ops[i].link_id;
+            ids[id].type = CACHE_ID_LINK;
+            ids[id++].path_off = ops[i].value_off;
+        }
+    }
+
+    if (scl_config_get()->root[0] != '\0') {
+        for (id = 0; id < header.id_count; id++) {
+            make_portable(&ids[id]);
+        }
+    }
+
+    *_data = data;
+    *_len = len;
+
+    return true;
+}
+
+static bool check_id(const struct env_cache_key *key, const char *path,
+    const struct env_cache_id *id, int *dir)
+{
+    struct arena arena = ARENA_INIT;
+    struct env_cache_id current;
+
+    switch (id->type) {
+        case CACHE_ID_DIR:
+            /* Directories were examined when the key was created */
+            if (key->dirs[*dir] == NULL || strcmp(key->dirs[*dir], path)) {
+                return false;
+            }
+            current.id = key->dir_ids[(*dir)++];
+            break;
+        case CACHE_ID_FILE:
+        case CACHE_ID_LINK:
+            path = root_path(&arena, path);
+            if (path == NULL) {
+                return false;
+            }
+            file_id_path(path, id->type == CACHE_ID_FILE, &current.id);
+            arena_release(&arena);
+            break;
+        default:
+            return false;
+    }
+
+    /* Portable ids have neither device nor inode */
+    if (id->id.dev == 0 && id->id.ino == 0) {
+        current.type = id->type;
+        make_portable(&current);
+    }
+
+    return !memcmp(&current.id, &id->id, sizeof(current.id));
+}
+
+/*
+ * Check that data have the layout of a cache file and return its header,
+ * NULL if they don't.
+ */
+static const struct env_cache_header *env_cache_header(const char *data,
+    size_t len)
+{
+    const struct env_cache_header *header = (const void *) data;
+    const char *pool;
+
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, ENV_CACHE_MAGIC, sizeof(ENV_CACHE_MAGIC)) ||
+        header->version != ENV_CACHE_VERSION) {
+
+        return NULL;
+    }
+
+    if (len != sizeof(*header) +
+        (size_t) header->id_count * sizeof(struct env_cache_id) +
+        (size_t) header->op_count * sizeof(struct env_cache_op) +
+        header->pool_len || header->pool_len == 0) {
+
+        return NULL;
+    }
+
+    /* Terminated pool guarantees that every string ends inside the data */
+    pool = data + len - header->pool_len;
+    if (pool[header->pool_len - 1] != '\0' ||
+        header->modname_off >= header->pool_len ||
+        header->modulepath_off >= header->pool_len) {
+
+        return NULL;
+    }
+
+    return header;
+}
+
+bool env_cache_decode(const struct env_cache_key *key, const char *data,
+    size_t len, bool check_key, struct env_delta *delta)
+{
+    const struct env_cache_header *header;
+    const struct env_cache_id *ids;
+    const struct env_cache_op *ops;
+    const char *pool;
+    int dir = 0;
+
+    header = env_cache_header(data, len);
+    if (header == NULL) {
+        return false;
+    }
+
+    ids = (const struct env_cache_id *) (data + sizeof(*header));
+    ops = (const struct env_cache_op *) (ids + header->id_count);
+    pool = (const char *) (ops + header->op_count);
+
+    if (strcmp(pool + header->modname_off, key->modname) ||
+        strcmp(pool + header->modulepath_off, key->modulepath)) {
+
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->id_count; i++) {
+        if (ids[i].path_off >= header->pool_len) {
+            return false;
+        }
+        if (check_key && !check_id(key, pool + ids[i].path_off, &ids[i],
+            &dir)) {
+
+            return false;
+        }
+    }
+    if (check_key && key->dirs[dir] != NULL) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->op_count; i++) {
+        if (ops[i].name_off >= header->pool_len ||
+            (ops[i].value_off != NO_VALUE &&
+            ops[i].value_off >= header->pool_len)) {
+
+            return false;
+        }
+
+        /* env_delta_apply() relies on types and values of operations */
+        switch (ops[i].type) {
+            case ENV_OP_UNSET:
+                break;
+            case ENV_OP_PREPEND:
+            case ENV_OP_APPEND:
+                if (ops[i].delim == '\0') {
+                    return false;
+                }
+                /* fall through */
+            case ENV_OP_SET:
+            case ENV_OP_MODULE_BEGIN:
+            case ENV_OP_MODULE_END:
+                if (ops[i].value_off == NO_VALUE) {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    delta->ops = xcalloc(header->op_count + 1, sizeof(*delta->ops));
+    if (delta->ops == NULL) {
+        return false;
+    }
+    delta->count = delta->alloced = header->op_count;
+    for (uint32_t i = 0; i < header->op_count; i++) {
+        delta->ops[i].type = ops[i].type;
+        delta->ops[i].delim = ops[i].delim;
+        delta->ops[i].name = (char *) pool + ops[i].name_off;
+        delta->ops[i].value = ops[i].value_off == NO_VALUE ?
+            NULL : (char *) pool + ops[i].value_off;
+    }
+
+    return true;
+}
+
+struct env_lookup {
+    const struct env_cache_key *key;
+    struct env_delta *delta;
+};
+
+static bool env_cache_check(const void *map, size_t len, void *arg)
+{
+    struct env_lookup *lookup = arg;
+
+    return env_cache_decode(lookup->key, map, len, true, lookup->delta);
+}
+
+bool env_cache_load(const struct env_cache_key *key, struct env_delta *delta)
+{
+    struct env_lookup lookup = {key, delta};
+    void *map;
+    size_t len;
+
+    if (!cache_map(key->name, env_cache_check, &lookup, &map, &len)) {
+        return false;
+    }
+    delta->map = map;
+    delta->map_len = len;
+
+    return true;
+}
+
+bool env_cache_store(const struct env_cache_key *key,
+    const struct env_delta *delta)
+{
+    char *data = NULL;
+    size_t len;
+    bool written;
+
+    if (!env_cache_encode(key, delta, &data, &len)) {
+        return false;
+    }
+    written = cache_write(key->name, data, len);
+    data = _free(data);
+
+    return written;
+}
+
+static void bundle_header_init(struct bundle_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC));
+    header->version = BUNDLE_VERSION;
+}
+
+scl_rc cache_bundle_add(struct cache_bundle *bundle, uint64_t hash,
+    const struct env_cache_key *key, const struct env_delta *delta)
+{
+    struct bundle_entry entry;
+    char *data = NULL, *p;
+    size_t len, size, alloced;
+
+    if (!env_cache_encode(key, delta, &data, &len)) {
+        return EMEM;
+    }
+
+    size = sizeof(entry) + BUNDLE_ALIGN(len);
+    if (bundle->len == 0) {
+        size += sizeof(struct bundle_header);
+    }
+    if (bundle->len + size > bundle->alloced) {
+        /* The bundle is kept when the allocation fails */
+        alloced = (bundle->len + size) * 2;
+        p = xrealloc(bundle->data, alloced);
+        if (p == NULL) {
+            data = _free(data);
+            return EMEM;
+        }
+        bundle->data = p;
+        bundle->alloced = alloced;
+    }
+    if (bundle->len == 0) {
+        bundle_header_init((struct bundle_header *) bundle->data);
+        bundle->len = sizeof(struct bundle_header);
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.hash = hash;
+    entry.len = len;
+
+    p = bundle->data + bundle->len;
+    memcpy(p, &entry, sizeof(entry));
+    memcpy(p + sizeof(entry), data, len);
+    memset(p + sizeof(entry) + len, 0, BUNDLE_ALIGN(len) - len);
+    bundle->len += sizeof(entry) + BUNDLE_ALIGN(len);
+    ((struct bundle_header *) bundle->data)->entry_count++;
+
+    data = _free(data);
+
+    return EOK;
+}
+
+bool cache_bundle_write(const struct cache_bundle *bundle, const char *path)
+{
+    struct bundle_header header;
+    const void *data = bundle->data;
+    size_t len = bundle->len;
+    bool written;
+    int fd;
+
+    /* Bundle without any entry */
+    if (len == 0) {
+        bundle_header_init(&header);
+        data = &header;
+        len = sizeof(header);
+    }
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    written = write_all(fd, data, len);
+    if (close(fd) == -1) {
+        written = false;
+    }
+
+    return written;
+}
+
+scl_rc cache_bundle_open(struct cache_bundle *bundle, const char *path)
+{
+    const struct bundle_header *header;
+    const struct bundle_entry *entry;
+    struct stat st;
+    size_t len, pos;
+    bool valid = true;
+    void *map;
+    int fd;
+
+    memset(bundle, 0, sizeof(*bundle));
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        debug("Unable to open file %s: %s\n", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return EDISK;
+    }
+    if (!S_ISREG(st.st_mode) || (size_t) st.st_size < sizeof(*header)) {
+        debug("File %s is not a cache bundle!\n", path);
+        close(fd);
+        return EINPUT;
+    }
+
+    len = st.st_size;
+    map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        debug("Unable to read file %s: %s\n", path, strerror(errno));
+        return EDISK;
+    }
+
+    header = map;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(BUNDLE_MAGIC)) ||
+        header->version != BUNDLE_VERSION) {
+
+        debug("File %s is not a cache bundle of version %d!\n", path,
+            BUNDLE_VERSION);
+        munmap(map, len);
+        return EINPUT;
+    }
+
+    /* Lengths of entries are checked once, cache_bundle_next() trusts them */
+    pos = sizeof(*header);
+    for (uint32_t i = 0; i < header->entry_count && valid; i++) {
+        entry = (const void *) ((char *) map + pos);
+        valid = len - pos >= sizeof(*entry) &&
+            len - pos - sizeof(*entry) >= BUNDLE_ALIGN(entry->len);
+        if (valid) {
+            pos += sizeof(*entry) + BUNDLE_ALIGN(entry->len);
+        }
+    }
+    if (!valid || pos != len) {
+        debug("Cache bundle %s is truncated or corrupted!\n", path);
+        munmap(map, len);
+        return EINPUT;
+    }
+
+    bundle->data = bundle->map = map;
+    bundle->len = bundle->alloced = len;
+
+    return EOK;
+}
+
+scl_rc cache_bundle_next(const struct cache_bundle *bundle, size_t *pos,
+    struct cache_bundle_entry *entry, bool *_found)
+{
+    const struct env_cache_header *header;
+    const struct bundle_entry *e;
+    const char *data, *pool;
+
+    *_found = false;
+    if (*pos == 0) {
+        *pos = sizeof(struct bundle_header);
+    }
+
+    while (*pos < bundle->len) {
+        e = (const void *) (bundle->data + *pos);
+        data = (const char *) (e + 1);
+        *pos += sizeof(*e) + BUNDLE_ALIGN(e->len);
+
+        memset(entry, 0, sizeof(*entry));
+        header = env_cache_header(data, e->len);
+        if (header == NULL) {
+            debug("Skipping invalid entry of cache bundle.\n");
+            continue;
+        }
+
+        /* The entry is checked against files when it is imported */
+        pool = data + e->len - header->pool_len;
+        if (env_cache_key_init(&entry->key, pool + header->modname_off,
+            pool + header->modulepath_off) != EOK) {
+
+            return EMEM;
+        }
+        if (!env_cache_decode(&entry->key, data, e->len, false,
+            &entry->delta)) {
+
+            debug("Skipping invalid entry of cache bundle.\n");
+            env_cache_key_free(&entry->key);
+            continue;
+        }
+        entry->hash = e->hash;
+        *_found = true;
+
+        return EOK;
+    }
+
+    return EOK;
+}
+
+void cache_bundle_entry_free(struct cache_bundle_entry *entry)
+{
+    env_cache_key_free(&entry->key);
+
+    /* Names and values belong to the bundle */
+    entry->delta.ops = _free(entry->delta.ops);
+    entry->delta.count = entry->delta.alloced = 0;
+}
+
+void cache_bundle_free(struct cache_bundle *bundle)
+{
+    if (bundle->map != NULL) {
+        munmap(bundle->map, bundle->len);
+    } else {
+        bundle->data = _free(bundle->data);
+    }
+    memset(bundle, 0, sizeof(*bundle));
+}
+
+/*
+ * Read entries of the executable cache of path. Ids of directories are
+ * copied to ids, names of entries point into data.
+ */
+static int exec_cache_decode(const char *data, size_t len, const char *path,
+    int dir_count, struct file_id *ids, struct exec_entry **_entries)
+{
+    const struct exec_cache_header *header = (const void *) data;
+    const struct exec_cache_entry *entries;
+    const struct file_id *dir_ids;
+    const char *pool;
+
+    if (len < sizeof(*header) ||
+        memcmp(header->magic, EXEC_CACHE_MAGIC, sizeof(EXEC_CACHE_MAGIC)) ||
+        header->version != EXEC_CACHE_VERSION ||
+        header->dir_count != (uint32_t) dir_count) {
+
+        return 0;
+    }
+
+    if (len != sizeof(*header) + (size_t) dir_count * sizeof(*dir_ids) +
+        (size_t) header->entry_count * sizeof(*entries) + header->pool_len ||
+        header->pool_len == 0) {
+
+        return 0;
+    }
+
+    dir_ids = (const struct file_id *) (data + sizeof(*header));
+    entries = (const struct exec_cache_entry *) (dir_ids + dir_count);
+    pool = (const char *) (entries + header->entry_count);
+
+    if (pool[header->pool_len - 1] != '\0' ||
+        header->path_off >= header->pool_len ||
+        strcmp(pool + header->path_off, path)) {
+
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        if (entries[i].name_off >= header->pool_len ||
+            entries[i].dir >= header->dir_count) {
+
+            return 0;
+        }
+    }
+
+    memcpy(ids, dir_ids, dir_count * sizeof(*ids));
+    *_entries = xcalloc(header->entry_count + 1, sizeof(**_entries));
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        (*_entries)[i].name = pool + entries[i].name_off;
+        (*_entries)[i].dir = entries[i].dir;
+    }
+
+    return header->entry_count;
+}
+
+static void exec_cache_store(const char *cache_name, const char *path,
+    int dir_count, const struct file_id *ids,
+    const struct exec_entry *entries, int entry_count)
+{
+    struct exec_cache_header header;
+    struct exec_cache_entry *cache_entries;
+    char *data, *pool;
+    uint32_t pool_len = 0;
+    size_t len;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXEC_CACHE_MAGIC, sizeof(EXEC_CACHE_MAGIC));
+    header.version = EXEC_CACHE_VERSION;
+    header.dir_count = dir_count;
+    header.entry_count = entry_count;
+
+    pool_add(NULL, &pool_len, path);
+    for (int i = 0; i < entry_count; i++) {
+        pool_add(NULL, &pool_len, entries[i].name);
+    }
+    header.pool_len = pool_len;
+
+    len = sizeof(header) + dir_count * sizeof(*ids) +
+        entry_count * sizeof(*cache_entries) + pool_len;
+    data = xcalloc(len, 1);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), ids, dir_count * sizeof(*ids));
+    cache_entries = (struct exec_cache_entry *) (data + sizeof(header) +
+        dir_count * sizeof(*ids));
+    pool = (char *) (cache_entries + entry_count);
+
+    pool_len = 0;
+    header.path_off = pool_add(pool, &pool_len, path);
+    memcpy(data, &header, sizeof(header));
+    for (int i = 0; i < entry_count; i++) {
+        cache_entries[i].name_off = pool_add(pool, &pool_len, entries[i].name);
+        cache_entries[i].dir = entries[i].dir;
+    }
+
+    cache_write(cache_name, data, len);
+    data = _free(data);
+}
+
+/*
+ * State of a lookup of name in executable caches of path. Directories are
+ * examined only once, current holds ids of the first checked ones.
+ */
+struct exec_lookup {
+    const char *path;
+    const char *name;
+    char **dirs;
+    int dir_count;
+    struct file_id *ids;
+    struct file_id *current;
+    int checked;
+    char *file;
+};
+
+/*
+ * Accept cache file which has a valid entry of the name.
+ */
+static bool exec_cache_check(const void *map, size_t len, void *arg)
+{
+    struct exec_lookup *lookup = arg;
+    struct exec_entry *entries = NULL;
+    int entry_count, dir;
+
+    entry_count = exec_cache_decode(map, len, lookup->path,
+        lookup->dir_count, lookup->ids, &entries);
+
+    for (int i = 0; i < entry_count; i++) {
+        if (strcmp(entries[i].name, lookup->name)) {
+            continue;
+        }
+        for (dir = 0; dir <= entries[i].dir; dir++) {
+            if (dir == lookup->checked) {
+                file_id_path(lookup->dirs[dir], true, &lookup->current[dir]);
+                lookup->checked++;
+            }
+            if (memcmp(&lookup->current[dir], &lookup->ids[dir],
+                sizeof(*lookup->ids))) {
+
+                break;
+            }
+        }
+        if (dir > entries[i].dir) {
+            xasprintf(&lookup->file, "%s/%s", lookup->dirs[entries[i].dir],
+                lookup->name);
+        }
+        break;
+    }
+    entries = _free(entries);
+
+    return lookup->file != NULL;
+}
+
+char *exec_cache_resolve(const char *path, const char *name)
+{
+    char *copy = NULL, **dirs = NULL, *cache_name = NULL, *file = NULL;
+    struct file_id *ids = NULL, *current = NULL;
+    struct exec_entry *entries = NULL;
+    struct exec_lookup lookup;
+    int dir_count, entry_count = 0, checked, found = -1, changed;
+    const char *item, *end;
+    void *map = NULL;
+    size_t len = 0;
+    struct stat st;
+
+    if (path == NULL || strchr(name, '/') != NULL) {
+        return NULL;
+    }
+
+    /* Meaning of empty and relative items depends on working directory */
+    for (item = path; item != NULL; item = *end ? end + 1 : NULL) {
+        end = strchrnul(item, ':');
+        if (item[0] != '/') {
+            return NULL;
+        }
+    }
+
+    copy = xstrdup(path);
+    dirs = split(copy, ':');
+    dir_count = string_array_len(dirs);
+    ids = xcalloc(dir_count + 1, sizeof(*ids));
+    current = xcalloc(dir_count + 1, sizeof(*current));
+
+    xasprintf(&cache_name, "exec-%016llx",
+        (unsigned long long) hash_bytes(path, strlen(path), HASH_INIT));
+    lookup = (struct exec_lookup) {path, name, dirs, dir_count, ids, current,
+        0, NULL};
+    if (cache_map(cache_name, exec_cache_check, &lookup, &map, &len)) {
+        file = lookup.file;
+        goto exit;
+    }
+    checked = lookup.checked;
+
+    /* No file has a valid entry, the first one is updated with a new one */
+    if (cache_map(cache_name, NULL, NULL, &map, &len)) {
+        entry_count = exec_cache_decode(map, len, path, dir_count, ids,
+            &entries);
+    }
+    for (int i = 0; i < entry_count; i++) {
+        if (!strcmp(entries[i].name, name)) {
+            entries[i] = entries[--entry_count];
+            break;
+        }
+    }
+
+    for (int i = 0; i < dir_count && found == -1; i++) {
+        if (i >= checked) {
+            file_id_path(dirs[i], true, &current[i]);
+            checked++;
+        }
+        xasprintf(&file, "%s/%s", dirs[i], name);
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(file, X_OK) == 0) {
+
+            found = i;
+        } else {
+            file = _free(file);
+        }
+    }
+
+    if (found == -1) {
+        goto exit;
+    }
+
+    /* Entries behind the first changed directory can't be trusted anymore */
+    for (changed = 0; changed < checked; changed++) {
+        if (memcmp(&current[changed], &ids[changed], sizeof(*ids))) {
+            break;
+        }
+    }
+    for (int i = 0; i < entry_count; i++) {
+        if (entries[i].dir >= changed) {
+            entries[i--] = entries[--entry_count];
+        }
+    }
+    memcpy(ids, current, checked * sizeof(*ids));
+
+    entries = xrealloc(entries, (entry_count + 1) * sizeof(*entries));
+    entries[entry_count].name = name;
+    entries[entry_count++].dir = found;
+    exec_cache_store(cache_name, path, dir_count, ids, entries, entry_count);
+
+exit:
+    if (map != NULL) {
+        munmap(map, len);
+    }
+    entries = _free(entries);
+    ids = _free(ids);
+    current = _free(current);
+    cache_name = _free(cache_name);
+    dirs = _free(dirs);
+    copy = _free(copy);
+
+    return file;
+}
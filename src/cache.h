@@ -0,0 +1,155 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "errors.h"
+#include "lib_common.h"
+#include "modulefile.h"
+
+/*
+ * Identifies cached environment delta of a module. Directories of
+ * MODULEPATH are part of the key because a new modulefile in any of them
+ * can change which modulefile is loaded.
+ */
+struct env_cache_key {
+    char *modname;
+    char *modulepath;
+    char *name;             /* name of the cache file */
+    char **dirs;            /* directories listed in modulepath */
+    struct file_id *dir_ids;
+};
+
+typedef bool (*cache_check)(const void *map, size_t len, void *arg);
+
+/*
+ * Map cache file into memory. Only files owned by root or by the current
+ * user are accepted. The file in cache_dir is tried first, the user's one
+ * when check rejects it, so that a stale file of root doesn't hide a valid
+ * file of the user.
+ * @param[in] name          Name of the cache file.
+ * @param[in] check         Function accepting the content, NULL to accept
+ *                          any file.
+ * @param[in] arg           Argument passed to check.
+ * @param[out] _map         Mapped content of the file.
+ * @param[out] _len         Length of the mapping.
+ * @return                  true if an accepted file was found
+ */
+bool cache_map(const char *name, cache_check check, void *arg, void **_map,
+    size_t *_len);
+
+/*
+ * Atomically replace cache file. Failures are usually ignored, the cache
+ * is only an optimization.
+ * @param[in] name          Name of the cache file.
+ * @param[in] data          New content of the file.
+ * @param[in] len           Length of the content.
+ * @return                  true if the file was written
+ */
+bool cache_write(const char *name, const void *data, size_t len);
+
+/*
+ * Create key of module modname. It has to be created before the module is
+ * evaluated. Directories of modulepath are inside the root.
+ */
+scl_rc env_cache_key_init(struct env_cache_key *key, const char *modname,
+    const char *modulepath);
+void env_cache_key_free(struct env_cache_key *key);
+
+/*
+ * Load delta of module from cache. The delta must be released by
+ * env_delta_free().
+ * @return                  true if valid delta was found
+ */
+bool env_cache_load(const struct env_cache_key *key, struct env_delta *delta);
+
+/*
+ * Store delta returned by modulefile_eval() to cache.
+ * @return                  true if the delta was stored
+ */
+bool env_cache_store(const struct env_cache_key *key,
+    const struct env_delta *delta);
+
+/*
+ * Serialize delta into the binary format of cache files.
+ * @return                  false if an allocation failed
+ */
+bool env_cache_encode(const struct env_cache_key *key,
+    const struct env_delta *delta, char **_data, size_t *_len);
+
+/*
+ * Decode delta of module from binary data created by env_cache_encode().
+ * Names and values of operations point into data. When check_key is set,
+ * the data are accepted only if they still match files on disk.
+ * @return                  true if the data are valid
+ */
+bool env_cache_decode(const struct env_cache_key *key, const char *data,
+    size_t len, bool check_key, struct env_delta *delta);
+
+/*
+ * Environment deltas of collections written to one file, so that they can
+ * be computed once and copied to other hosts with the same collections.
+ * Every delta is stored together with a hash of contents of files it was
+ * computed from.
+ */
+struct cache_bundle {
+    char *data;
+    size_t len;
+    size_t alloced;
+    void *map;              /* mapped bundle file which data points to */
+};
+
+struct cache_bundle_entry {
+    uint64_t hash;              /* hash of files of the collection */
+    struct env_cache_key key;   /* key of the delta on this host */
+    struct env_delta delta;     /* names and values point into the bundle */
+};
+
+/*
+ * Append delta of module key->modname to bundle.
+ * @return                  EOK or EMEM, the bundle is unchanged then
+ */
+scl_rc cache_bundle_add(struct cache_bundle *bundle, uint64_t hash,
+    const struct env_cache_key *key, const struct env_delta *delta);
+
+/*
+ * Write bundle to file path.
+ * @return                  true if the file was written
+ */
+bool cache_bundle_write(const struct cache_bundle *bundle, const char *path);
+
+/*
+ * Map bundle file written by cache_bundle_write(). The bundle must be
+ * released by cache_bundle_free().
+ * @return                  EOK, EDISK if the file can't be read or EINPUT
+ *                          if it isn't a bundle of this version
+ */
+scl_rc cache_bundle_open(struct cache_bundle *bundle, const char *path);
+
+/*
+ * Get next entry of bundle, pos has to be 0 for the first one. Entries
+ * which can't be decoded, e.g. with unknown operations, are skipped. Key
+ * of the entry is created for the host, it must be released by
+ * cache_bundle_entry_free().
+ * @param[out] _found       false if there are no more entries
+ * @return                  EOK or EMEM
+ */
+scl_rc cache_bundle_next(const struct cache_bundle *bundle, size_t *pos,
+    struct cache_bundle_entry *entry, bool *_found);
+
+void cache_bundle_entry_free(struct cache_bundle_entry *entry);
+void cache_bundle_free(struct cache_bundle *bundle);
+
+/*
+ * Find executable name in directories listed in path like execvp() does.
+ * Results are cached per path, a cached result is used as long as its
+ * directory and all directories preceding it in path are unchanged.
+ * @param[in] path          Colon separated list of directories.
+ * @param[in] name          Name of the executable.
+ * @return                  Path of the executable which must be freed or
+ *                          NULL if it can't be resolved by the cache.
+ */
+char *exec_cache_resolve(const char *path, const char *name);
+
+#endif
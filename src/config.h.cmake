@@ -5,6 +5,10 @@
 #define SCL_MODULES_PATH "@MODULES_PATH@"
 #define MODULE_CMD "@MODULE_CMD@"
 #define SCL_CONF_DIR "@CONF_DIR@"
+#define SCL_CACHE_DIR "@CACHE_DIR@"
+#define SCLD_SOCKET "@SCLD_SOCKET@"
+#define SCL_CONFIG_FILE "@CONFIG_FILE@"
 #define SCL_VERSION "@scl_VERSION@"
+#cmakedefine HAVE_SYS_SDT_H
 
 #endif
@@ -0,0 +1,464 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "sclmalloc.h"
+#include "lib_common.h"
+#include "envbuilder.h"
+
+static int find_slot(const struct env_builder *env, const char *name,
+    int name_len)
+{
+    int slot;
+    struct env_entry *e;
+
+    slot = hash_bytes(name, name_len, HASH_INIT) & (env->table_size - 1);
+    while (env->table[slot] != -1) {
+        e = &env->entries[env->table[slot]];
+        if (e->name_len == name_len && !memcmp(e->var, name, name_len)) {
+            break;
+        }
+        slot = (slot + 1) & (env->table_size - 1);
+    }
+
+    return slot;
+}
+
+static void rehash(struct env_builder *env, int table_size)
+{
+    int *table, slot;
+
+    /* The current table stays usable if the new one can't be allocated */
+    table = xmalloc(table_size * sizeof(*table));
+    if (table == NULL) {
+        env->failed = true;
+        return;
+    }
+    memset(table, -1, table_size * sizeof(*table));
+    env->table = _free(env->table);
+    env->table = table;
+    env->table_size = table_size;
+
+    for (int i = 0; i < env->count; i++) {
+        slot = find_slot(env, env->entries[i].var, env->entries[i].name_len);
+        env->table[slot] = i;
+    }
+}
+
+/*
+ * Store var of length name_len to the builder, var is owned by the builder
+ * from now on. NULL var means that its allocation failed.
+ */
+static void store(struct env_builder *env, char *var, int name_len,
+    bool unset)
+{
+    struct env_entry *e, *entries;
+    int slot, alloced;
+
+    if (var == NULL) {
+        env->failed = true;
+    }
+    if (env->failed) {
+        var = _free(var);
+        return;
+    }
+
+    slot = find_slot(env, var, name_len);
+    if (env->table[slot] != -1) {
+        e = &env->entries[env->table[slot]];
+        e->var = _free(e->var);
+    } else {
+        if (env->count == env->alloced) {
+            alloced = env->alloced ? env->alloced << 1 : 64;
+            entries = xrealloc(env->entries, alloced * sizeof(*entries));
+            if (entries == NULL) {
+                env->failed = true;
+                var = _free(var);
+                return;
+            }
+            env->entries = entries;
+            env->alloced = alloced;
+        }
+        env->table[slot] = env->count;
+        e = &env->entries[env->count++];
+    }
+
+    e->var = var;
+    e->name_len = name_len;
+    e->unset = unset;
+    env->envp_valid = false;
+
+    /* Keep the load factor under one half */
+    if (env->count * 2 > env->table_size) {
+        rehash(env, env->table_size << 1);
+    }
+}
+
+void env_builder_init(struct env_builder *env, char *const base[])
+{
+    const char *eq;
+
+    memset(env, 0, sizeof(*env));
+    rehash(env, 256);
+
+    for (int i = 0; base != NULL && base[i] != NULL; i++) {
+        eq = strchr(base[i], '=');
+        if (eq != NULL) {
+            store(env, xstrdup(base[i]), eq - base[i], false);
+        }
+    }
+}
+
+void env_builder_free(struct env_builder *env)
+{
+    for (int i = 0; i < env->count; i++) {
+        env->entries[i].var = _free(env->entries[i].var);
+    }
+    env->entries = _free(env->entries);
+    env->table = _free(env->table);
+    env->envp = _free(env->envp);
+    env->count = env->alloced = env->table_size = 0;
+}
+
+const char *env_builder_get(const struct env_builder *env, const char *name)
+{
+    int name_len = strlen(name);
+    struct env_entry *e;
+    int slot;
+
+    /* The table is missing only if the builder failed right away */
+    if (env->table == NULL) {
+        return NULL;
+    }
+
+    slot = find_slot(env, name, name_len);
+    if (env->table[slot] == -1) {
+        return NULL;
+    }
+
+    e = &env->entries[env->table[slot]];
+    return e->unset ? NULL : e->var + name_len + 1;
+}
+
+void env_builder_set(struct env_builder *env, const char *name,
+    const char *value)
+{
+    char *var;
+
+    if (value != NULL) {
+        xasprintf(&var, "%s=%s", name, value);
+    } else {
+        var = xstrdup(name);
+    }
+    store(env, var, strlen(name), value == NULL);
+}
+
+void env_builder_put(struct env_builder *env, const char *var)
+{
+    const char *eq = strchr(var, '=');
+
+    if (eq != NULL) {
+        store(env, xstrdup(var), eq - var, false);
+    } else {
+        store(env, xstrdup(var), strlen(var), true);
+    }
+}
+
+char *const *env_builder_envp(struct env_builder *env)
+{
+    char **envp;
+    int count = 0;
+
+    if (env->failed) {
+        return NULL;
+    }
+
+    if (!env->envp_valid) {
+        envp = xrealloc(env->envp, (env->count + 1) * sizeof(*envp));
+        if (envp == NULL) {
+            env->failed = true;
+            return NULL;
+        }
+        env->envp = envp;
+        for (int i = 0; i < env->count; i++) {
+            if (!env->entries[i].unset) {
+                env->envp[count++] = env->entries[i].var;
+            }
+        }
+        env->envp[count] = NULL;
+        env->envp_valid = true;
+    }
+
+    return env->envp;
+}
+
+struct path_item {
+    const char *dir;
+    int len;
+    int exists;
+};
+
+static int cmp_path_items(const void *p1, const void *p2)
+{
+    const struct path_item *i1 = p1, *i2 = p2;
+    int ret;
+
+    ret = memcmp(i1->dir, i2->dir, i1->len < i2->len ? i1->len : i2->len);
+    return ret ? ret : i1->len - i2->len;
+}
+
+/*
+ * Iterate over items of colon separated list, len is set to the length
+ * of item and end points behind it.
+ */
+#define FOR_EACH_ITEM(list, item, len, end) \
+    for (item = list; item != NULL; item = *end ? end + 1 : NULL) \
+        if ((end = strchrnul(item, ':')), (len = end - item), 1)
+
+void env_builder_compact_paths(struct env_builder *env,
+    const char *const names[], struct env_compact_stats *stats)
+{
+    struct path_item *items = NULL, *new_items, *found, *seen = NULL;
+    int item_count = 0, alloced = 0, seen_count, unique = 0, name_count = 0;
+    const char *value, *item, *end;
+    char **compacted_values = NULL, *compacted, *dir;
+    int len, compacted_len, kept;
+    struct stat st;
+
+    memset(stats, 0, sizeof(*stats));
+    if (env->failed) {
+        return;
+    }
+
+    /* Collect absolute directories of all variables */
+    for (int i = 0; names[i] != NULL; i++) {
+        value = env_builder_get(env, names[i]);
+        if (value == NULL) {
+            continue;
+        }
+        FOR_EACH_ITEM(value, item, len, end) {
+            if (len == 0 || item[0] != '/') {
+                continue;
+            }
+            if (item_count == alloced) {
+                alloced = alloced ? alloced << 1 : 64;
+                new_items = xrealloc(items, alloced * sizeof(*items));
+                if (new_items == NULL) {
+                    env->failed = true;
+                    goto exit;
+                }
+                items = new_items;
+            }
+            items[item_count].dir = item;
+            items[item_count].len = len;
+            items[item_count++].exists = 1;
+        }
+    }
+
+    if (item_count == 0) {
+        return;
+    }
+
+    /* Check existence of every directory only once */
+    qsort(items, item_count, sizeof(*items), cmp_path_items);
+    for (int i = 0; i < item_count; i++) {
+        if (unique > 0 && !cmp_path_items(&items[unique - 1], &items[i])) {
+            continue;
+        }
+        items[unique] = items[i];
+        dir = xstrndup(items[unique].dir, items[unique].len);
+        if (dir == NULL) {
+            env->failed = true;
+            goto exit;
+        }
+        if (stat(dir, &st) == -1 && (errno == ENOENT || errno == ENOTDIR)) {
+            items[unique].exists = 0;
+        }
+        dir = _free(dir);
+        unique++;
+    }
+
+    /*
+     * Items point into the current values, so the compacted values are set
+     * only after all variables are scanned.
+     */
+    while (names[name_count] != NULL) {
+        name_count++;
+    }
+    compacted_values = xcalloc(name_count, sizeof(*compacted_values));
+    seen = xmalloc(unique * sizeof(*seen));
+    if (compacted_values == NULL || seen == NULL) {
+        env->failed = true;
+        goto exit;
+    }
+
+    for (int i = 0; names[i] != NULL; i++) {
+        value = env_builder_get(env, names[i]);
+        if (value == NULL) {
+            continue;
+        }
+
+        compacted = xmalloc(strlen(value) + 1);
+        if (compacted == NULL) {
+            env->failed = true;
+            goto exit;
+        }
+        compacted_len = kept = 0;
+        seen_count = 0;
+
+        FOR_EACH_ITEM(value, item, len, end) {
+            if (len > 0 && item[0] == '/') {
+                struct path_item key = {item, len, 1};
+
+                found = bsearch(&key, items, unique, sizeof(*items),
+                    cmp_path_items);
+                if (found != NULL && !found->exists) {
+                    stats->missing++;
+                    continue;
+                }
+
+                /* Variables are short, linear search is good enough */
+                for (int i2 = 0; i2 < seen_count && found != NULL; i2++) {
+                    if (!cmp_path_items(&seen[i2], &key)) {
+                        found = NULL;
+                    }
+                }
+                if (found == NULL) {
+                    stats->duplicates++;
+                    continue;
+                }
+                seen[seen_count++] = key;
+            }
+
+            if (kept++ > 0) {
+                compacted[compacted_len++] = ':';
+            }
+            memcpy(compacted + compacted_len, item, len);
+            compacted_len += len;
+        }
+        compacted[compacted_len] = '\0';
+
+        if (compacted_len != (int) strlen(value)) {
+            stats->vars++;
+            stats->bytes += strlen(value) - compacted_len;
+            compacted_values[i] = compacted;
+        } else {
+            compacted = _free(compacted);
+        }
+    }
+
+    for (int i = 0; i < name_count; i++) {
+        if (compacted_values[i] != NULL) {
+            env_builder_set(env, names[i], compacted_values[i]);
+        }
+    }
+
+exit:
+    for (int i = 0; compacted_values != NULL && i < name_count; i++) {
+        compacted_values[i] = _free(compacted_values[i]);
+    }
+    compacted_values = _free(compacted_values);
+    seen = _free(seen);
+    items = _free(items);
+}
+
+void env_parser_init(struct env_parser *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+}
+
+static void end_statement(struct env_parser *parser)
+{
+    size_t len = parser->len - parser->spaces;
+    char **vars;
+    int alloced;
+
+    /* Statements other than assignments, e. g. export, are ignored */
+    if (len > 0 && memchr(parser->stmt, '=', len) != NULL) {
+        if (parser->count == parser->alloced_vars) {
+            alloced = parser->alloced_vars ? parser->alloced_vars << 1 : 32;
+            vars = xrealloc(parser->vars, alloced * sizeof(*vars));
+            if (vars == NULL) {
+                parser->failed = true;
+                return;
+            }
+            parser->vars = vars;
+            parser->alloced_vars = alloced;
+        }
+        parser->vars[parser->count] = arena_strndup(&parser->arena,
+            parser->stmt, len);
+        if (parser->vars[parser->count] == NULL) {
+            parser->failed = true;
+            return;
+        }
+        parser->count++;
+    }
+    parser->len = parser->spaces = 0;
+}
+
+void env_parser_feed(struct env_parser *parser, const char *data, size_t len)
+{
+    size_t alloced;
+    char *stmt;
+    char c;
+
+    for (size_t i = 0; i < len && !parser->failed; i++) {
+        c = data[i];
+
+        if (!parser->escape) {
+            if (c == '\\') {
+                parser->escape = true;
+                continue;
+            }
+            if (c == ';' || c == '\n') {
+                end_statement(parser);
+                continue;
+            }
+            if (c == ' ' && parser->len == 0) {
+                continue;
+            }
+        }
+
+        if (parser->len == parser->alloced) {
+            alloced = parser->alloced ? parser->alloced << 1 : 256;
+            stmt = xrealloc(parser->stmt, alloced);
+            if (stmt == NULL) {
+                parser->failed = true;
+                return;
+            }
+            parser->stmt = stmt;
+            parser->alloced = alloced;
+        }
+        parser->stmt[parser->len++] = c;
+        parser->spaces = c == ' ' && !parser->escape ? parser->spaces + 1 : 0;
+        parser->escape = false;
+    }
+}
+
+void env_parser_apply(struct env_parser *parser, struct env_builder *env)
+{
+    /* Backslash at the very end escapes nothing */
+    parser->escape = false;
+    if (!parser->failed) {
+        end_statement(parser);
+    }
+    if (parser->failed) {
+        return;
+    }
+
+    for (int i = 0; i < parser->count; i++) {
+        env_builder_put(env, parser->vars[i]);
+    }
+    parser->count = 0;
+}
+
+void env_parser_free(struct env_parser *parser)
+{
+    parser->stmt = _free(parser->stmt);
+    parser->vars = _free(parser->vars);
+    arena_release(&parser->arena);
+    parser->len = parser->alloced = parser->spaces = 0;
+    parser->count = parser->alloced_vars = 0;
+}
@@ -0,0 +1,108 @@
+#ifndef __ENVBUILDER_H__
+#define __ENVBUILDER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "sclmalloc.h"
+
+struct env_entry {
+    char *var;          /* "NAME=value" */
+    int name_len;
+    bool unset;         /* variable was removed, var keeps the name */
+};
+
+/*
+ * Environment of a program being prepared. Variables are looked up through
+ * a hash table indexed by variable name, the order of variables is kept.
+ * When an allocation fails, failed is set and all following changes are
+ * ignored, so callers check it only once they are done.
+ */
+struct env_builder {
+    struct env_entry *entries;
+    int count;
+    int alloced;
+    int *table;         /* indexes to entries, -1 for empty slot */
+    int table_size;
+    char **envp;        /* NULL-terminated array returned by env_builder_envp() */
+    bool envp_valid;
+    bool failed;        /* an allocation failed, the environment is incomplete */
+};
+
+/*
+ * Statistics of env_builder_compact_paths().
+ */
+struct env_compact_stats {
+    int vars;           /* number of changed variables */
+    int duplicates;     /* removed duplicate items */
+    int missing;        /* removed nonexistent directories */
+    int bytes;          /* number of bytes saved */
+};
+
+/*
+ * Initialize builder with copy of environment base.
+ */
+void env_builder_init(struct env_builder *env, char *const base[]);
+void env_builder_free(struct env_builder *env);
+
+/*
+ * Return value of variable name or NULL if it isn't set.
+ */
+const char *env_builder_get(const struct env_builder *env, const char *name);
+
+/*
+ * Set variable name to value, NULL value unsets the variable.
+ */
+void env_builder_set(struct env_builder *env, const char *name,
+    const char *value);
+
+/*
+ * Set variable from "NAME=value" string, string without "=" unsets
+ * variable NAME.
+ */
+void env_builder_put(struct env_builder *env, const char *var);
+
+/*
+ * Remove duplicate items and nonexistent directories from colon separated
+ * variables listed in names. The first occurrence of an item wins, empty
+ * and relative items are kept untouched.
+ */
+void env_builder_compact_paths(struct env_builder *env,
+    const char *const names[], struct env_compact_stats *stats);
+
+/*
+ * Return NULL-terminated environment suitable for execve(). It is valid
+ * until the builder is changed or released. Returns NULL if the builder
+ * failed.
+ */
+char *const *env_builder_envp(struct env_builder *env);
+
+/*
+ * Incremental parser of "sh" output of modulecmd, it can be fed by chunks
+ * split at any byte. Statements are separated by ';' or newline, backslash
+ * escapes the next character. Only assignments are kept, they are added
+ * to a builder by env_parser_apply() once the whole output was read.
+ */
+struct env_parser {
+    char *stmt;         /* current statement, escapes removed */
+    size_t len;
+    size_t alloced;
+    size_t spaces;      /* unescaped spaces at the end of stmt */
+    bool escape;        /* previous character was backslash */
+    char **vars;        /* "NAME=value" strings allocated from arena */
+    int count;
+    int alloced_vars;
+    struct arena arena;
+    bool failed;        /* an allocation failed, the rest is ignored */
+};
+
+void env_parser_init(struct env_parser *parser);
+void env_parser_feed(struct env_parser *parser, const char *data, size_t len);
+
+/*
+ * Finish the last statement and set its variables in env. Nothing is set
+ * if the parser failed.
+ */
+void env_parser_apply(struct env_parser *parser, struct env_builder *env);
+void env_parser_free(struct env_parser *parser);
+
+#endif
@@ -10,65 +10,80 @@
 
 #include "scllib.h"
 #include "sclmalloc.h"
-#include "config.h"
 #include "errors.h"
 #include "debug.h"
 #include "lib_common.h"
+#include "envbuilder.h"
+#include "fallback.h"
+#include "trace.h"
+#include "stats.h"
+#include "probes.h"
+#include "sclconfig.h"
 
 bool has_old_collection(char * const colnames[])
 {
-    char *module_file_link = NULL;
+    struct arena arena = ARENA_INIT;
+    bool ret = false;
 
     while (*colnames != NULL) {
-        xasprintf(&module_file_link, SCL_MODULES_PATH "/%s", *colnames);
-        if (access(module_file_link, F_OK)) {
-            module_file_link = _free(module_file_link);
-            return true;
+        if (access(modulefile_path(&arena, *colnames), F_OK)) {
+
+            ret = true;
+            break;
         }
-        module_file_link = _free(module_file_link);
         colnames++;
     }
-    return false;
+    arena_release(&arena);
+
+    return ret;
 }
 
-scl_rc fallback_get_enabled_collections(char ***_enabled_collections)
+scl_rc fallback_get_enabled_collections(struct arena *arena,
+    char ***_enabled_collections)
 {
     char **enabled_collections = NULL;
-    char *X_SCLS = getenv("X_SCLS");
+    const char *X_SCLS = getenv("X_SCLS");
+    struct tokenizer tok;
+    struct strview scl;
+    int i = 0;
 
     if (X_SCLS != NULL) {
-        X_SCLS = xstrdup(X_SCLS);
-        enabled_collections = split(X_SCLS, ' ');
+        enabled_collections = arena_alloc(arena,
+            (count_words(X_SCLS, ' ') + 1) * sizeof(*enabled_collections));
+        tokenizer_init(&tok, X_SCLS, strlen(X_SCLS), ' ');
 
-        for (int i = 0; enabled_collections[i] != NULL; i++) {
-            enabled_collections[i] = xstrdup(enabled_collections[i]);
+        while (tokenizer_next(&tok, &scl)) {
+            enabled_collections[i++] = arena_strndup(arena, scl.str, scl.len);
         }
+        enabled_collections[i] = NULL;
     }
-    X_SCLS = _free(X_SCLS);
     *_enabled_collections = enabled_collections;
 
     return EOK;
 }
 
-bool fallback_is_collection_enabled(const char *colname)
+bool fallback_is_collection_enabled_in(const char *x_scls, const char *colname)
 {
-    bool ret = false;
-    char **enabled_collections = NULL;
+    struct tokenizer tok;
+    struct strview scl;
 
-    ret = fallback_get_enabled_collections(&enabled_collections);
+    if (x_scls == NULL) {
+        return false;
+    }
 
-    if (ret == EOK && enabled_collections != NULL) {
-        for (int i = 0; enabled_collections[i] != NULL; i++) {
-            if (!strcmp(enabled_collections[i], colname)) {
-                ret = true;
-                break;
-            }
+    tokenizer_init(&tok, x_scls, strlen(x_scls), ' ');
+    while (tokenizer_next(&tok, &scl)) {
+        if (strview_equal(scl, colname)) {
+            return true;
         }
-
     }
-    enabled_collections = free_string_array(enabled_collections);
 
-    return ret;
+    return false;
+}
+
+bool fallback_is_collection_enabled(const char *colname)
+{
+    return fallback_is_collection_enabled_in(getenv("X_SCLS"), colname);
 }
 
 /*
@@ -76,24 +91,24 @@ bool fallback_is_collection_enabled(const char *colname)
  */
 scl_rc fallback_collection_exists(const char *colname, bool *_exists)
 {
+    struct arena arena = ARENA_INIT;
     char *col_path = NULL;
-    char *conf_file = NULL;
     scl_rc ret = EOK;
 
-    xasprintf(&conf_file, SCL_CONF_DIR "/%s", colname);
-    *_exists = !access(conf_file, F_OK);
+    *_exists = !access(conf_file_path(&arena, colname), F_OK);
 
     if (*_exists) {
         ret = get_collection_path(colname, &col_path);
         if (ret != EOK) {
+            arena_release(&arena);
             return ret;
         }
 
-        *_exists = !access(col_path, F_OK);
+        *_exists = !access(root_path(&arena, col_path), F_OK);
 
     }
+    arena_release(&arena);
 
-    conf_file = _free(conf_file);
     col_path = _free(col_path);
 
     return EOK;
@@ -101,15 +116,16 @@ scl_rc fallback_collection_exists(const char *colname, bool *_exists)
 
 scl_rc fallback_get_installed_collections(char ***_colnames)
 {
+    const char *conf_dir = scl_config_get()->conf_dir;
     struct dirent **nl;
     int n, i, i2 = 0;
     char **colnames;
     bool col_exists;
     scl_rc ret = EOK;
 
-    n = scandir(SCL_CONF_DIR, &nl, 0, alphasort);
+    n = scandir(conf_dir, &nl, 0, alphasort);
     if (n < 0) {
-        debug("Cannot list directory %s: %s\n", SCL_CONF_DIR, strerror(errno));
+        debug("Cannot list directory %s: %s\n", conf_dir, strerror(errno));
         return EDISK;
     }
 
@@ -145,24 +161,28 @@ exit:
     }
 
     for (i = 0; i < n; i++) {
-        nl[i] = _free(nl[i]);
+        free(nl[i]);
     }
-    nl = _free(nl);
+    free(nl);
 
     return ret;
 }
 
-scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
+/*
+ * Write bash script, which runs first_line (if not NULL), enables
+ * collections colnames and runs last_line, to temporary file tmp created by
+ * mkstemp().
+ */
+static scl_rc write_enable_script(char * const colnames[],
+    const char *first_line, const char *last_line, char *tmp)
 {
     scl_rc ret = EOK;
-    char tmp[] = "/var/tmp/sclXXXXXX";
     int tfd;
-    int status;
     FILE *tfp = NULL;
     char *colname;
     char *colpath = NULL;
-    char *enable_path = NULL;
-    char *bash_cmd = NULL;;
+    char *enable_path;
+    struct arena arena = ARENA_INIT;
 
     const char *script_body =
         "SCLS+=(%s)\n"
@@ -178,10 +198,12 @@ scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
     if (tfp == NULL) {
         debug("Cannot open a temporary file %s: %s\n", tmp, strerror(errno));
         close(tfd);
+        unlink(tmp);
         return EDISK;
     }
 
-    if (fprintf(tfp, "eval \"SCLS=( ${X_SCLS[*]} )\"\n") < 0) {
+    if ((first_line != NULL && fprintf(tfp, "%s\n", first_line) < 0) ||
+        fprintf(tfp, "eval \"SCLS=( ${X_SCLS[*]} )\"\n") < 0) {
         debug("Cannot write to a temporary file %s: %s\n", tmp,
             strerror(errno));
         ret = EDISK;
@@ -190,7 +212,6 @@ scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
 
     while (*colnames != NULL) {
         colname = *colnames;
-
         if (fallback_is_collection_enabled(colname)) {
             colnames++;
             continue;
@@ -200,7 +221,7 @@ scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
         if (ret != EOK) {
             goto exit;
         }
-        xasprintf(&enable_path, "%s/enable", colpath);
+        enable_path = arena_asprintf(&arena, "%s/enable", colpath);
 
         if (fprintf(tfp, script_body, colname, enable_path) < 0) {
             debug("Cannot write to a temporary file %s: %s\n", tmp,
@@ -208,27 +229,54 @@ scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
             ret = EDISK;
             goto exit;
         }
-        enable_path = _free(enable_path);
         colpath = _free(colpath);
         colnames++;
     }
 
-    if (exec) {
-        fprintf(tfp, "exec %s\n", cmd);
-    } else {
-        fprintf(tfp, "%s\n", cmd);
-    }
+    fprintf(tfp, "%s\n", last_line);
+
+exit:
     fclose(tfp);
-    tfp = NULL;
+    arena_release(&arena);
+    colpath = _free(colpath);
+    if (ret != EOK) {
+        unlink(tmp);
+    }
+
+    return ret;
+}
+
+scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
+{
+    scl_rc ret = EOK;
+    char tmp[] = "/var/tmp/sclXXXXXX";
+    int status, trace_id;
+    struct arena arena = ARENA_INIT;
+    char *bash_cmd;
+
+    PROBE2(fallback_run_command_entry, colnames[0], cmd);
+    stats_fallback();
+    ret = write_enable_script(colnames, NULL,
+        exec ? arena_asprintf(&arena, "exec %s", cmd) : cmd, tmp);
+    if (ret != EOK) {
+        arena_release(&arena);
+        PROBE2(fallback_run_command_return, colnames[0], ret);
+        return ret;
+    }
 
     if (exec) {
+        trace_mark("exec", "/bin/bash");
+        trace_flush();
+        stats_finish(EOK, true);
         execl("/bin/bash", "/bin/bash", tmp, NULL);
         debug("Problem with executing program %s: %s\n", "/bin/bash", strerror(errno));
         ret = ERUN;
 
     } else {
-        xasprintf(&bash_cmd, "/bin/bash %s", tmp);
+        bash_cmd = arena_asprintf(&arena, "/bin/bash %s", tmp);
+        trace_id = trace_begin("command", bash_cmd);
         status = system(bash_cmd);
+        trace_end(trace_id);
         if (status == -1 || !WIFEXITED(status)) {
             if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
                 goto exit;
@@ -240,13 +288,48 @@ scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec)
     }
 
 exit:
-    if (tfp != NULL) {
-        fclose(tfp);
+    arena_release(&arena);
+    unlink(tmp);
+    PROBE2(fallback_run_command_return, colnames[0], ret);
+
+    return ret;
+}
+
+scl_rc fallback_get_env(char * const colnames[], struct env_builder *env)
+{
+    scl_rc ret = EOK;
+    char tmp[] = "/var/tmp/sclXXXXXX";
+    char *argv[] = {"/bin/bash", tmp, NULL};
+    char *output = NULL, *var;
+    size_t len;
+
+    stats_fallback();
+
+    /* Enable scripts may print to stdout, keep it apart from the output */
+    ret = write_enable_script(colnames, "exec 3>&1 >&2",
+        "exec env -0 >&3 3>&-", tmp);
+    if (ret != EOK) {
+        return ret;
     }
-    enable_path = _free(enable_path);
-    colpath = _free(colpath);
-    bash_cmd = _free(bash_cmd);
+
+    output = get_command_output_len(argv[0], argv, NULL, STDOUT_FILENO,
+        &len);
     unlink(tmp);
+    if (output == NULL) {
+        debug("Problem with executing program %s: %s\n", argv[0],
+            strerror(errno));
+        return ERUN;
+    }
+
+    env_builder_init(env, NULL);
+    for (var = output; var < output + len; var += strlen(var) + 1) {
+        env_builder_put(env, var);
+    }
+    output = _free(output);
+
+    /* Variables maintained by bash itself */
+    env_builder_set(env, "_", getenv("_"));
+    env_builder_set(env, "SHLVL", getenv("SHLVL"));
 
     return ret;
 }
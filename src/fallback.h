@@ -2,12 +2,23 @@
 #define __FALLBACK_H__
 
 #include <stdbool.h>
+#include "sclmalloc.h"
+#include "envbuilder.h"
 
 bool has_old_collection(char * const colnames[]);
 bool fallback_is_collection_enabled(const char *colname);
+bool fallback_is_collection_enabled_in(const char *x_scls, const char *colname);
 scl_rc fallback_run_command(char * const colnames[], const char *cmd, bool exec);
-scl_rc fallback_get_enabled_collections(char ***_colnames);
+
+scl_rc fallback_get_enabled_collections(struct arena *arena,
+    char ***_colnames);
 scl_rc fallback_get_installed_collections(char ***_colnames);
 scl_rc fallback_collection_exists(const char *colname, bool *_exists);
 
+/*
+ * Compute environment of collections colnames by running their enable
+ * scripts. Variables bash sets for itself keep their current values.
+ */
+scl_rc fallback_get_env(char * const colnames[], struct env_builder *env);
+
 #endif
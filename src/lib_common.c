@@ -8,95 +8,219 @@
 #include <unistd.h>
 #include <wordexp.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
 
 #include "errors.h"
 #include "scllib.h"
 #include "debug.h"
 #include "sclmalloc.h"
 #include "lib_common.h"
+#include "trace.h"
+#include "probes.h"
 
-char *get_command_output(const char *path, char *const argv[], int fileno)
+/*
+ * Size of the previous output, outputs of modulecmd in one process tend to
+ * be similar so this is a good initial size of the buffer. It is only a
+ * hint, so relaxed atomic access is enough when threads share it.
+ */
+static size_t output_size_hint = 16384;
+
+bool stream_command_output(const char *path, char *const argv[],
+    char *const envp[], int fileno, output_consumer consume, void *arg)
 {
-    int pid = 0, status;
-    int outpipe[2] = {0, 0};
-    FILE *fpipe = NULL;
-    int c;
-    char *buffer = NULL;
-    int count = 0, alloced = 5;
-    int error = 1;
-
-    if (pipe(outpipe) == -1) {
+    pid_t pid = 0;
+    int status, spawn_ret;
+    int outpipe[2] = {-1, -1};
+    posix_spawn_file_actions_t actions;
+    char chunk[16384];
+    ssize_t r;
+    size_t bytes = 0;
+    bool ret = false;
+    int trace_id = trace_begin("spawn", path);
+
+    PROBE1(command_output_entry, path);
+
+    /* Both ends are closed in the child, only its dup2()ed copy survives */
+    if (pipe2(outpipe, O_CLOEXEC) == -1) {
         goto exit;
     }
 
-    pid = fork();
-    if (pid == -1) {
+    /*
+     * posix_spawn() doesn't have to copy page tables of this process like
+     * fork() does, which matters with librpm mapped in.
+     */
+    if (posix_spawn_file_actions_init(&actions) != 0) {
         goto exit;
-    } else if (pid == 0) {/* Child */
-        close(outpipe[0]);
-        if (dup2(outpipe[1], fileno) == -1) {
-            goto exit;
-        }
-        execv(path, argv);
-        exit(EXIT_FAILURE);
     }
-
-    close(outpipe[1]);
-    fpipe = fdopen(outpipe[0], "r");
-    if (fpipe == NULL){
+    spawn_ret = posix_spawn_file_actions_adddup2(&actions, outpipe[1], fileno);
+    if (spawn_ret == 0) {
+        spawn_ret = posix_spawn(&pid, path, &actions, NULL, argv,
+            envp != NULL ? envp : environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (spawn_ret != 0) {
+        pid = 0;
+        errno = spawn_ret;
         goto exit;
     }
-    outpipe[0] = 0;
-    buffer = xmalloc(alloced);
 
+    close(outpipe[1]);
+    outpipe[1] = -1;
+
+    /* Output is consumed while the child is still producing it */
     while (1) {
-        c = fgetc(fpipe);
-        if (ferror(fpipe) != 0) {
+        r = read(outpipe[0], chunk, sizeof(chunk));
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             goto exit;
         }
-        count++;
-        if (count > alloced) {
-            alloced <<=1;
-            buffer = xrealloc(buffer, alloced);
-        }
-        if (c != EOF) {
-            buffer[count - 1] = c;
-        } else {
-            buffer[count - 1] = '\0';
+        if (r == 0) {
             break;
         }
+        bytes += r;
+        if (!consume(chunk, r, arg)) {
+            goto exit;
+        }
     }
-    error = 0;
+    ret = true;
 
 exit:
-    if (outpipe[0]) {
+    if (outpipe[0] != -1) {
         close(outpipe[0]);
     }
 
-    if (outpipe[1]) {
+    if (outpipe[1] != -1) {
         close(outpipe[1]);
     }
 
-    if (fpipe) {
-        fclose(fpipe);
-    }
-
     if (pid > 0) {
-        waitpid(pid, &status, 0);
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
         if (!WIFEXITED(status)) {
             debug("Program %s didn't terminate normally!\n", path);
-            error = 1;
+            ret = false;
         }else if (WEXITSTATUS(status)) {
             debug("Program %s returned nonzero return code!\n", path);
-            error = 1;
+            ret = false;
+        }
+    }
+    trace_end(trace_id);
+    PROBE4(command_output_return, path, pid, bytes, ret);
+
+    return ret;
+}
+
+struct output_buffer {
+    char *data;
+    size_t count;
+    size_t alloced;
+    bool failed;
+};
+
+static bool append_output(const char *data, size_t len, void *arg)
+{
+    struct output_buffer *buffer = arg;
+    size_t alloced = buffer->alloced;
+    char *new_data;
+
+    if (buffer->count + len >= alloced) {
+        while (buffer->count + len >= alloced) {
+            alloced <<= 1;
+        }
+        new_data = xrealloc(buffer->data, alloced);
+        if (new_data == NULL) {
+            buffer->failed = true;
+            return false;
+        }
+        buffer->data = new_data;
+        buffer->alloced = alloced;
+    }
+    memcpy(buffer->data + buffer->count, data, len);
+    buffer->count += len;
+
+    return true;
+}
+
+char *get_command_output_len(const char *path, char *const argv[],
+    char *const envp[], int fileno, size_t *_len)
+{
+    struct output_buffer buffer;
+
+    buffer.count = 0;
+    buffer.alloced = __atomic_load_n(&output_size_hint, __ATOMIC_RELAXED) + 1;
+    buffer.failed = false;
+    buffer.data = xmalloc(buffer.alloced);
+    if (buffer.data == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (!stream_command_output(path, argv, envp, fileno, append_output,
+        &buffer)) {
+
+        if (buffer.failed) {
+            errno = ENOMEM;
         }
+        return _free(buffer.data);
     }
 
-    if (error) {
-        buffer = _free(buffer);
+    buffer.data[buffer.count] = '\0';
+    if (_len != NULL) {
+        *_len = buffer.count;
     }
+    if (buffer.count > __atomic_load_n(&output_size_hint, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&output_size_hint, buffer.count, __ATOMIC_RELAXED);
+    }
+
+    return buffer.data;
+}
+
+char *get_command_output(const char *path, char *const argv[],
+    char *const envp[], int fileno)
+{
+    return get_command_output_len(path, argv, envp, fileno, NULL);
+}
+
+bool write_all(int fd, const void *data, size_t len)
+{
+    ssize_t written;
+
+    while (len > 0) {
+        written = write(fd, data, len);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data = (const char *) data + written;
+        len -= written;
+    }
+    return true;
+}
 
-    return buffer;
+bool read_all(int fd, void *data, size_t len)
+{
+    ssize_t r;
+
+    while (len > 0) {
+        r = read(fd, data, len);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (r == 0) {
+            return false;
+        }
+        data = (char *) data + r;
+        len -= r;
+    }
+    return true;
 }
 
 scl_rc prepare_args(const char *cmd, char ***_argv)
@@ -122,13 +246,94 @@ scl_rc prepare_args(const char *cmd, char ***_argv)
     return EOK;
 }
 
-int count_words(const char *str, char ch)
+void exec_with_env(char *const argv[], char *const envp[], const char *path)
+{
+    const char *dir, *end;
+    char *file = NULL;
+    char **sh_argv;
+    bool eacces = false;
+    int argc;
+
+    if (strchr(argv[0], '/') != NULL) {
+        execve(argv[0], argv, envp);
+        return;
+    }
+
+    if (path == NULL) {
+        path = "/bin:/usr/bin";
+    }
+
+    for (dir = path; dir != NULL; dir = *end ? end + 1 : NULL) {
+        end = strchrnul(dir, ':');
+
+        /* Empty item means current directory */
+        if (end == dir) {
+            xasprintf(&file, "%s", argv[0]);
+        } else {
+            xasprintf(&file, "%.*s/%s", (int) (end - dir), dir, argv[0]);
+        }
+
+        execve(file, argv, envp);
+
+        if (errno == ENOEXEC) {
+            /* Script without shebang line is run by shell like execvp() does */
+            argc = 0;
+            while (argv[argc] != NULL) {
+                argc++;
+            }
+            sh_argv = xcalloc(argc + 2, sizeof(*sh_argv));
+            sh_argv[0] = "/bin/sh";
+            sh_argv[1] = file;
+            memcpy(sh_argv + 2, argv + 1, argc * sizeof(*sh_argv));
+            execve(sh_argv[0], sh_argv, envp);
+            sh_argv = _free(sh_argv);
+        } else if (errno == EACCES) {
+            eacces = true;
+        }
+        file = _free(file);
+    }
+
+    if (eacces) {
+        errno = EACCES;
+    }
+}
+
+/*
+ * Kernels scanning strings for a byte. Every kernel has a scalar version
+ * and, on x86, SSE2 and AVX2 versions selected at run time.
+ */
+struct simd_kernels {
+    /* Index of the first c in s or len if there is none */
+    size_t (*find_byte)(const char *s, size_t len, char c);
+    /* Length of s without trailing c */
+    size_t (*strip_len)(const char *s, size_t len, char c);
+    /* Number of runs of characters other than c */
+    int (*count_words)(const char *s, size_t len, char c);
+};
+
+static size_t find_byte_scalar(const char *s, size_t len, char c)
+{
+    size_t i;
+
+    for (i = 0; i < len && s[i] != c; i++);
+    return i;
+}
+
+static size_t strip_len_scalar(const char *s, size_t len, char c)
+{
+    while (len > 0 && s[len - 1] == c) {
+        len--;
+    }
+    return len;
+}
+
+static int count_words_scalar(const char *s, size_t len, char c)
 {
     int count = 0;
     bool inside_word = false;
 
-    while (*str != '\0') {
-        if (*str != ch) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] != c) {
             if (!inside_word) {
                 count++;
             }
@@ -136,58 +341,218 @@ int count_words(const char *str, char ch)
         } else {
             inside_word = false;
         }
-        str++;
     }
 
     return count;
 }
 
+static const struct simd_kernels scalar_kernels = {
+    find_byte_scalar, strip_len_scalar, count_words_scalar
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/*
+ * Both vector widths share the code, only the types and intrinsics differ.
+ * Masks have one bit per byte, bit i set when byte i equals c.
+ */
+#define DEFINE_SIMD_KERNELS(isa, isa_name, vec, width, mask_t, load, set1, \
+    cmpeq, movemask) \
+\
+__attribute__ ((target(isa_name))) \
+static size_t find_byte_##isa(const char *s, size_t len, char c) \
+{ \
+    vec needle = set1(c); \
+    mask_t mask; \
+    size_t i; \
+\
+    for (i = 0; i + width <= len; i += width) { \
+        mask = movemask(cmpeq(load((const vec *) (s + i)), needle)); \
+        if (mask != 0) { \
+            return i + __builtin_ctz(mask); \
+        } \
+    } \
+    return i + find_byte_scalar(s + i, len - i, c); \
+} \
+\
+__attribute__ ((target(isa_name))) \
+static size_t strip_len_##isa(const char *s, size_t len, char c) \
+{ \
+    vec needle = set1(c); \
+    mask_t mask; \
+\
+    for (; len >= width; len -= width) { \
+        mask = ~movemask(cmpeq(load((const vec *) (s + len - width)), needle)); \
+        if (mask != 0) { \
+            return len - width + 32 - __builtin_clz(mask); \
+        } \
+    } \
+    return strip_len_scalar(s, len, c); \
+} \
+\
+__attribute__ ((target(isa_name))) \
+static int count_words_##isa(const char *s, size_t len, char c) \
+{ \
+    vec needle = set1(c); \
+    mask_t delim, starts, prev = 1; \
+    int count = 0; \
+    size_t i; \
+\
+    /* Word starts at non-delimiter preceded by delimiter */ \
+    for (i = 0; i + width <= len; i += width) { \
+        delim = movemask(cmpeq(load((const vec *) (s + i)), needle)); \
+        starts = ~delim & ((delim << 1) | prev); \
+        count += __builtin_popcount(starts); \
+        prev = delim >> (width - 1); \
+    } \
+    for (; i < len; i++) { \
+        if (s[i] != c && prev) { \
+            count++; \
+        } \
+        prev = s[i] == c; \
+    } \
+    return count; \
+} \
+\
+static const struct simd_kernels isa##_kernels = { \
+    find_byte_##isa, strip_len_##isa, count_words_##isa \
+};
+
+/* Masks of SSE2 are truncated to 16 bits when stored to mask_t */
+DEFINE_SIMD_KERNELS(sse2, "sse2", __m128i, 16, unsigned short,
+    _mm_loadu_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_movemask_epi8)
+DEFINE_SIMD_KERNELS(avx2, "avx2", __m256i, 32, unsigned int,
+    _mm256_loadu_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8,
+    (unsigned int) _mm256_movemask_epi8)
+#endif
+
+static const struct simd_kernels *kernels = NULL;
+
+int simd_select(int level)
+{
+    const struct simd_kernels *selected = &scalar_kernels;
+    int selected_level = SIMD_SCALAR;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (level >= SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        selected = &avx2_kernels;
+        selected_level = SIMD_AVX2;
+    } else if (level >= SIMD_SSE2 && __builtin_cpu_supports("sse2")) {
+        selected = &sse2_kernels;
+        selected_level = SIMD_SSE2;
+    }
+#endif
+
+    __atomic_store_n(&kernels, selected, __ATOMIC_RELAXED);
+    return selected_level;
+}
+
+static const struct simd_kernels *get_kernels()
+{
+    const struct simd_kernels *k = __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+
+    /* Threads racing here select the same kernels */
+    if (k == NULL) {
+        simd_select(SIMD_AVX2);
+        k = __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+    }
+    return k;
+}
+
+int count_words(const char *str, char ch)
+{
+    return get_kernels()->count_words(str, strlen(str), ch);
+}
+
 void strip_trailing_chars(char *str, char char_to_strip)
 {
-    for (int i = strlen(str) - 1; i >=0; i--) {
-        if (str[i] == char_to_strip) {
-            str[i] = '\0';
-        } else {
+    str[get_kernels()->strip_len(str, strlen(str), char_to_strip)] = '\0';
+}
+
+size_t unescape_to(char *dst, const char *src, size_t len)
+{
+    const struct simd_kernels *k = get_kernels();
+    size_t si = 0, ti = 0, run;
+
+    while (si < len) {
+        /* Copy everything up to the next backslash at once */
+        run = k->find_byte(src + si, len - si, '\\');
+        memmove(dst + ti, src + si, run);
+        si += run;
+        ti += run;
+
+        /* Skip the backslash and take the next character literally */
+        if (++si >= len) {
             break;
         }
+        dst[ti++] = src[si++];
     }
+    dst[ti] = '\0';
+
+    return ti;
 }
 
 void unescape_string(char *str)
 {
-    int str_len = strlen(str);
-    int si, ti = 0;
-
-    for (si = 0; si < str_len; si++) {
-        if (str[si] == '\\') {
-            si++;
-            if (si == str_len) {
-                break;
-            }
-        }
+    unescape_to(str, str, strlen(str));
+}
 
-        str[ti++] = str[si];
+void tokenizer_init(struct tokenizer *tok, const char *str, size_t len,
+    char delim)
+{
+    tok->pos = str;
+    tok->end = str + len;
+    tok->delim = delim;
+}
+
+bool tokenizer_next(struct tokenizer *tok, struct strview *token)
+{
+    size_t len;
+
+    /* Skip empty tokens like strtok() does */
+    while (tok->pos < tok->end && *tok->pos == tok->delim) {
+        tok->pos++;
+    }
+    if (tok->pos == tok->end) {
+        return false;
     }
-    str[ti] = '\0';
+
+    len = get_kernels()->find_byte(tok->pos, tok->end - tok->pos, tok->delim);
+    token->str = tok->pos;
+    token->len = len;
+    tok->pos += len;
+
+    return true;
 }
 
+bool strview_equal(struct strview view, const char *str)
+{
+    return !strncmp(view.str, str, view.len) && str[view.len] == '\0';
+}
 
 char **split(char *str, char delim)
 {
-    char **parts, *p;
-    int word_count, i = 0;
-    char delim_str[2];
-
-    delim_str[0] = delim;
-    delim_str[1] = '\0';
+    char **parts;
+    size_t len = strlen(str);
+    struct tokenizer tok;
+    struct strview token;
+    int i = 0;
 
-    word_count = count_words(str, delim);
-    parts = xmalloc((word_count + 1) * sizeof(*parts));
+    parts = xmalloc((get_kernels()->count_words(str, len, delim) + 1) *
+        sizeof(*parts));
+    if (parts == NULL) {
+        return NULL;
+    }
 
-    p = strtok(str, delim_str);
-    while (p != NULL) {
-        parts[i++] = p;
-        p = strtok(NULL, delim_str);
+    tokenizer_init(&tok, str, len, delim);
+    while (tokenizer_next(&tok, &token)) {
+        parts[i++] = (char *) token.str;
+        /* Terminate the token by its delimiter */
+        if (tok.pos < tok.end) {
+            *(char *) tok.pos++ = '\0';
+        }
     }
     parts[i] = NULL;
 
@@ -270,10 +635,6 @@ char **merge_string_arrays(char *const *array1, char *const *array2)
     }
     merged_array[++prev] = NULL;
 
-    for (int i = 0; i < prev; i++) {
-        merged_array[i] = xstrdup(merged_array[i]);
-    }
-
     return merged_array;
 }
 
@@ -287,9 +648,10 @@ void *free_string_array(char **array) {
 
     if (array != NULL) {
         while (array[i] != NULL) {
-            free(array[i++]);
+            array[i] = _free(array[i]);
+            i++;
         }
-        free(array);
+        array = _free(array);
     }
     return NULL;
 }
@@ -307,3 +669,42 @@ char *directory_name(const char *_path)
 
     return path;
 }
+
+/**
+ * FNV-1a hash of data, hash is HASH_INIT or result of previous call.
+ */
+uint64_t hash_bytes(const void *data, size_t len, uint64_t hash)
+{
+    const unsigned char *p = data;
+
+    while (len-- > 0) {
+        hash ^= *p++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Fills identity of a file from its status, NULL status means the file
+ * doesn't exist.
+ */
+void file_id_get(const struct stat *st, struct file_id *id)
+{
+    memset(id, 0, sizeof(*id));
+    if (st != NULL) {
+        id->dev = st->st_dev;
+        id->ino = st->st_ino;
+        id->size = st->st_size;
+        id->mtime_sec = st->st_mtim.tv_sec;
+        id->mtime_nsec = st->st_mtim.tv_nsec;
+    }
+}
+
+void file_id_path(const char *path, bool follow, struct file_id *id)
+{
+    struct stat st;
+    int ret;
+
+    ret = follow ? stat(path, &st) : lstat(path, &st);
+    file_id_get(ret == 0 ? &st : NULL, id);
+}
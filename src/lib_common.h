@@ -1,18 +1,119 @@
 #ifndef __LIB_COMMON_H__
 #define __LIB_COMMON_H__
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
 #include "errors.h"
 
-char *get_command_output(const char *path, char *const argv[], int fileno);
+#define HASH_INIT 14695981039346656037ULL
+
+/*
+ * Identity of a file used to find out whether the file changed.
+ */
+struct file_id {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+/*
+ * Return everything program path wrote to fileno, NULL if it failed. errno
+ * is ENOMEM when the output couldn't be stored.
+ */
+char *get_command_output(const char *path, char *const argv[],
+    char *const envp[], int fileno);
+
+typedef bool (*output_consumer)(const char *data, size_t len, void *arg);
+
+/*
+ * Run program path and pass everything it writes to fileno to consume as
+ * soon as it is read. Returns false if the program can't be run, it fails
+ * or consume returns false, consumed output should be discarded then. The
+ * program is waited for in all cases.
+ */
+bool stream_command_output(const char *path, char *const argv[],
+    char *const envp[], int fileno, output_consumer consume, void *arg);
+
+/*
+ * Like get_command_output(), the length of the output is stored to _len,
+ * so the output may contain NUL characters.
+ */
+char *get_command_output_len(const char *path, char *const argv[],
+    char *const envp[], int fileno, size_t *_len);
+
+/*
+ * Write or read exactly len bytes, interrupted calls are restarted.
+ * read_all() fails also on premature end of file.
+ */
+bool write_all(int fd, const void *data, size_t len);
+bool read_all(int fd, void *data, size_t len);
 scl_rc prepare_args(const char *cmd, char ***_argv);
+
+/*
+ * Execute program argv[0] with environment envp. Like execvp() does, the
+ * program is searched in directories listed in path. Returns only on error.
+ */
+void exec_with_env(char *const argv[], char *const envp[], const char *path);
+/*
+ * String functions below scan strings by kernels using the best SIMD
+ * instructions of the CPU. simd_select() chooses kernels up to level
+ * instead, it returns the level actually selected.
+ */
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+int simd_select(int level);
 int count_words(const char *str, char ch);
 void unescape_string(char *str);
+
+/*
+ * Copy len bytes of src to dst without backslashes escaping characters and
+ * terminate dst by NUL. dst may be the same as src. Returns length of dst.
+ */
+size_t unescape_to(char *dst, const char *src, size_t len);
+
+/*
+ * Part of a string, which isn't NUL-terminated.
+ */
+struct strview {
+    const char *str;
+    size_t len;
+};
+
+/*
+ * Non-destructive split(), tokens are returned as views into the original
+ * string one by one. Empty tokens are skipped like split() does, so
+ * count_words() tells the number of tokens in advance.
+ */
+struct tokenizer {
+    const char *pos;
+    const char *end;
+    char delim;
+};
+
+void tokenizer_init(struct tokenizer *tok, const char *str, size_t len,
+    char delim);
+bool tokenizer_next(struct tokenizer *tok, struct strview *token);
+bool strview_equal(struct strview view, const char *str);
 void strip_trailing_chars(char *str, char char_to_strip);
 char **split(char *str, char delim);
 void print_string_array(char *const *array);
+int string_array_len(char *const *array);
 void *free_string_array(char **array);
 char *strip_trailing_slashes(const char *path_to_strip);
 char *directory_name(const char *_path);
+/*
+ * Return sorted union of two arrays. Strings are not copied, only the
+ * returned array has to be released.
+ */
 char **merge_string_arrays(char *const *array1, char *const *array2);
+uint64_t hash_bytes(const void *data, size_t len, uint64_t hash);
+void file_id_get(const struct stat *st, struct file_id *id);
+void file_id_path(const char *path, bool follow, struct file_id *id);
 
 #endif
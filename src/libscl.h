@@ -0,0 +1,71 @@
+#ifndef __LIBSCL_H__
+#define __LIBSCL_H__
+
+#include <stdbool.h>
+#include "errors.h"
+
+/*
+ * Reentrant interface of libscl. All functions can be called from several
+ * threads at once, also with the same context. They never modify the
+ * environment of the process and report allocation failures as EMEM.
+ *
+ * Some state belongs to the process rather than to the context, the calls
+ * are not reentrant with respect to it:
+ * - The configuration (SCL_CONFIG, SCL_MODULES_PATH, ...) is read from the
+ *   environment by the first call and shared by all contexts.
+ * - The environment of the process is read, e.g. XDG_RUNTIME_DIR. Code of
+ *   scl(1) which temporarily replaces environ, like run_command(), must not
+ *   run in the same process.
+ * - Diagnostics are written to stderr.
+ */
+typedef struct scl_ctx scl_ctx;
+
+/*
+ * Create context which owns caches. Locations of collections come from
+ * the configuration of the process, see scl(1).
+ * @param[out] _ctx         New context, release it by scl_ctx_free().
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc scl_ctx_new(scl_ctx **_ctx);
+void scl_ctx_free(scl_ctx *ctx);
+
+/*
+ * Create array of installed collections. The list is kept in the context
+ * and read again only when the directory of modulefiles changes.
+ * @param[in] ctx           Context.
+ * @param[out] _colnames    NULL-terminated array, release it by
+ *                          scl_free_strv().
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc scl_ctx_list_collections(scl_ctx *ctx, char ***_colnames);
+
+/*
+ * Find out whether collection is installed.
+ * @param[in] ctx           Context.
+ * @param[in] colname       Name of collection.
+ * @param[out] _exists      true if the collection is installed
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc scl_ctx_collection_exists(scl_ctx *ctx, const char *colname,
+    bool *_exists);
+
+/*
+ * Compute environment with collections enabled. Collections whose
+ * modulefiles are too complex to be evaluated in process are passed to
+ * modulecmd.
+ * @param[in] ctx           Context.
+ * @param[in] colnames      NULL-terminated array of collections to enable.
+ * @param[in] base          NULL-terminated environment to start from.
+ * @param[out] _envp        NULL-terminated array of "NAME=value" strings,
+ *                          release it by scl_free_strv().
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc scl_ctx_get_env(scl_ctx *ctx, char *const colnames[],
+    char *const base[], char ***_envp);
+
+/*
+ * Release array returned by the library.
+ */
+void scl_free_strv(char **strv);
+
+#endif
@@ -0,0 +1,705 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "errors.h"
+#include "debug.h"
+#include "sclmalloc.h"
+#include "lib_common.h"
+#include "envbuilder.h"
+#include "modulefile.h"
+#include "sclconfig.h"
+
+/*
+ * In-process evaluator of modulefiles. Only a small subset of Tcl used by
+ * collection modulefiles is understood: comments, "set", "setenv",
+ * "unsetenv", "prepend-path", "append-path", "module load" and the
+ * informational "module-whatis" and "proc". Whenever a modulefile uses
+ * anything else, the evaluation is reported as unsupported and caller has
+ * to fall back to modulecmd.
+ */
+
+#define MAX_LOAD_DEPTH 16
+#define MAX_WORDS 64
+
+struct buffer {
+    char *data;
+    int len;
+    int alloced;
+    bool failed;        /* an allocation failed, appends are ignored */
+};
+
+struct parser {
+    const char *p;
+    const char *end;
+    char **vars;        /* NULL-terminated "name=value" pairs from "set" */
+    bool supported;
+    bool failed;        /* an allocation failed */
+};
+
+static void buffer_append(struct buffer *buf, const char *data, int len)
+{
+    char *new_data;
+
+    if (buf->failed) {
+        return;
+    }
+
+    if (buf->len + len + 1 > buf->alloced) {
+        new_data = xrealloc(buf->data, (buf->len + len + 1) * 2);
+        if (new_data == NULL) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = new_data;
+        buf->alloced = (buf->len + len + 1) * 2;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+}
+
+scl_rc env_delta_add(struct env_delta *delta, int type, char delim,
+    const char *name, const char *value)
+{
+    struct env_op *op, *ops;
+    int alloced;
+
+    if (delta->count == delta->alloced) {
+        alloced = delta->alloced ? delta->alloced << 1 : 16;
+        ops = xrealloc(delta->ops, alloced * sizeof(*ops));
+        if (ops == NULL) {
+            return EMEM;
+        }
+        delta->ops = ops;
+        delta->alloced = alloced;
+    }
+    op = &delta->ops[delta->count];
+    op->name = xstrdup(name);
+    op->value = value != NULL ? xstrdup(value) : NULL;
+    if (op->name == NULL || (value != NULL && op->value == NULL)) {
+        op->name = _free(op->name);
+        op->value = _free(op->value);
+        return EMEM;
+    }
+    op->type = type;
+    op->delim = delim;
+    file_id_get(NULL, &op->id);
+    file_id_get(NULL, &op->link_id);
+    delta->count++;
+
+    return EOK;
+}
+
+void env_delta_free(struct env_delta *delta)
+{
+    if (delta->map != NULL) {
+        munmap(delta->map, delta->map_len);
+        delta->map = NULL;
+    } else {
+        for (int i = 0; i < delta->count; i++) {
+            delta->ops[i].name = _free(delta->ops[i].name);
+            delta->ops[i].value = _free(delta->ops[i].value);
+        }
+    }
+    delta->ops = _free(delta->ops);
+    delta->count = delta->alloced = 0;
+}
+
+static const char *get_var(char *const *vars, const char *name, int len)
+{
+    for (int i = 0; vars != NULL && vars[i] != NULL; i++) {
+        if (!strncmp(vars[i], name, len) && vars[i][len] == '=') {
+            return vars[i] + len + 1;
+        }
+    }
+    return NULL;
+}
+
+static scl_rc set_var(char ***_vars, const char *name, const char *value)
+{
+    char **vars = *_vars, *var;
+    int len = strlen(name);
+    int count = 0;
+
+    if (xasprintf(&var, "%s=%s", name, value) == -1) {
+        return EMEM;
+    }
+
+    for (; vars != NULL && vars[count] != NULL; count++) {
+        if (!strncmp(vars[count], name, len) && vars[count][len] == '=') {
+            _free(vars[count]);
+            vars[count] = var;
+            return EOK;
+        }
+    }
+
+    vars = xrealloc(vars, (count + 2) * sizeof(*vars));
+    if (vars == NULL) {
+        var = _free(var);
+        return EMEM;
+    }
+    vars[count] = var;
+    vars[count + 1] = NULL;
+    *_vars = vars;
+
+    return EOK;
+}
+
+/*
+ * Substitute variable reference starting at ps->p (pointing to '$').
+ */
+static void substitute_var(struct parser *ps, struct buffer *word)
+{
+    const char *name, *value;
+    int len = 0;
+
+    ps->p++;
+    if (ps->p < ps->end && *ps->p == '{') {
+        name = ++ps->p;
+        while (ps->p < ps->end && *ps->p != '}') {
+            ps->p++;
+        }
+        len = ps->p - name;
+        if (ps->p < ps->end) {
+            ps->p++;
+        }
+    } else {
+        name = ps->p;
+        while (ps->p < ps->end &&
+            (isalnum((unsigned char) *ps->p) || *ps->p == '_')) {
+
+            ps->p++;
+        }
+        len = ps->p - name;
+
+        /* A lone "$" is taken literally */
+        if (len == 0) {
+            buffer_append(word, "$", 1);
+            return;
+        }
+
+        /* Arrays like $env(NAME) depend on the environment */
+        if (ps->p < ps->end && *ps->p == '(') {
+            ps->supported = false;
+            return;
+        }
+    }
+
+    value = get_var(ps->vars, name, len);
+    if (value == NULL) {
+        ps->supported = false;
+        return;
+    }
+    buffer_append(word, value, strlen(value));
+}
+
+static void substitute_backslash(struct parser *ps, struct buffer *word)
+{
+    char c;
+
+    ps->p++;
+    if (ps->p == ps->end) {
+        buffer_append(word, "\\", 1);
+        return;
+    }
+
+    switch (*ps->p) {
+        case 'n': c = '\n'; break;
+        case 't': c = '\t'; break;
+        case '\n': c = ' '; break;
+        default: c = *ps->p;
+    }
+    buffer_append(word, &c, 1);
+    ps->p++;
+}
+
+/*
+ * Read one word of the current command.
+ * @return      true when a word was read, false at the end of command
+ */
+static bool read_word(struct parser *ps, char **_word)
+{
+    struct buffer word = {NULL, 0, 0, false};
+    int depth;
+
+    while (ps->p < ps->end) {
+        if (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\r') {
+            ps->p++;
+        } else if (*ps->p == '\\' && ps->p + 1 < ps->end && ps->p[1] == '\n') {
+            ps->p += 2;
+        } else {
+            break;
+        }
+    }
+
+    if (ps->p == ps->end || *ps->p == '\n' || *ps->p == ';') {
+        return false;
+    }
+
+    buffer_append(&word, "", 0);
+
+    if (*ps->p == '{') {
+        /* Braces quote everything literally, including nested braces */
+        const char *start = ++ps->p;
+
+        depth = 1;
+        while (ps->p < ps->end) {
+            if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+                ps->p++;
+            } else if (*ps->p == '{') {
+                depth++;
+            } else if (*ps->p == '}' && --depth == 0) {
+                break;
+            }
+            ps->p++;
+        }
+        buffer_append(&word, start, ps->p - start);
+        if (ps->p < ps->end) {
+            ps->p++;
+        }
+    } else if (*ps->p == '"') {
+        ps->p++;
+        while (ps->p < ps->end && *ps->p != '"' && ps->supported) {
+            if (*ps->p == '$') {
+                substitute_var(ps, &word);
+            } else if (*ps->p == '\\') {
+                substitute_backslash(ps, &word);
+            } else if (*ps->p == '[') {
+                ps->supported = false;
+            } else {
+                buffer_append(&word, ps->p++, 1);
+            }
+        }
+        if (ps->p < ps->end) {
+            ps->p++;
+        }
+    } else {
+        while (ps->p < ps->end && !strchr(" \t\r\n;", *ps->p) &&
+            ps->supported) {
+
+            if (*ps->p == '$') {
+                substitute_var(ps, &word);
+            } else if (*ps->p == '\\') {
+                substitute_backslash(ps, &word);
+            } else if (*ps->p == '[') {
+                ps->supported = false;
+            } else {
+                buffer_append(&word, ps->p++, 1);
+            }
+        }
+    }
+
+    if (word.failed) {
+        word.data = _free(word.data);
+        ps->failed = true;
+        return false;
+    }
+
+    *_word = word.data;
+    return true;
+}
+
+static void skip_line(struct parser *ps)
+{
+    while (ps->p < ps->end && *ps->p != '\n') {
+        if (*ps->p == '\\' && ps->p + 1 < ps->end) {
+            ps->p++;
+        }
+        ps->p++;
+    }
+}
+
+scl_rc modulefile_find(const char *modname, const char *modulepath,
+    char **_path)
+{
+    struct arena arena = ARENA_INIT;
+    char *dirs, **parts = NULL, *path = NULL;
+    const char *file;
+    struct stat st;
+    scl_rc ret = EOK;
+
+    *_path = NULL;
+    if (modulepath == NULL) {
+        return EOK;
+    }
+
+    dirs = xstrdup(modulepath);
+    if (dirs != NULL) {
+        parts = split(dirs, ':');
+    }
+    if (parts == NULL) {
+        ret = EMEM;
+        goto exit;
+    }
+
+    for (int i = 0; parts[i] != NULL; i++) {
+        if (xasprintf(&path, "%s/%s", parts[i], modname) == -1 ||
+            (file = root_path(&arena, path)) == NULL) {
+
+            path = _free(path);
+            ret = EMEM;
+            goto exit;
+        }
+        if (stat(file, &st) == 0) {
+            /*
+             * Directories contain versioned modulefiles, choosing the
+             * default version is left to modulecmd.
+             */
+            if (!S_ISREG(st.st_mode)) {
+                path = _free(path);
+            }
+            break;
+        }
+        path = _free(path);
+    }
+    *_path = path;
+
+exit:
+    parts = _free(parts);
+    dirs = _free(dirs);
+    arena_release(&arena);
+
+    return ret;
+}
+
+static scl_rc eval_file(const char *modname, const char *modulepath,
+    int depth, struct env_delta *delta, bool *_supported);
+
+static scl_rc eval_command(struct parser *ps, int argc, char **argv,
+    const char *modulepath, int depth, struct env_delta *delta)
+{
+    int i = 1;
+    char delim = ':';
+    int type;
+    scl_rc ret = EOK;
+
+    if (!strcmp(argv[0], "module-whatis") || !strcmp(argv[0], "proc")) {
+        return EOK;
+    }
+
+    if (!strcmp(argv[0], "set") && argc == 3) {
+        ret = set_var(&ps->vars, argv[1], argv[2]);
+    } else if (!strcmp(argv[0], "setenv") && argc == 3) {
+        ret = env_delta_add(delta, ENV_OP_SET, delim, argv[1], argv[2]);
+    } else if (!strcmp(argv[0], "unsetenv") && (argc == 2 || argc == 3)) {
+        ret = env_delta_add(delta, ENV_OP_UNSET, delim, argv[1], NULL);
+    } else if (!strcmp(argv[0], "prepend-path") ||
+        !strcmp(argv[0], "append-path")) {
+
+        type = argv[0][0] == 'p' ? ENV_OP_PREPEND : ENV_OP_APPEND;
+
+        if (argc > 1 && (!strcmp(argv[1], "-d") ||
+            !strcmp(argv[1], "--delim")) && argc > 2) {
+
+            delim = argv[2][0];
+            i = 3;
+        } else if (argc > 1 && !strncmp(argv[1], "--delim=", 8)) {
+            delim = argv[1][8];
+            i = 2;
+        }
+
+        if (argc - i < 2 || delim == '\0') {
+            ps->supported = false;
+            return EOK;
+        }
+
+        /*
+         * Values end up in the order of the arguments, like modulecmd
+         * puts them, so the last one is prepended first.
+         */
+        if (type == ENV_OP_PREPEND) {
+            for (int i2 = argc - 1; i2 > i && ret == EOK; i2--) {
+                ret = env_delta_add(delta, type, delim, argv[i], argv[i2]);
+            }
+        } else {
+            for (int i2 = i + 1; i2 < argc && ret == EOK; i2++) {
+                ret = env_delta_add(delta, type, delim, argv[i], argv[i2]);
+            }
+        }
+    } else if (!strcmp(argv[0], "module") && argc >= 3 &&
+        (!strcmp(argv[1], "load") || !strcmp(argv[1], "add"))) {
+
+        for (i = 2; i < argc && ps->supported; i++) {
+            ret = eval_file(argv[i], modulepath, depth + 1, delta,
+                &ps->supported);
+            if (ret != EOK) {
+                return ret;
+            }
+        }
+    } else {
+        ps->supported = false;
+    }
+
+    return ret;
+}
+
+static scl_rc eval_file(const char *modname, const char *modulepath,
+    int depth, struct env_delta *delta, bool *_supported)
+{
+    struct parser ps = {NULL, NULL, NULL, true, false};
+    struct arena arena = ARENA_INIT;
+    const char *file;
+    char *path = NULL, *content = NULL;
+    char *argv[MAX_WORDS + 1];
+    int argc = 0;
+    FILE *fp = NULL;
+    struct stat st;
+    struct file_id link_id;
+    scl_rc ret = EOK;
+
+    if (depth > MAX_LOAD_DEPTH) {
+        ps.supported = false;
+        goto exit;
+    }
+
+    ret = modulefile_find(modname, modulepath, &path);
+    if (ret != EOK) {
+        goto exit;
+    }
+    if (path == NULL) {
+        ps.supported = false;
+        goto exit;
+    }
+
+    file = root_path(&arena, path);
+    if (file == NULL) {
+        ret = EMEM;
+        goto exit;
+    }
+    file_id_path(file, false, &link_id);
+    fp = fopen(file, "r");
+    if (fp == NULL || fstat(fileno(fp), &st) != 0) {
+        ps.supported = false;
+        goto exit;
+    }
+
+    content = xmalloc(st.st_size + 1);
+    if (content == NULL) {
+        ret = EMEM;
+        goto exit;
+    }
+    if (st.st_size > 0 && fread(content, st.st_size, 1, fp) != 1) {
+        debug("Unable to read file %s: %s\n", file, strerror(errno));
+        ret = EDISK;
+        goto exit;
+    }
+    content[st.st_size] = '\0';
+
+    if (strncmp(content, MODULEFILE_MAGIC, sizeof(MODULEFILE_MAGIC) - 1)) {
+        ps.supported = false;
+        goto exit;
+    }
+
+    ps.p = content;
+    ps.end = content + st.st_size;
+
+    /* Remember exactly which file was read so that its result can be cached */
+    ret = env_delta_add(delta, ENV_OP_MODULE_BEGIN, ':', modname, path);
+    if (ret != EOK) {
+        goto exit;
+    }
+    file_id_get(&st, &delta->ops[delta->count - 1].id);
+    delta->ops[delta->count - 1].link_id = link_id;
+
+    while (ps.p < ps.end && ps.supported && ret == EOK) {
+        argc = 0;
+
+        /* Comments are recognized only at the start of a command */
+        while (ps.p < ps.end && strchr(" \t\r\n;", *ps.p)) {
+            ps.p++;
+        }
+        if (ps.p < ps.end && *ps.p == '#') {
+            skip_line(&ps);
+            continue;
+        }
+
+        while (read_word(&ps, &argv[argc])) {
+            if (!ps.supported || argc == MAX_WORDS) {
+                argc++;
+                ps.supported = false;
+                break;
+            }
+            argc++;
+        }
+
+        if (ps.failed) {
+            ret = EMEM;
+        } else if (argc > 0 && ps.supported) {
+            ret = eval_command(&ps, argc, argv, modulepath, depth, delta);
+        }
+
+        for (int i = 0; i < argc; i++) {
+            argv[i] = _free(argv[i]);
+        }
+    }
+
+    if (ret == EOK) {
+        ret = env_delta_add(delta, ENV_OP_MODULE_END, ':', modname, path);
+    }
+
+exit:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    if (!ps.supported) {
+        *_supported = false;
+    }
+    ps.vars = free_string_array(ps.vars);
+    content = _free(content);
+    path = _free(path);
+    arena_release(&arena);
+
+    return ret;
+}
+
+scl_rc modulefile_eval(const char *modname, const char *modulepath,
+    struct env_delta *delta, bool *_supported)
+{
+    scl_rc ret;
+    bool supported = true;
+
+    ret = eval_file(modname, modulepath, 0, delta, &supported);
+    if (ret != EOK || !supported) {
+        env_delta_free(delta);
+    }
+    *_supported = supported;
+
+    return ret;
+}
+
+/*
+ * Return true if element of length len is one of elements of list.
+ */
+static bool has_element(const char *list, char delim, const char *element,
+    int len)
+{
+    const char *p = list;
+
+    while (p != NULL) {
+        if (!strncmp(p, element, len) && (p[len] == delim || p[len] == '\0')) {
+            return true;
+        }
+        p = strchr(p, delim);
+        if (p != NULL) {
+            p++;
+        }
+    }
+    return false;
+}
+
+/*
+ * Add elements at the beginning or at the end of delimited list. Elements
+ * which are already in the list are moved. Returns NULL if an allocation
+ * failed.
+ */
+static char *add_elements(const char *old, const char *elements, char delim,
+    bool prepend)
+{
+    struct buffer buf = {NULL, 0, 0, false};
+    const char *p = old, *next;
+    int len;
+
+    buffer_append(&buf, "", 0);
+    if (prepend) {
+        buffer_append(&buf, elements, strlen(elements));
+    }
+
+    while (p != NULL && *p != '\0') {
+        next = strchr(p, delim);
+        len = next ? next - p : (int) strlen(p);
+
+        if (!has_element(elements, delim, p, len)) {
+            if (buf.len > 0) {
+                buffer_append(&buf, &delim, 1);
+            }
+            buffer_append(&buf, p, len);
+        }
+        p = next ? next + 1 : NULL;
+    }
+
+    if (!prepend) {
+        if (buf.len > 0) {
+            buffer_append(&buf, &delim, 1);
+        }
+        buffer_append(&buf, elements, strlen(elements));
+    }
+
+    if (buf.failed) {
+        buf.data = _free(buf.data);
+    }
+    return buf.data;
+}
+
+scl_rc env_delta_apply(const struct env_delta *delta, struct env_builder *env)
+{
+    const struct env_op *op;
+    const char *loaded;
+    char *value;
+    int skip = 0;
+
+    for (int i = 0; i < delta->count; i++) {
+        op = &delta->ops[i];
+
+        /* Modules which are already loaded are not loaded again */
+        if (skip > 0) {
+            if (op->type == ENV_OP_MODULE_BEGIN) {
+                skip++;
+            } else if (op->type == ENV_OP_MODULE_END) {
+                skip--;
+            }
+            continue;
+        }
+
+        switch (op->type) {
+            case ENV_OP_SET:
+                env_builder_set(env, op->name, op->value);
+                break;
+            case ENV_OP_UNSET:
+                env_builder_set(env, op->name, NULL);
+                break;
+            case ENV_OP_PREPEND:
+            case ENV_OP_APPEND:
+                value = add_elements(env_builder_get(env, op->name), op->value,
+                    op->delim, op->type == ENV_OP_PREPEND);
+                if (value == NULL) {
+                    return EMEM;
+                }
+                env_builder_set(env, op->name, value);
+                value = _free(value);
+                break;
+            case ENV_OP_MODULE_BEGIN:
+                loaded = env_builder_get(env, "LOADEDMODULES");
+                if (loaded != NULL && has_element(loaded, ':', op->name,
+                    strlen(op->name))) {
+
+                    skip = 1;
+                }
+                break;
+            case ENV_OP_MODULE_END:
+                value = add_elements(env_builder_get(env, "LOADEDMODULES"),
+                    op->name, ':', false);
+                if (value == NULL) {
+                    return EMEM;
+                }
+                env_builder_set(env, "LOADEDMODULES", value);
+                value = _free(value);
+
+                value = add_elements(env_builder_get(env, "_LMFILES_"),
+                    op->value, ':', false);
+                if (value == NULL) {
+                    return EMEM;
+                }
+                env_builder_set(env, "_LMFILES_", value);
+                value = _free(value);
+                break;
+        }
+    }
+
+    return env->failed ? EMEM : EOK;
+}
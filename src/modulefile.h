@@ -0,0 +1,78 @@
+#ifndef __MODULEFILE_H__
+#define __MODULEFILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "errors.h"
+#include "lib_common.h"
+#include "envbuilder.h"
+
+#define MODULEFILE_MAGIC "#%Module"
+
+#define ENV_OP_SET 0           /* setenv NAME value */
+#define ENV_OP_UNSET 1         /* unsetenv NAME */
+#define ENV_OP_PREPEND 2       /* prepend-path NAME value */
+#define ENV_OP_APPEND 3        /* append-path NAME value */
+#define ENV_OP_MODULE_BEGIN 4  /* start of module NAME loaded from file value */
+#define ENV_OP_MODULE_END 5    /* end of module started by ENV_OP_MODULE_BEGIN */
+
+struct env_op {
+    int type;
+    char delim;     /* element delimiter for path operations */
+    char *name;
+    char *value;
+    struct file_id id;      /* ENV_OP_MODULE_BEGIN: modulefile which was read */
+    struct file_id link_id; /* ENV_OP_MODULE_BEGIN: modulefile link itself */
+};
+
+/*
+ * List of environment operations a module performs when it is loaded. The
+ * delta doesn't depend on the current environment, it is resolved against
+ * it only when applied.
+ */
+struct env_delta {
+    struct env_op *ops;
+    int count;
+    int alloced;
+    void *map;      /* mapped cache file which names and values point to */
+    size_t map_len;
+};
+
+/*
+ * Evaluate modulefile of a module without executing modulecmd.
+ * @param[in] modname       Name of the module to evaluate.
+ * @param[in] modulepath    Colon separated list of module directories.
+ * @param[out] delta        Operations performed by the module.
+ * @param[out] _supported   False if the modulefile uses a construct which
+ *                          can't be evaluated in-process.
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc modulefile_eval(const char *modname, const char *modulepath,
+    struct env_delta *delta, bool *_supported);
+
+/*
+ * Find modulefile of module modname in directories listed in modulepath.
+ * Directories are inside the root, so is the returned path.
+ * @param[out] _path        Path which must be freed or NULL if there is no
+ *                          plain modulefile of the module.
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc modulefile_find(const char *modname, const char *modulepath,
+    char **_path);
+
+/*
+ * Apply delta to environment.
+ * @param[in] delta         Delta returned by modulefile_eval().
+ * @param[in,out] env       Environment to change.
+ * @return                  EOK on succes, EMEM if env is incomplete
+ */
+scl_rc env_delta_apply(const struct env_delta *delta, struct env_builder *env);
+
+/*
+ * Append operation to delta, nothing is appended when EMEM is returned.
+ */
+scl_rc env_delta_add(struct env_delta *delta, int type, char delim,
+    const char *name, const char *value);
+void env_delta_free(struct env_delta *delta);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#include "config.h"
+
+/*
+ * USDT probes of provider "scl" for bpftrace, perf and systemtap, e.g.:
+ *   bpftrace -e 'usdt:/usr/bin/scl:scl:run_command_entry { ... }'
+ *
+ *   run_command_entry(colname, cmd)          run_command_return(colname, rc)
+ *   fallback_run_command_entry(colname, cmd) fallback_run_command_return(colname, rc)
+ *   get_env_vars_entry(colname, count)       get_env_vars_return(colname, rc)
+ *   command_output_entry(path)               command_output_return(path, pid, bytes, ok)
+ *   list_packages_entry(colname)             list_packages_return(colname, headers, rc)
+ *   run_scriptlet_entry(program)             run_scriptlet_return(program, pid, rc)
+ *
+ * colname is the first of the given collections. Return probes of commands
+ * run with exec don't fire on success. Without <sys/sdt.h> the probes are
+ * compiled out.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(scl, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(scl, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(scl, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(scl, name, a, b, c, d)
+#else
+#define PROBE1(name, a) do {} while (0)
+#define PROBE2(name, a, b) do {} while (0)
+#define PROBE3(name, a, b, c) do {} while (0)
+#define PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+#endif
@@ -15,6 +15,9 @@
 #include "lib_common.h"
 #include "debug.h"
 #include "fallback.h"
+#include "trace.h"
+#include "stats.h"
+#include "sclconfig.h"
 
 /**
  * Prints help on stderr.
@@ -23,31 +26,69 @@
 static void print_usage( const char *name ) {
     fprintf(stderr, "usage: %s enable|run [<collection>...] <command>\n", basename(name));
     fprintf(stderr, "       %s load|unload [<collection>...]\n", basename(name));
-    fprintf(stderr, "       %s list-collections\n", basename(name));
-    fprintf(stderr, "       %s list-packages|man|register|deregister <collection>\n", basename(name));
+    fprintf(stderr, "       %s env [--format=sh|csh|json|env] <collection>...\n", basename(name));
+    fprintf(stderr, "       %s [--root <dir>] list-collections\n", basename(name));
+    fprintf(stderr, "       %s [--root <dir>] list-packages <collection>\n", basename(name));
+    fprintf(stderr, "       %s man|register|deregister <collection>\n", basename(name));
+    fprintf(stderr, "       %s [--root <dir>] cache build\n", basename(name));
+    fprintf(stderr, "       %s [--root <dir>] cache export|import <file>\n", basename(name));
+    fprintf(stderr, "       %s stats [<file>]\n", basename(name));
     fprintf(stderr, "       %s --help\n\n", basename(name));
 
     fprintf(stderr,
                  "description:\n"
                  "    enable|run            run given command from Software Collection \n"
                  "    load|unload           enable/disable collection in current shell\n"
+                 "    env                   print environment changes of given collections\n"
                  "    list-collections      list installed Software Collections\n"
                  "    list-enabled          list Software Collections enabled in current shell\n"
                  "    list-packages         list packages in Software Collection\n"
                  "    man                   show manual page about Software Collection\n"
                  "    register|deregister   register/deregister Software Collection\n"
+                 "    stats                 summarize statistics log written due to SCL_STATS\n"
+                 "    cache build           cache environment changes of installed collections\n"
+                 "    cache export|import   copy cached environment changes between hosts\n"
+                 "    --root <dir>          work with the tree under <dir> instead of /\n"
                  "    --help                show this help\n"
                  "\nUse '-' as <command> to read the command from standard input.\n");
 }
 
+/* Names of actions in statistics, indexed by ACTION_* */
+static const char *action_names[] = {
+    [ACTION_NONE] = "help",
+    [ACTION_LIST_COLLECTIONS] = "list-collections",
+    [ACTION_LIST_PACKAGES] = "list-packages",
+    [ACTION_COMMAND] = "enable",
+    [ACTION_REGISTER] = "register",
+    [ACTION_DEREGISTER] = "deregister",
+    [ACTION_MAN] = "man",
+    [ACTION_LOAD] = "load",
+    [ACTION_UNLOAD] = "unload",
+    [ACTION_VERSION] = "version",
+    [ACTION_LIST_ENABLED] = "list-enabled",
+    [ACTION_ENV] = "env",
+    [ACTION_STATS] = "stats",
+    [ACTION_CACHE_BUILD] = "cache-build",
+    [ACTION_CACHE_EXPORT] = "cache-export",
+    [ACTION_CACHE_IMPORT] = "cache-import",
+};
 
 int main(int argc, char *argv[]) {
 	int ret = EOK;
     struct scl_args *args;
-    char **pkgs = NULL;
+    char **pkgs = NULL, **cached = NULL;
+    char **installed = NULL;
     char **colls = NULL, **colls2 = NULL, **colls_merged = NULL;
+    struct arena arena = ARENA_INIT;
+    int trace_id;
 
+    const char *stats_file;
+
+    trace_init(getenv("SCL_TRACE"));
+    stats_init(scl_config_get()->stats_file);
+    trace_id = trace_begin("args", NULL);
     ret = scl_args_get(argc, argv, &args);
+    trace_end(trace_id);
     if (ret == EINPUT) {
         fprintf(stderr, "Wrong arguments specified!\n\n");
         print_usage(argv[0]);
@@ -58,7 +99,10 @@ int main(int argc, char *argv[]) {
 
         return ret;
     }
-
+    if (args->root != NULL) {
+        scl_config_set_root(args->root);
+    }
+    stats_begin(action_names[args->action], args->collections);
 
     switch (args->action) {
         case ACTION_NONE:
@@ -66,9 +110,9 @@ int main(int argc, char *argv[]) {
             break;
 
         case ACTION_LIST_COLLECTIONS:
-            ret = fallback_get_installed_collections(&colls);
+            ret = fallback_get_installed_collections(&installed);
             if (ret == EOK) {
-                print_string_array(colls);
+                print_string_array(installed);
             }
             break;
 
@@ -100,17 +144,20 @@ int main(int argc, char *argv[]) {
             debug("Missing function scl in your environment!!!\n");
             ret = ECONFIG;
             break;
+        case ACTION_ENV:
+            ret = print_env(args->collections, args->env_format);
+            break;
         case ACTION_VERSION:
             printf("%s\n", get_version());
             break;
         case ACTION_LIST_ENABLED:
             /* Get enabled collections of new type */
-            ret = get_enabled_collections(&colls);
+            ret = get_enabled_collections(&arena, &colls);
             if (ret != EOK) {
                 break;
             }
             /* Get enabled collections of old type */
-            ret = fallback_get_enabled_collections(&colls2);
+            ret = fallback_get_enabled_collections(&arena, &colls2);
             if (ret != EOK) {
                 break;
             }
@@ -123,15 +170,49 @@ int main(int argc, char *argv[]) {
             colls_merged = merge_string_arrays(colls, colls2);
             print_string_array(colls_merged);
 
+            break;
+        case ACTION_STATS:
+            /* Don't count summaries among the runs */
+            stats_init(NULL);
+            stats_file = args->stats_file;
+            if (stats_file == NULL) {
+                stats_file = scl_config_get()->stats_file;
+            }
+            if (stats_file == NULL || *stats_file == '\0') {
+                fprintf(stderr, "No statistics file, pass it or set SCL_STATS!\n");
+                ret = EINPUT;
+                break;
+            }
+            ret = stats_summary(stats_file, stdout);
+            break;
+        case ACTION_CACHE_BUILD:
+            ret = build_cache(&cached);
+            if (ret == EOK) {
+                print_string_array(cached);
+            }
+            break;
+        case ACTION_CACHE_EXPORT:
+            ret = export_cache(args->bundle_file, &cached);
+            if (ret == EOK) {
+                print_string_array(cached);
+            }
+            break;
+        case ACTION_CACHE_IMPORT:
+            ret = import_cache(args->bundle_file, &cached);
+            if (ret == EOK) {
+                print_string_array(cached);
+            }
             break;
     }
+    stats_finish(ret, false);
 
     scl_args_free(args);
-    free(args);
+    args = _free(args);
     free_string_array(pkgs);
-    free_string_array(colls);
-    free_string_array(colls2);
-    free_string_array(colls_merged);
+    free_string_array(installed);
+    free_string_array(cached);
+    colls_merged = _free(colls_merged);
+    arena_release(&arena);
     release_scllib_cache();
     return ret;
 }
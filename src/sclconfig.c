@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "debug.h"
+#include "sclmalloc.h"
+#include "sclconfig.h"
+
+/*
+ * Resolved values are stored in static buffers, nothing is allocated, so
+ * that the configuration can't fail and doesn't show up in allocation
+ * statistics.
+ */
+struct setting {
+    const char *key;        /* key in the configuration file */
+    const char *env;        /* variable of environment */
+    const char *def;        /* built-in default, NULL for none */
+    bool dir;               /* strip trailing slashes */
+    bool absolute;          /* only absolute paths are accepted */
+    bool rooted;            /* path is inside the root, else on the host */
+    bool set;               /* value was given by environment or file */
+    char value[PATH_MAX];
+};
+
+enum {
+    SET_CONF_DIR,
+    SET_MODULES_PATH,
+    SET_MODULE_CMD,
+    SET_CACHE_DIR,
+    SET_STATS_FILE,
+    SET_SCLD_SOCKET,
+    SETTINGS
+};
+
+static struct setting settings[SETTINGS] = {
+    [SET_CONF_DIR] = {"conf_dir", "SCL_CONF_DIR", SCL_CONF_DIR, true, true,
+        true},
+    [SET_MODULES_PATH] = {"modules_path", "SCL_MODULES_PATH",
+        SCL_MODULES_PATH, true, true, true},
+    [SET_MODULE_CMD] = {"module_cmd", "SCL_MODULE_CMD", MODULE_CMD, false,
+        true, false},
+    [SET_CACHE_DIR] = {"cache_dir", "SCL_CACHE_DIR", SCL_CACHE_DIR, true,
+        true, true},
+    [SET_STATS_FILE] = {"stats_file", "SCL_STATS", NULL, false, false,
+        false},
+    [SET_SCLD_SOCKET] = {"scld_socket", "SCLD_SOCKET", SCLD_SOCKET, false,
+        true, false},
+};
+
+static char root[PATH_MAX];
+static struct scl_config config;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Store value of setting s, returns false if the value isn't acceptable.
+ */
+static bool set_value(struct setting *s, const char *value, size_t len)
+{
+    if (len == 0 || len >= sizeof(s->value) ||
+        (s->absolute && value[0] != '/')) {
+
+        return false;
+    }
+
+    memcpy(s->value, value, len);
+    s->value[len] = '\0';
+    if (s->dir) {
+        while (len > 1 && s->value[len - 1] == '/') {
+            s->value[--len] = '\0';
+        }
+    }
+    s->set = true;
+
+    return true;
+}
+
+/*
+ * Read the configuration file at path. The file of the tree under the root
+ * describes only the tree, it can't choose programs and files of the host.
+ */
+static void read_config_file(const char *path, bool tree)
+{
+    char line[PATH_MAX + 64];
+    char *key, *value, *end;
+    int lineno = 0;
+    FILE *fp;
+
+    fp = fopen(path, "re");
+    if (fp == NULL) {
+        if (errno != ENOENT) {
+            debug("Cannot open configuration %s: %s\n", path, strerror(errno));
+        }
+        return;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        key = line + strspn(line, " \t");
+        if (*key == '#' || *key == '\n' || *key == '\0') {
+            continue;
+        }
+
+        value = strchr(key, '=');
+        if (value == NULL) {
+            debug("%s:%d: expected key = value\n", path, lineno);
+            continue;
+        }
+        for (end = value; end > key && strchr(" \t=", end[-1]); end--);
+        *end = '\0';
+        value += 1 + strspn(value + 1, " \t");
+        for (end = value + strlen(value); end > value &&
+            strchr(" \t\r\n", end[-1]); end--);
+
+        for (int i = 0; i < SETTINGS; i++) {
+            if (strcmp(key, settings[i].key)) {
+                continue;
+            }
+            /* Variables of environment take precedence */
+            if (tree && !settings[i].rooted) {
+                debug("%s:%d: %s is ignored in the tree\n", path, lineno,
+                    key);
+            } else if (!settings[i].set &&
+                !set_value(&settings[i], value, end - value)) {
+
+                debug("%s:%d: invalid value of %s\n", path, lineno, key);
+            }
+            key = NULL;
+            break;
+        }
+        if (key != NULL) {
+            debug("%s:%d: unknown key %s\n", path, lineno, key);
+        }
+    }
+
+    fclose(fp);
+}
+
+/*
+ * Prepend the root to the value of setting s.
+ */
+static void add_root(struct setting *s)
+{
+    size_t root_len = strlen(root), len = strlen(s->value);
+
+    if (root_len + len >= sizeof(s->value)) {
+        debug("Path %s%s is too long!\n", root, s->value);
+        len = sizeof(s->value) - root_len - 1;
+    }
+    memmove(s->value + root_len, s->value, len + 1);
+    memcpy(s->value, root, root_len);
+    s->value[root_len + len] = '\0';
+}
+
+static void resolve_config()
+{
+    const char *path = getenv("SCL_CONFIG");
+    char file[PATH_MAX + sizeof(SCL_CONFIG_FILE)];
+    const char *value;
+    struct setting *s;
+    bool tree = false;
+
+    for (int i = 0; i < SETTINGS; i++) {
+        s = &settings[i];
+        s->set = false;
+        value = getenv(s->env);
+        if (value != NULL && !set_value(s, value, strlen(value)) &&
+            *value != '\0') {
+
+            debug("Ignoring invalid value of %s: %s\n", s->env, value);
+        }
+    }
+
+    if (path == NULL || path[0] != '/') {
+        snprintf(file, sizeof(file), "%s%s", root, SCL_CONFIG_FILE);
+        path = file;
+        tree = root[0] != '\0';
+    }
+    read_config_file(path, tree);
+
+    for (int i = 0; i < SETTINGS; i++) {
+        s = &settings[i];
+        if (!s->set && s->def != NULL) {
+            set_value(s, s->def, strlen(s->def));
+            s->set = false;
+        }
+        if (s->rooted && root[0] != '\0') {
+            add_root(s);
+        }
+    }
+
+    config.conf_dir = settings[SET_CONF_DIR].value;
+    config.modules_path = settings[SET_MODULES_PATH].value;
+    config.module_cmd = settings[SET_MODULE_CMD].value;
+    config.cache_dir = settings[SET_CACHE_DIR].value;
+    config.stats_file = settings[SET_STATS_FILE].set ?
+        settings[SET_STATS_FILE].value : NULL;
+    config.root = root;
+
+    /*
+     * The default daemon answers for the default directories, it can't be
+     * asked about other ones. A daemon never answers for another tree.
+     */
+    if (root[0] != '\0') {
+        config.scld_socket = NULL;
+    } else if (settings[SET_SCLD_SOCKET].set ||
+        (!settings[SET_CONF_DIR].set && !settings[SET_MODULES_PATH].set)) {
+
+        config.scld_socket = settings[SET_SCLD_SOCKET].value;
+    } else {
+        config.scld_socket = NULL;
+    }
+}
+
+const struct scl_config *scl_config_get()
+{
+    pthread_once(&config_once, resolve_config);
+
+    return &config;
+}
+
+void scl_config_set_root(const char *_root)
+{
+    size_t len = strlen(_root);
+
+    pthread_once(&config_once, resolve_config);
+
+    /* "/" is no root at all */
+    while (len > 0 && _root[len - 1] == '/') {
+        len--;
+    }
+    if (len >= sizeof(root)) {
+        len = sizeof(root) - 1;
+    }
+    memcpy(root, _root, len);
+    root[len] = '\0';
+
+    resolve_config();
+}
+
+const char *root_path(struct arena *arena, const char *path)
+{
+    return root[0] == '\0' ? path : arena_asprintf(arena, "%s%s", root, path);
+}
+
+char *conf_file_path(struct arena *arena, const char *colname)
+{
+    return arena_asprintf(arena, "%s/%s", scl_config_get()->conf_dir, colname);
+}
+
+char *modulefile_path(struct arena *arena, const char *colname)
+{
+    return arena_asprintf(arena, "%s/%s", scl_config_get()->modules_path,
+        colname);
+}
@@ -0,0 +1,62 @@
+#ifndef __SCLCONFIG_H__
+#define __SCLCONFIG_H__
+
+#include "sclmalloc.h"
+
+/*
+ * Locations scl works with. Every setting is taken from the first of:
+ *   variable of environment      e.g. SCL_CONF_DIR=/srv/tenant/conf
+ *   configuration file           e.g. conf_dir = /srv/tenant/conf
+ *   built-in default from config.h
+ * The configuration file is SCL_CONFIG_FILE or the file named by variable
+ * SCL_CONFIG. Lines of the file are "key = value", lines starting with '#'
+ * are comments. Paths other than stats_file have to be absolute,
+ * directories are stored without trailing slashes.
+ *
+ * When scl works with a tree other than / (scl --root), the configuration
+ * file and the directories are looked up inside the tree and the root is
+ * included in them. module_cmd and stats_file are paths of the host, the
+ * configuration file of the tree can't set them, and scld isn't used.
+ */
+struct scl_config {
+    const char *conf_dir;       /* conf_dir, SCL_CONF_DIR */
+    const char *modules_path;   /* modules_path, SCL_MODULES_PATH */
+    const char *module_cmd;     /* module_cmd, SCL_MODULE_CMD */
+    const char *cache_dir;      /* cache_dir, SCL_CACHE_DIR */
+    const char *stats_file;     /* stats_file, SCL_STATS, NULL if disabled */
+    /*
+     * scld_socket, SCLD_SOCKET. NULL if scld can't be used, because it
+     * answers for the default directories and they were overridden.
+     */
+    const char *scld_socket;
+    const char *root;           /* "" unless --root was given */
+};
+
+/*
+ * Return configuration of the process, it is resolved on the first call
+ * and never changes afterwards.
+ */
+const struct scl_config *scl_config_get();
+
+/*
+ * Work with the tree under root instead of /, the configuration is
+ * resolved again. It has to be called before other threads use the
+ * configuration.
+ */
+void scl_config_set_root(const char *root);
+
+/*
+ * Path under the root of a path inside the tree, e.g. of a collection
+ * prefix read from its configuration file. Returns path itself when there
+ * is no root, otherwise the result is allocated from arena.
+ */
+const char *root_path(struct arena *arena, const char *path);
+
+/*
+ * Paths of the file with prefix of collection colname and of its
+ * modulefile, allocated from arena.
+ */
+char *conf_file_path(struct arena *arena, const char *colname);
+char *modulefile_path(struct arena *arena, const char *colname);
+
+#endif
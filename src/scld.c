@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+
+#include "config.h"
+#include "errors.h"
+#include "debug.h"
+#include "scllib.h"
+#include "sclmalloc.h"
+#include "lib_common.h"
+#include "modulefile.h"
+#include "cache.h"
+#include "scld.h"
+#include "sclconfig.h"
+
+/*
+ * scld keeps answers about collections in memory. Installed collections
+ * change only when files in conf_dir or modules_path change, which
+ * inotify reports. Modulefiles may be symlinks pointing elsewhere, so
+ * cached deltas are additionally checked against the files they were
+ * computed from, like the disk cache does.
+ *
+ * The daemon usually runs as root and anybody can connect to it, while
+ * MODULEPATH comes from the client. Only deltas of modulefiles from
+ * modules_path, which belongs to the administrator, are therefore
+ * answered. Clients evaluate other modulefiles themselves, with their own
+ * permissions.
+ *
+ * Clients are served in turns by the poll loop, every one reads or writes
+ * only as much as its socket takes, so a slow client delays nobody. A
+ * request has to arrive and its answer has to be taken before a deadline,
+ * otherwise the connection is closed.
+ */
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+    IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+#define MAX_CLIENTS 64
+#define REQUEST_TIMEOUT 1000    /* ms to send a request and take its answer */
+
+struct answer {
+    char *colname;
+    char *modulepath;
+    struct scld_response response;
+    char *data;
+};
+
+struct client {
+    int fd;
+    char *buf;          /* request being read or answer being written */
+    size_t len;         /* bytes read or written so far */
+    size_t size;        /* bytes expected */
+    bool writing;
+    long long deadline; /* ms of monotonic clock */
+};
+
+static struct answer *answers = NULL;
+static int answer_count = 0;
+static int inotify_fd = -1;
+static bool watching = false;
+static volatile sig_atomic_t terminate = 0;
+
+static void flush_answers()
+{
+    for (int i = 0; i < answer_count; i++) {
+        answers[i].colname = _free(answers[i].colname);
+        answers[i].modulepath = _free(answers[i].modulepath);
+        answers[i].data = _free(answers[i].data);
+    }
+    answers = _free(answers);
+    answer_count = 0;
+
+    release_scllib_cache();
+}
+
+/*
+ * Answers can be kept only while both directories are watched.
+ */
+static void watch_dirs()
+{
+    const struct scl_config *config = scl_config_get();
+
+    if (watching) {
+        return;
+    }
+
+    watching = inotify_add_watch(inotify_fd, config->conf_dir,
+        WATCH_EVENTS) != -1 && inotify_add_watch(inotify_fd,
+        config->modules_path, WATCH_EVENTS) != -1;
+}
+
+static void read_events()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *) p;
+            if (event->mask & (IN_IGNORED | IN_Q_OVERFLOW)) {
+                /* Directory is gone, watch it again once it's back */
+                watching = false;
+            }
+        }
+        flush_answers();
+    }
+}
+
+static bool answer_valid(const struct answer *answer)
+{
+    struct env_cache_key key;
+    struct env_delta delta = {NULL, 0, 0};
+    bool valid;
+
+    if (answer->response.status != SCLD_DELTA) {
+        return true;
+    }
+
+    if (env_cache_key_init(&key, answer->colname, answer->modulepath) != EOK) {
+        return false;
+    }
+    valid = env_cache_decode(&key, answer->data, answer->response.len, true,
+        &delta);
+
+    /* Strings of decoded delta point into answer->data */
+    delta.ops = _free(delta.ops);
+    env_cache_key_free(&key);
+
+    return valid;
+}
+
+/*
+ * Return true if all modulefiles read by delta are in modules_path.
+ */
+static bool from_modules_path(const struct env_delta *delta)
+{
+    const char *modules_path = scl_config_get()->modules_path;
+    size_t len = strlen(modules_path);
+
+    for (int i = 0; i < delta->count; i++) {
+        if (delta->ops[i].type == ENV_OP_MODULE_BEGIN &&
+            (strncmp(delta->ops[i].value, modules_path, len) ||
+            delta->ops[i].value[len] != '/')) {
+
+            return false;
+        }
+    }
+    return true;
+}
+
+static void compute_answer(struct answer *answer)
+{
+    struct env_cache_key key;
+    struct env_delta delta = {NULL, 0, 0};
+    size_t len = 0;
+    bool exists, supported;
+
+    answer->response.status = SCLD_ERROR;
+    answer->response.len = 0;
+    answer->data = _free(answer->data);
+
+    if (collection_exists(answer->colname, &exists) != EOK) {
+        return;
+    }
+    if (!exists) {
+        answer->response.status = SCLD_NOT_INSTALLED;
+        return;
+    }
+
+    if (env_cache_key_init(&key, answer->colname, answer->modulepath) != EOK) {
+        return;
+    }
+
+    if (modulefile_eval(answer->colname, answer->modulepath, &delta,
+        &supported) == EOK) {
+
+        if (supported && !from_modules_path(&delta)) {
+            debug("Collection %s loads modulefiles from outside of %s, the "
+                "client has to evaluate them.\n", answer->colname,
+                scl_config_get()->modules_path);
+            env_delta_free(&delta);
+        } else if (supported) {
+            env_cache_encode(&key, &delta, &answer->data, &len);
+            answer->response.status = SCLD_DELTA;
+            answer->response.len = len;
+            env_delta_free(&delta);
+        } else {
+            answer->response.status = SCLD_UNSUPPORTED;
+        }
+    }
+    env_cache_key_free(&key);
+}
+
+static const struct answer *get_answer(const char *colname,
+    const char *modulepath)
+{
+    static struct answer uncached = {NULL, NULL, {0, 0}, NULL};
+    struct answer *answer;
+
+    /* Changes have to be seen before the request is answered */
+    read_events();
+    watch_dirs();
+    if (!watching) {
+        flush_answers();
+        uncached.colname = (char *) colname;
+        uncached.modulepath = (char *) modulepath;
+        compute_answer(&uncached);
+        return &uncached;
+    }
+
+    for (int i = 0; i < answer_count; i++) {
+        answer = &answers[i];
+        if (!strcmp(answer->colname, colname) &&
+            !strcmp(answer->modulepath, modulepath)) {
+
+            if (!answer_valid(answer)) {
+                compute_answer(answer);
+            }
+            return answer;
+        }
+    }
+
+    answers = xrealloc(answers, (answer_count + 1) * sizeof(*answers));
+    answer = &answers[answer_count++];
+    memset(answer, 0, sizeof(*answer));
+    answer->colname = xstrdup(colname);
+    answer->modulepath = xstrdup(modulepath);
+    compute_answer(answer);
+
+    return answer;
+}
+
+static long long now_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Wait for the next request of client.
+ */
+static void client_reset(struct client *client)
+{
+    client->buf = xrealloc(client->buf, sizeof(struct scld_request));
+    client->len = 0;
+    client->size = sizeof(struct scld_request);
+    client->writing = false;
+    client->deadline = now_ms() + REQUEST_TIMEOUT;
+}
+
+/*
+ * Replace complete request of client by its answer. Returns false if the
+ * request is invalid.
+ */
+static bool answer_request(struct client *client)
+{
+    const struct scld_request *request = (const void *) client->buf;
+    const struct answer *answer;
+    char *colname, *modulepath, *buf;
+    size_t colname_len, size;
+
+    colname = client->buf + sizeof(*request);
+    if (colname[request->len - 1] != '\0') {
+        return false;
+    }
+    colname_len = strlen(colname) + 1;
+    if (colname_len == request->len) {
+        return false;
+    }
+    modulepath = colname + colname_len;
+
+    /* Answers change while other clients are served, copy it */
+    answer = get_answer(colname, modulepath);
+    size = sizeof(answer->response) + answer->response.len;
+    buf = xmalloc(size);
+    memcpy(buf, &answer->response, sizeof(answer->response));
+    memcpy(buf + sizeof(answer->response), answer->data,
+        answer->response.len);
+
+    client->buf = _free(client->buf);
+    client->buf = buf;
+    client->len = 0;
+    client->size = size;
+    client->writing = true;
+
+    return true;
+}
+
+/*
+ * Read or write as much as the socket of client takes. Returns false when
+ * the connection has to be closed.
+ */
+static bool serve_client(struct client *client)
+{
+    const struct scld_request *request;
+    ssize_t n;
+
+    if (client->writing) {
+        n = send(client->fd, client->buf + client->len,
+            client->size - client->len, MSG_NOSIGNAL);
+    } else {
+        n = recv(client->fd, client->buf + client->len,
+            client->size - client->len, 0);
+    }
+    if (n == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (n == 0) {
+        return false;
+    }
+
+    client->len += n;
+    if (client->len < client->size) {
+        return true;
+    }
+
+    if (client->writing) {
+        client_reset(client);
+        return true;
+    }
+
+    /* Header is complete, the rest of the request follows */
+    if (client->size == sizeof(*request)) {
+        request = (const void *) client->buf;
+        if (request->version != SCLD_VERSION || request->len < 2 ||
+            request->len > SCLD_MAX_REQUEST) {
+
+            return false;
+        }
+        client->size += request->len;
+        client->buf = xrealloc(client->buf, client->size);
+        return true;
+    }
+
+    return answer_request(client);
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    char *dir;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        debug("Socket path %s is too long!\n", path);
+        return -1;
+    }
+
+    dir = directory_name(path);
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        debug("Cannot create directory %s: %s\n", dir, strerror(errno));
+        dir = _free(dir);
+        return -1;
+    }
+    dir = _free(dir);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        debug("Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Socket left behind by previous instance */
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        chmod(path, 0666) == -1 || listen(fd, 64) == -1) {
+
+        debug("Cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void handle_signal(int sig)
+{
+    terminate = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = scld_socket_path();
+    struct client clients[MAX_CLIENTS];
+    struct pollfd fds[2 + MAX_CLIENTS];
+    struct sigaction sa;
+    int listen_fd, client_fd, client_count = 0, timeout;
+    long long now;
+    bool keep;
+
+    if (argc == 3 && !strcmp(argv[1], "--socket") && argv[2][0] == '/') {
+        path = argv[2];
+    } else if (argc != 1) {
+        fprintf(stderr, "usage: %s [--socket <path>]\n", argv[0]);
+        return EINPUT;
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Directories differ from the default ones, "
+            "pass --socket or set SCLD_SOCKET!\n");
+        return EINPUT;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        debug("Cannot initialize inotify: %s\n", strerror(errno));
+        return ESYS;
+    }
+
+    listen_fd = listen_socket(path);
+    if (listen_fd == -1) {
+        return ESYS;
+    }
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = inotify_fd;
+    fds[1].events = POLLIN;
+
+    while (!terminate) {
+        timeout = -1;
+        now = now_ms();
+        for (int i = 0; i < client_count; i++) {
+            fds[2 + i].fd = clients[i].fd;
+            fds[2 + i].events = clients[i].writing ? POLLOUT : POLLIN;
+            if (clients[i].deadline <= now) {
+                timeout = 0;
+            } else if (timeout == -1 || clients[i].deadline - now < timeout) {
+                timeout = clients[i].deadline - now;
+            }
+        }
+
+        if (poll(fds, 2 + client_count, timeout) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("poll() failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            read_events();
+        }
+
+        now = now_ms();
+        for (int i = 0; i < client_count; i++) {
+            keep = true;
+            if (fds[2 + i].revents != 0) {
+                keep = serve_client(&clients[i]);
+            }
+            if (!keep || clients[i].deadline <= now) {
+                close(clients[i].fd);
+                clients[i].buf = _free(clients[i].buf);
+                clients[i] = clients[--client_count];
+                fds[2 + i] = fds[2 + client_count];
+                i--;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            client_fd = accept4(listen_fd, NULL, NULL,
+                SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (client_fd == -1) {
+                continue;
+            }
+
+            /* Clients which don't fit compute the answers themselves */
+            if (client_count == MAX_CLIENTS) {
+                close(client_fd);
+                continue;
+            }
+            memset(&clients[client_count], 0, sizeof(*clients));
+            clients[client_count].fd = client_fd;
+            client_reset(&clients[client_count++]);
+        }
+    }
+
+    for (int i = 0; i < client_count; i++) {
+        close(clients[i].fd);
+        clients[i].buf = _free(clients[i].buf);
+    }
+    unlink(path);
+    close(listen_fd);
+    close(inotify_fd);
+    flush_answers();
+
+    return EOK;
+}
@@ -0,0 +1,59 @@
+#ifndef __SCLD_H__
+#define __SCLD_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "modulefile.h"
+
+/*
+ * Protocol of scld, the environment server. A client sends requests over
+ * one connection, every request is struct scld_request followed by len
+ * bytes: NUL-terminated name of collection and NUL-terminated MODULEPATH.
+ * The daemon answers with struct scld_response followed by len bytes of
+ * delta encoded by env_cache_encode() when status is SCLD_DELTA.
+ */
+#define SCLD_VERSION 1
+#define SCLD_MAX_REQUEST 65536
+
+#define SCLD_DELTA 0            /* delta of collection follows */
+#define SCLD_UNSUPPORTED 1      /* modulefile has to be run by modulecmd */
+#define SCLD_NOT_INSTALLED 2    /* collection doesn't exist */
+#define SCLD_ERROR 3            /* daemon can't answer, compute it yourself */
+
+struct scld_request {
+    uint32_t version;
+    uint32_t len;
+};
+
+struct scld_response {
+    uint32_t status;
+    uint32_t len;
+};
+
+/*
+ * Return path of the daemon socket from the configuration, NULL if the
+ * daemon can't be used with the configured directories.
+ */
+const char *scld_socket_path();
+
+/*
+ * Connect to the daemon. Only a daemon running as root or as the current
+ * user is accepted.
+ * @return                  connected socket or -1 if daemon isn't reachable
+ */
+int scld_connect();
+
+/*
+ * Ask the daemon about collection colname.
+ * @param[in] fd            Socket returned by scld_connect().
+ * @param[in] colname       Name of collection.
+ * @param[in] modulepath    Value of MODULEPATH.
+ * @param[out] _status      SCLD_DELTA, SCLD_UNSUPPORTED or SCLD_NOT_INSTALLED.
+ * @param[out] delta        Delta of collection if status is SCLD_DELTA, it
+ *                          must be released by env_delta_free().
+ * @return                  false if the daemon didn't answer
+ */
+bool scld_query(int fd, const char *colname, const char *modulepath,
+    int *_status, struct env_delta *delta);
+
+#endif
@@ -0,0 +1,131 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "sclmalloc.h"
+#include "lib_common.h"
+#include "cache.h"
+#include "scld.h"
+#include "sclconfig.h"
+
+const char *scld_socket_path()
+{
+    return scl_config_get()->scld_socket;
+}
+
+int scld_connect()
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = {1, 0};
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    const char *path = scld_socket_path();
+    int fd;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* Stuck daemon must not stop the command from running */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 ||
+        (cred.uid != 0 && cred.uid != getuid())) {
+
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool scld_query(int fd, const char *colname, const char *modulepath,
+    int *_status, struct env_delta *delta)
+{
+    struct scld_request request;
+    struct scld_response response;
+    struct env_cache_key key;
+    size_t colname_len = strlen(colname) + 1;
+    size_t modulepath_len;
+    char *buf = NULL;
+    void *map;
+    bool ret = false;
+
+    if (modulepath == NULL) {
+        modulepath = "";
+    }
+    modulepath_len = strlen(modulepath) + 1;
+    if (colname_len + modulepath_len > SCLD_MAX_REQUEST) {
+        return false;
+    }
+
+    request.version = SCLD_VERSION;
+    request.len = colname_len + modulepath_len;
+    buf = xmalloc(sizeof(request) + request.len);
+    if (buf == NULL) {
+        return false;
+    }
+    memcpy(buf, &request, sizeof(request));
+    memcpy(buf + sizeof(request), colname, colname_len);
+    memcpy(buf + sizeof(request) + colname_len, modulepath, modulepath_len);
+
+    if (!write_all(fd, buf, sizeof(request) + request.len) ||
+        !read_all(fd, &response, sizeof(response))) {
+
+        goto exit;
+    }
+
+    switch (response.status) {
+        case SCLD_UNSUPPORTED:
+        case SCLD_NOT_INSTALLED:
+            ret = response.len == 0;
+            break;
+        case SCLD_DELTA:
+            if (response.len == 0) {
+                break;
+            }
+
+            /* Strings of the delta point into the map released with it */
+            map = mmap(NULL, response.len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (map == MAP_FAILED) {
+                break;
+            }
+            key.modname = (char *) colname;
+            key.modulepath = (char *) modulepath;
+            if (!read_all(fd, map, response.len) ||
+                !env_cache_decode(&key, map, response.len, false, delta)) {
+
+                munmap(map, response.len);
+                break;
+            }
+            delta->map = map;
+            delta->map_len = response.len;
+            ret = true;
+            break;
+    }
+
+    if (ret) {
+        *_status = response.status;
+    }
+
+exit:
+    buf = _free(buf);
+
+    return ret;
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <rpm/rpmlib.h>
@@ -12,6 +13,8 @@
 #include <errno.h>
 #include <wordexp.h>
 #include <signal.h>
+#include <dirent.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "errors.h"
@@ -20,128 +23,371 @@
 #include "lib_common.h"
 #include "sclmalloc.h"
 #include "fallback.h"
+#include "modulefile.h"
+#include "cache.h"
+#include "envbuilder.h"
+#include "scld.h"
+#include "libscl.h"
+#include "trace.h"
+#include "stats.h"
+#include "probes.h"
+#include "sclconfig.h"
 #include "ctype.h"
 
-char **installed_collections = NULL;
+/*
+ * List of installed collections shared by threads using the same context.
+ * It is immutable, a new list replaces it when modules_path changes.
+ */
+struct collection_list {
+    char **names;
+    int refs;               /* protected by lock of the context */
+    struct file_id dir_id;  /* identity of modules_path the list is for */
+};
 
-static scl_rc initialize_env()
-{
-    char *module_path = getenv("MODULEPATH");
-    char *new_module_env;
+/*
+ * Context of library calls, it owns caches. Locations come from the
+ * configuration of the process, see scl_config_get().
+ */
+struct scl_ctx {
+    pthread_mutex_t lock;
+    struct collection_list *collections;
+};
 
-    if (!module_path || !strstr(module_path, SCL_MODULES_PATH)) {
+/* Context of functions declared in scllib.h */
+static struct scl_ctx default_ctx = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .collections = NULL,
+};
 
-        if (module_path) {
-            xasprintf(&new_module_env, "MODULEPATH=" SCL_MODULES_PATH ":%s",
-                module_path);
-        } else {
-            xasprintf(&new_module_env, "MODULEPATH=" SCL_MODULES_PATH);
-        }
+/*
+ * Make sure that modulefiles of collections are found through MODULEPATH.
+ * Directories of MODULEPATH are inside the root.
+ */
+static scl_rc add_modulepath(struct env_builder *env)
+{
+    const struct scl_config *config = scl_config_get();
+    const char *modules_path = config->modules_path + strlen(config->root);
+    const char *module_path = env_builder_get(env, "MODULEPATH");
+    char *new_module_path;
 
-        if(putenv(new_module_env) != 0) {
-            debug("Impossible to create environment variable %s: %s\n",
-                new_module_env, strerror(errno));
-            return ESYS;
-        }
+    if (module_path != NULL && strstr(module_path, modules_path)) {
+        return EOK;
     }
 
-    return EOK;
+    if (module_path != NULL) {
+        xasprintf(&new_module_path, "%s:%s", modules_path, module_path);
+    } else {
+        new_module_path = xstrdup(modules_path);
+    }
+    if (new_module_path == NULL) {
+        return EMEM;
+    }
+    env_builder_set(env, "MODULEPATH", new_module_path);
+    new_module_path = _free(new_module_path);
+
+    return env->failed ? EMEM : EOK;
 }
 
-static scl_rc get_env_vars(const char *colname, char ***_vars)
+/*
+ * Get environment delta of a collection without executing modulecmd.
+ * _supported is set to false if the modulefile of collection has to be
+ * evaluated by modulecmd.
+ */
+static scl_rc get_module_delta(const char *colname, const char *modulepath,
+    struct env_delta *delta, bool *_supported)
 {
-    char *argv[] = {MODULE_CMD, MODULE_CMD, "sh", "add", "", NULL};
-    char *output = NULL;
-    int i = 0;
-    char **parts, *part, **vars;
+    struct env_cache_key key;
     scl_rc ret = EOK;
 
-    ret = initialize_env();
+    ret = env_cache_key_init(&key, colname, modulepath);
     if (ret != EOK) {
         return ret;
     }
 
-    argv[4] = (char *) colname;
-    output = get_command_output(argv[0], argv + 1, STDOUT_FILENO);
-    if (output == NULL) {
-        debug("Problem with executing program %s: %s\n", argv[0],
-            strerror(errno));
-        ret = ERUN;
+    /*
+     * Most modulefiles use only a few simple commands, evaluate them
+     * directly and spare the modulecmd execution. The result doesn't depend
+     * on the current environment so it can be cached.
+     */
+    if (env_cache_load(&key, delta)) {
+        *_supported = true;
+    } else {
+        ret = modulefile_eval(colname, key.modulepath, delta, _supported);
+        if (ret == EOK && *_supported) {
+            env_cache_store(&key, delta);
+        }
+    }
+    env_cache_key_free(&key);
+
+    return ret;
+}
+
+/*
+ * Add environment variables of collections to env, all collections are
+ * evaluated by a single modulecmd run.
+ */
+static bool feed_parser(const char *data, size_t len, void *parser)
+{
+    env_parser_feed(parser, data, len);
+    return !((struct env_parser *) parser)->failed;
+}
+
+static scl_rc get_env_vars(char *const colnames[], int count,
+    struct env_builder *env)
+{
+    char **argv;
+    char *const *envp;
+    struct env_parser parser;
+    scl_rc ret = EOK;
+
+    PROBE2(get_env_vars_entry, colnames[0], count);
+    env_parser_init(&parser);
+    argv = xcalloc(count + 5, sizeof(*argv));
+    envp = env_builder_envp(env);
+    if (argv == NULL || envp == NULL) {
+        ret = EMEM;
         goto exit;
     }
+    argv[0] = (char *) scl_config_get()->module_cmd;
+    argv[1] = argv[0];
+    argv[2] = "sh";
+    argv[3] = "add";
+    memcpy(argv + 4, colnames, count * sizeof(*argv));
 
     /*
-     * Expected format of string stored in variable output is following:
+     * Expected format of output of MODULE_CMD is following:
      * var1=value1 ;export value1 ; var2=value2 ;export value2;
      * var3=value\ with\ spaces
      * NOTE: Newer (tcl-based) versions of MODULE_CMD put a newline after each
      * export command so we need to take that into account.
+     *
+     * The output is parsed while modulecmd writes it, but variables are set
+     * only if it succeeds.
      */
+    if (!stream_command_output(argv[0], argv + 1, envp, STDOUT_FILENO,
+        feed_parser, &parser)) {
 
-    vars = parts = split(output, ';');
-
-    /* Filter out strings without "=" i. e. strings with export. */
-    while (*parts != NULL) {
-        part = *parts;
-        if (part[0] == '\n')
-            part++;
-        if (strchr(part, '=')) {
-            strip_trailing_chars(part, ' ');
-            unescape_string(part);
-            vars[i++] = xstrdup(part);
+        if (parser.failed) {
+            ret = EMEM;
+            goto exit;
         }
-        parts++;
+        debug("Problem with executing program %s: %s\n", argv[0],
+            strerror(errno));
+        ret = ERUN;
+        goto exit;
+    }
+    env_parser_apply(&parser, env);
+    if (parser.failed || env->failed) {
+        ret = EMEM;
     }
-    vars[i] = NULL;
-    *_vars = vars;
 
 exit:
-    output = _free(output);
+    env_parser_free(&parser);
+    argv = _free(argv);
+    PROBE2(get_env_vars_return, colnames[0], ret);
+    return ret;
+}
+
+/*
+ * Enable collections which have to be evaluated by modulecmd, all of them
+ * are passed to a single modulecmd run.
+ */
+static scl_rc enable_pending(char *const colnames[], int count,
+    struct env_builder *env)
+{
+    scl_rc ret = EOK;
+
+    if (count == 0) {
+        return EOK;
+    }
+
+    ret = get_env_vars(colnames, count, env);
+    if (ret != EOK && ret != EMEM) {
+        /* Find out which collection caused the failure */
+        for (int i = 0; i < count && count > 1; i++) {
+            if (get_env_vars(colnames + i, 1, env) != EOK) {
+                debug("Unable to enable collection %s!\n", colnames[i]);
+                break;
+            }
+        }
+    }
+
     return ret;
 }
-scl_rc get_enabled_collections(char ***_enabled_collections)
+
+scl_rc get_enabled_collections(struct arena *arena,
+    char ***_enabled_collections)
 {
     char **enabled_collections = NULL;
-    char *lm_files = getenv("_LMFILES_");
+    const char *lm_files = getenv("_LMFILES_");
+    const char *modules_path = scl_config_get()->modules_path;
+    size_t prefix_len = strlen(modules_path);
+    struct tokenizer tok;
+    struct strview file;
+    int i = 0;
 
     if (lm_files != NULL) {
-        lm_files = xstrdup(lm_files);
-        enabled_collections = split(lm_files, ':');
+        enabled_collections = arena_alloc(arena,
+            (count_words(lm_files, ':') + 1) * sizeof(*enabled_collections));
+        tokenizer_init(&tok, lm_files, strlen(lm_files), ':');
 
-        for (int i = 0; enabled_collections[i] != NULL; i++) {
-            if (!strncmp(SCL_MODULES_PATH, enabled_collections[i],
-                sizeof(SCL_MODULES_PATH - 1))){
+        while (tokenizer_next(&tok, &file)) {
+            if (file.len > prefix_len + 1 &&
+                !memcmp(file.str, modules_path, prefix_len) &&
+                file.str[prefix_len] == '/') {
 
-                enabled_collections[i] += sizeof(SCL_MODULES_PATH);
+                file.str += prefix_len + 1;
+                file.len -= prefix_len + 1;
             }
-            enabled_collections[i] = xstrdup(enabled_collections[i]);
+            enabled_collections[i++] = arena_strndup(arena, file.str,
+                file.len);
         }
-
+        enabled_collections[i] = NULL;
     }
-    lm_files = _free(lm_files);
     *_enabled_collections = enabled_collections;
     return EOK;
 }
 
-scl_rc get_installed_collections(char *const **_colnames)
+static int not_hidden(const struct dirent *entry)
 {
-    char *argv[] = {MODULE_CMD, "modulecmd", "sh", "-t", "avail", NULL};
+    return entry->d_name[0] != '.';
+}
+
+/*
+ * Return true if file starts with the modulefile magic cookie, modulecmd
+ * ignores all other files.
+ */
+static bool is_modulefile(const char *path)
+{
+    char magic[sizeof(MODULEFILE_MAGIC) - 1];
+    FILE *fp;
+    bool ret;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        return false;
+    }
+    ret = fread(magic, sizeof(magic), 1, fp) == 1 &&
+        !memcmp(magic, MODULEFILE_MAGIC, sizeof(magic));
+    fclose(fp);
+
+    return ret;
+}
+
+/*
+ * Add modulefiles from directory dir to array colnames. Modulefiles in
+ * subdirectories are added as "subdirectory/modulefile" like modulecmd
+ * does.
+ */
+static scl_rc scan_modulefiles(const char *dir, const char *prefix,
+    char ***colnames, int *count)
+{
+    struct dirent **nl;
+    struct stat st;
+    char *path = NULL, *name = NULL, **new_colnames;
+    int n;
+    scl_rc ret = EOK;
+
+    n = scandir(dir, &nl, not_hidden, alphasort);
+    if (n < 0) {
+        return errno == ENOMEM ? EMEM : EDISK;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (ret != EOK) {
+            free(nl[i]);
+            continue;
+        }
+
+        xasprintf(&path, "%s/%s", dir, nl[i]->d_name);
+        if (prefix != NULL) {
+            xasprintf(&name, "%s/%s", prefix, nl[i]->d_name);
+        } else {
+            name = xstrdup(nl[i]->d_name);
+        }
+        if (path == NULL || name == NULL) {
+            ret = EMEM;
+        } else if (stat(path, &st) == 0) {
+            /* Unreadable subdirectories are skipped like modulecmd does */
+            if (S_ISDIR(st.st_mode) && prefix == NULL) {
+                if (scan_modulefiles(path, name, colnames, count) == EMEM) {
+                    ret = EMEM;
+                }
+            } else if (S_ISREG(st.st_mode) && is_modulefile(path)) {
+                new_colnames = xrealloc(*colnames,
+                    (*count + 2) * sizeof(**colnames));
+                if (new_colnames == NULL) {
+                    ret = EMEM;
+                } else {
+                    *colnames = new_colnames;
+                    (*colnames)[(*count)++] = name;
+                    (*colnames)[*count] = NULL;
+                    name = NULL;
+                }
+            }
+        }
+
+        path = _free(path);
+        name = _free(name);
+        free(nl[i]);
+    }
+    free(nl);
+
+    return ret;
+}
+
+/*
+ * Read names of installed collections.
+ */
+static scl_rc read_installed_collections(char ***_colnames)
+{
+    const struct scl_config *config = scl_config_get();
+    char *argv[] = {(char *) config->module_cmd, "modulecmd", "sh", "-t",
+        "avail", NULL};
     char *output = NULL, **lines = NULL;
-    int i2 = 0, take = 0;
+    struct env_builder env;
+    struct tokenizer tok;
+    struct strview line;
+    size_t modules_path_len = strlen(config->modules_path);
+    int i2 = 0, take = 0, trace_id;
     scl_rc ret = EOK;
 
-    if (installed_collections != NULL) {
-        *_colnames = installed_collections;
+    /*
+     * Only modulefiles in modules_path are interesting, so read the
+     * directory directly instead of letting modulecmd crawl whole
+     * MODULEPATH. modulecmd is used only when the directory can't be read.
+     */
+    lines = xcalloc(1, sizeof(*lines));
+    if (lines == NULL) {
+        return EMEM;
+    }
+    trace_id = trace_begin("scan_modulefiles", config->modules_path);
+    ret = scan_modulefiles(config->modules_path, NULL, &lines, &i2);
+    trace_end(trace_id);
+    if (ret == EOK) {
+        *_colnames = lines;
         return EOK;
     }
-
-    ret = initialize_env();
-    if (ret != EOK) {
+    lines = free_string_array(lines);
+    if (ret == EMEM) {
         return ret;
     }
+    ret = EOK;
+    i2 = 0;
 
-    output = get_command_output(argv[0], argv + 1, STDERR_FILENO);
+    env_builder_init(&env, environ);
+    if (add_modulepath(&env) != EOK || env_builder_envp(&env) == NULL) {
+        env_builder_free(&env);
+        return EMEM;
+    }
+    errno = 0;
+    output = get_command_output(argv[0], argv + 1, env_builder_envp(&env),
+        STDERR_FILENO);
+    env_builder_free(&env);
     if (output == NULL) {
+        if (errno == ENOMEM) {
+            return EMEM;
+        }
         debug("Problem with executing program %s: %s\n", argv[0],
             strerror(errno));
         ret = ERUN;
@@ -159,30 +405,37 @@ scl_rc get_installed_collections(char *const **_colnames)
      * ...
      */
 
-    lines = split(output, '\n');
+    lines = xcalloc(count_words(output, '\n') + 1, sizeof(*lines));
+    if (lines == NULL) {
+        ret = EMEM;
+        goto exit;
+    }
+    tokenizer_init(&tok, output, strlen(output), '\n');
 
-    for (int i = 0; lines[i] != NULL; i++) {
+    while (tokenizer_next(&tok, &line)) {
         /* Line with path to modules on following lines */
-        if (strchr(lines[i], ':') != NULL) {
+        if (memchr(line.str, ':', line.len) != NULL) {
 
             /* We want only modules with path /etc/scl/modulefiles */
-            if (!strcmp(SCL_MODULES_PATH ":", lines[i])) {
-                take = 1;
-            } else {
-                take = 0;
-            }
+            take = line.len == modules_path_len + 1 &&
+                !memcmp(line.str, config->modules_path, modules_path_len) &&
+                line.str[modules_path_len] == ':';
 
         /* Line with module name */
         } else {
             if (take) {
-                lines[i2++] = xstrdup(lines[i]);
+                lines[i2] = xstrndup(line.str, line.len);
+                if (lines[i2++] == NULL) {
+                    lines = free_string_array(lines);
+                    ret = EMEM;
+                    goto exit;
+                }
             }
         }
     }
     lines[i2] = NULL;
 
-    installed_collections = lines;
-    *_colnames = installed_collections;
+    *_colnames = lines;
 
 exit:
     output = _free(output);
@@ -190,48 +443,484 @@ exit:
     return ret;
 }
 
+static void put_collections(struct scl_ctx *ctx, struct collection_list *list)
+{
+    bool last;
+
+    if (list == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    last = --list->refs == 0;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (last) {
+        list->names = free_string_array(list->names);
+        list = _free(list);
+    }
+}
+
 /*
- * Return true in output parameter _exists if a collection given by parameter
- * colname exists. This function works only for new type of collections i. e.
- * collections containing module file. In other words it returns true only
- * when a given collection exists and the collection is collection of new
- * type otherwise it returns false.
- *
- * There is also function fallback_collection_exists() which
- * returns true for all existing collections no matter of their types.
+ * Get list of installed collections, the list has to be released by
+ * put_collections(). The list is read again only when modules_path
+ * changed since it was read last time.
  */
-static scl_rc collection_exists(const char *colname, bool *_exists)
+static scl_rc get_collections(struct scl_ctx *ctx,
+    struct collection_list **_list)
 {
-    int ret = EOK;
-    char *const *collnames = NULL;
+    struct collection_list *list = NULL, *old;
+    struct file_id dir_id;
+    char **names = NULL;
+    scl_rc ret;
+
+    file_id_path(scl_config_get()->modules_path, true, &dir_id);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->collections != NULL &&
+        !memcmp(&ctx->collections->dir_id, &dir_id, sizeof(dir_id))) {
+
+        list = ctx->collections;
+        list->refs++;
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (list != NULL) {
+        *_list = list;
+        return EOK;
+    }
+
+    ret = read_installed_collections(&names);
+    if (ret != EOK) {
+        return ret;
+    }
+
+    list = xmalloc(sizeof(*list));
+    if (list == NULL) {
+        names = free_string_array(names);
+        return EMEM;
+    }
+    list->names = names;
+    list->refs = 2; /* one for the context, one for the caller */
+    list->dir_id = dir_id;
+
+    pthread_mutex_lock(&ctx->lock);
+    old = ctx->collections;
+    ctx->collections = list;
+    pthread_mutex_unlock(&ctx->lock);
+
+    put_collections(ctx, old);
+    *_list = list;
+
+    return EOK;
+}
+
+/*
+ * Cache of another tree is never left in the user's directory, make sure
+ * that the tree has its cache directory.
+ */
+static scl_rc prepare_cache_dir()
+{
+    const struct scl_config *config = scl_config_get();
+
+    if (config->root[0] != '\0' && mkdir(config->cache_dir, 0755) == -1 &&
+        errno != EEXIST) {
+
+        debug("Cannot create directory %s: %s\n", config->cache_dir,
+            strerror(errno));
+        return EDISK;
+    }
+
+    return EOK;
+}
+
+scl_rc build_cache(char ***_cached)
+{
+    const struct scl_config *config = scl_config_get();
+    struct collection_list *list;
+    struct env_delta delta = {NULL, 0, 0};
+    struct env_cache_key key;
+    struct env_builder env;
+    char **cached = NULL;
+    bool supported;
+    int count = 0;
+    scl_rc ret;
+
+    ret = get_collections(&default_ctx, &list);
+    if (ret != EOK) {
+        return ret;
+    }
+
+    ret = prepare_cache_dir();
+    if (ret != EOK) {
+        goto exit;
+    }
+
+    /* Keys have to be the same as the ones of runs, see compute_env() */
+    env_builder_init(&env, environ);
+    ret = add_modulepath(&env);
+    if (ret == EOK) {
+        cached = xcalloc(string_array_len(list->names) + 1, sizeof(*cached));
+        if (cached == NULL) {
+            ret = EMEM;
+        }
+    }
+    for (int i = 0; list->names[i] != NULL && ret == EOK; i++) {
+        ret = env_cache_key_init(&key, list->names[i],
+            env_builder_get(&env, "MODULEPATH"));
+        if (ret != EOK) {
+            break;
+        }
+
+        ret = modulefile_eval(list->names[i], key.modulepath, &delta,
+            &supported);
+        if (ret == EOK && !supported) {
+            debug("Environment of collection %s can't be cached, its "
+                "modulefile needs modulecmd.\n", list->names[i]);
+        } else if (ret == EOK) {
+            if (!env_cache_store(&key, &delta)) {
+                debug("Unable to write cache of collection %s to %s!\n",
+                    list->names[i], config->cache_dir);
+                ret = EDISK;
+            } else if ((cached[count++] = xstrdup(list->names[i])) == NULL) {
+                ret = EMEM;
+            }
+            env_delta_free(&delta);
+        }
+        env_cache_key_free(&key);
+    }
+    env_builder_free(&env);
+
+exit:
+    put_collections(&default_ctx, list);
+    if (ret != EOK) {
+        cached = free_string_array(cached);
+    }
+    *_cached = cached;
+
+    return ret;
+}
+
+static uint64_t hash_file(const char *path, uint64_t hash)
+{
+    char buf[8192];
+    ssize_t len;
+    char exists;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    exists = fd != -1;
+    hash = hash_bytes(&exists, 1, hash);
+    if (fd == -1) {
+        return hash;
+    }
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        hash = hash_bytes(buf, len, hash);
+    }
+    if (len == -1) {
+        hash = hash_bytes(&exists, 1, hash);
+    }
+    close(fd);
+
+    return hash;
+}
+
+/*
+ * Hash contents of files the environment of collection colname was computed
+ * from: its configuration file, its enable script and modulefiles evaluated
+ * by delta. The hash is computed only if modulefiles are still found where
+ * delta found them through modulepath.
+ * @return                  true if the hash was computed
+ */
+static bool collection_hash(const char *colname, const char *modulepath,
+    const struct env_delta *delta, uint64_t *_hash)
+{
+    struct arena arena = ARENA_INIT;
+    uint64_t hash = HASH_INIT;
+    char *colpath = NULL, *path;
+    const struct env_op *op;
+    bool found = true;
+
+    if (get_collection_path(colname, &colpath) != EOK) {
+        return false;
+    }
+
+    hash = hash_file(conf_file_path(&arena, colname), hash);
+    hash = hash_file(root_path(&arena,
+        arena_asprintf(&arena, "%s/enable", colpath)), hash);
+
+    for (int i = 0; i < delta->count && found; i++) {
+        op = &delta->ops[i];
+        if (op->type != ENV_OP_MODULE_BEGIN) {
+            continue;
+        }
+
+        found = modulefile_find(op->name, modulepath, &path) == EOK &&
+            path != NULL && !strcmp(path, op->value);
+        path = _free(path);
+
+        hash = hash_bytes(op->value, strlen(op->value) + 1, hash);
+        hash = hash_file(root_path(&arena, op->value), hash);
+    }
+    colpath = _free(colpath);
+    arena_release(&arena);
+
+    *_hash = hash;
+    return found;
+}
+
+scl_rc export_cache(const char *file, char ***_exported)
+{
+    struct collection_list *list;
+    struct env_delta delta = {NULL, 0, 0};
+    struct cache_bundle bundle = {NULL, 0, 0, NULL};
+    struct env_cache_key key;
+    struct env_builder env;
+    char **exported = NULL;
+    bool supported;
+    uint64_t hash;
+    int count = 0;
+    scl_rc ret;
+
+    ret = get_collections(&default_ctx, &list);
+    if (ret != EOK) {
+        return ret;
+    }
+
+    /* Keys have to be the same as the ones of runs, see compute_env() */
+    env_builder_init(&env, environ);
+    ret = add_modulepath(&env);
+    if (ret == EOK) {
+        exported = xcalloc(string_array_len(list->names) + 1,
+            sizeof(*exported));
+        if (exported == NULL) {
+            ret = EMEM;
+        }
+    }
+    for (int i = 0; list->names[i] != NULL && ret == EOK; i++) {
+        ret = env_cache_key_init(&key, list->names[i],
+            env_builder_get(&env, "MODULEPATH"));
+        if (ret != EOK) {
+            break;
+        }
+
+        /* Valid cache spares evaluation of the modulefile */
+        supported = true;
+        if (!env_cache_load(&key, &delta)) {
+            ret = modulefile_eval(list->names[i], key.modulepath, &delta,
+                &supported);
+        }
+
+        if (ret == EOK && !supported) {
+            debug("Environment of collection %s can't be exported, its "
+                "modulefile needs modulecmd.\n", list->names[i]);
+        } else if (ret == EOK) {
+            if (collection_hash(list->names[i], key.modulepath, &delta,
+                &hash)) {
+
+                ret = cache_bundle_add(&bundle, hash, &key, &delta);
+                if (ret == EOK &&
+                    (exported[count++] = xstrdup(list->names[i])) == NULL) {
+
+                    ret = EMEM;
+                }
+            } else {
+                debug("Files of collection %s can't be read, it isn't "
+                    "exported.\n", list->names[i]);
+            }
+            env_delta_free(&delta);
+        }
+        env_cache_key_free(&key);
+    }
+    env_builder_free(&env);
+
+    if (ret == EOK && !cache_bundle_write(&bundle, file)) {
+        debug("Unable to write cache bundle %s: %s\n", file, strerror(errno));
+        ret = EDISK;
+    }
+
+    cache_bundle_free(&bundle);
+    put_collections(&default_ctx, list);
+    if (ret != EOK) {
+        exported = free_string_array(exported);
+    }
+    *_exported = exported;
+
+    return ret;
+}
+
+scl_rc import_cache(const char *file, char ***_imported)
+{
+    const struct scl_config *config = scl_config_get();
+    struct cache_bundle bundle;
+    struct cache_bundle_entry entry;
+    struct arena arena = ARENA_INIT;
+    const char *colname, *path;
+    char **imported = NULL;
+    char **tmp;
+    struct env_op *op;
+    uint64_t hash;
+    size_t pos = 0;
+    int count = 0;
+    bool exists, found;
+    scl_rc ret;
+
+    ret = cache_bundle_open(&bundle, file);
+    if (ret != EOK) {
+        return ret;
+    }
+
+    ret = prepare_cache_dir();
+    if (ret != EOK) {
+        goto exit;
+    }
+
+    while (ret == EOK) {
+        ret = cache_bundle_next(&bundle, &pos, &entry, &found);
+        if (ret != EOK || !found) {
+            break;
+        }
+        colname = entry.key.modname;
+        tmp = xrealloc(imported, (count + 2) * sizeof(*imported));
+        if (tmp == NULL) {
+            cache_bundle_entry_free(&entry);
+            ret = EMEM;
+            break;
+        }
+        imported = tmp;
+        imported[count] = NULL;
+
+        ret = collection_exists(colname, &exists);
+        if (ret != EOK) {
+            cache_bundle_entry_free(&entry);
+            break;
+        } else if (!exists) {
+            debug("Collection %s is not installed, it isn't imported.\n",
+                colname);
+        } else if (!collection_hash(colname, entry.key.modulepath,
+            &entry.delta, &hash) || hash != entry.hash) {
+
+            debug("Files of collection %s differ from the exported ones, it "
+                "isn't imported.\n", colname);
+        } else {
+            /* Identities of the files on this host validate the cache */
+            for (int i = 0; i < entry.delta.count; i++) {
+                op = &entry.delta.ops[i];
+                if (op->type != ENV_OP_MODULE_BEGIN) {
+                    continue;
+                }
+                path = root_path(&arena, op->value);
+                if (path == NULL) {
+                    arena_release(&arena);
+                    cache_bundle_entry_free(&entry);
+                    ret = EMEM;
+                    goto exit;
+                }
+                file_id_path(path, true, &op->id);
+                file_id_path(path, false, &op->link_id);
+            }
+            arena_release(&arena);
+
+            if (!env_cache_store(&entry.key, &entry.delta)) {
+                debug("Unable to write cache of collection %s to %s!\n",
+                    colname, config->cache_dir);
+                ret = EDISK;
+            } else if ((imported[count] = xstrdup(colname)) == NULL) {
+                ret = EMEM;
+            } else {
+                imported[++count] = NULL;
+            }
+        }
+        cache_bundle_entry_free(&entry);
+    }
+
+    if (ret == EOK && imported == NULL) {
+        imported = xcalloc(1, sizeof(*imported));
+        if (imported == NULL) {
+            ret = EMEM;
+        }
+    }
+
+exit:
+    cache_bundle_free(&bundle);
+    if (ret != EOK) {
+        imported = free_string_array(imported);
+    }
+    *_imported = imported;
+
+    return ret;
+}
+
+scl_rc get_installed_collections(char *const **_colnames)
+{
+    struct collection_list *list;
+    scl_rc ret;
+
+    ret = get_collections(&default_ctx, &list);
+    if (ret != EOK) {
+        return ret;
+    }
+
+    /* The context keeps the list until release_scllib_cache() */
+    *_colnames = list->names;
+    put_collections(&default_ctx, list);
+
+    return EOK;
+}
+
+static scl_rc ctx_collection_exists(struct scl_ctx *ctx, const char *colname,
+    bool *_exists)
+{
+    struct collection_list *list;
     bool exists = false;
+    scl_rc ret;
 
-    ret = get_installed_collections(&collnames);
+    ret = get_collections(ctx, &list);
     if (ret != EOK) {
         return ret;
     }
 
-    for (int i = 0; collnames[i] != NULL; i++) {
-        if (!strcmp(collnames[i], colname)) {
+    for (int i = 0; list->names[i] != NULL; i++) {
+        if (!strcmp(list->names[i], colname)) {
             exists = true;
             break;
         }
     }
+    put_collections(ctx, list);
     *_exists = exists;
 
-    return ret;
+    return EOK;
+}
+
+/*
+ * Return true in output parameter _exists if a collection given by parameter
+ * colname exists. This function works only for new type of collections i. e.
+ * collections containing module file. In other words it returns true only
+ * when a given collection exists and the collection is collection of new
+ * type otherwise it returns false.
+ *
+ * There is also function fallback_collection_exists() which
+ * returns true for all existing collections no matter of their types.
+ */
+scl_rc collection_exists(const char *colname, bool *_exists)
+{
+    return ctx_collection_exists(&default_ctx, colname, _exists);
 }
 
 scl_rc get_collection_path(const char *colname, char **_colpath)
 {
+    struct arena arena = ARENA_INIT;
     FILE *fp = NULL;
     char *file_path = NULL;
     char *prefix = NULL;
     char *colpath = NULL;
     struct stat st;
+    int trace_id;
     scl_rc ret = EOK;
 
-    xasprintf(&file_path, "%s%s", SCL_CONF_DIR, colname);
+    trace_id = trace_begin("collection_path", colname);
+    file_path = conf_file_path(&arena, colname);
 
     if (stat(file_path, &st) != 0) {
         debug("Unable to get file status %s: %s\n", file_path, strerror(errno));
@@ -273,31 +962,146 @@ exit:
     if (fp != NULL) {
         fclose(fp);
     }
-    file_path = _free(file_path);
+    arena_release(&arena);
     prefix = _free(prefix);
+    trace_end(trace_id);
 
     return ret;
 }
 
-scl_rc run_command(char * const colnames[], const char *cmd, bool exec)
+/*
+ * Colon separated variables, which are compacted when SCL_COMPACT_PATHS
+ * is set.
+ */
+static const char *const path_vars[] = {
+    "PATH", "LD_LIBRARY_PATH", "LIBRARY_PATH", "CPATH", "MANPATH",
+    "INFOPATH", "PKG_CONFIG_PATH", "PYTHONPATH", "PERL5LIB", "XDG_DATA_DIRS",
+    NULL
+};
+
+static void compact_paths(struct env_builder *env)
 {
-    char **argv = NULL, **envs = NULL, *env = NULL;
-    bool exists;
-    scl_rc ret = EOK;
-    int status;
+    const char *mode = env_builder_get(env, "SCL_COMPACT_PATHS");
+    struct env_compact_stats stats;
 
-    ret = initialize_env();
-    if (ret != EOK) {
+    if (mode == NULL || *mode == '\0' || !strcmp(mode, "0")) {
+        return;
+    }
+
+    env_builder_compact_paths(env, path_vars, &stats);
+
+    if (!strcmp(mode, "stats")) {
+        debug("Compacted %d variables: %d duplicates and %d nonexistent "
+            "directories removed, %d bytes saved\n", stats.vars,
+            stats.duplicates, stats.missing, stats.bytes);
+    }
+}
+
+/*
+ * Execute argv[0] found in PATH of env. Returns only on error.
+ */
+static void exec_command(char *const argv[], struct env_builder *env)
+{
+    const char *path = env_builder_get(env, "PATH");
+    char *file;
+
+    trace_mark("exec", argv[0]);
+    trace_flush();
+    stats_finish(EOK, true);
+
+    file = exec_cache_resolve(path, argv[0]);
+    if (file != NULL) {
+        execve(file, argv, env_builder_envp(env));
+        file = _free(file);
+    }
+
+    /* Let the slow path deal with scripts, races and error reporting */
+    exec_with_env(argv, env_builder_envp(env), path);
+}
+
+/*
+ * Find out whether collection exists and get its delta, ask the daemon
+ * first if it is running.
+ */
+static scl_rc lookup_collection(struct scl_ctx *ctx, int *scld_fd,
+    const char *colname, const char *modulepath, struct env_delta *delta,
+    bool *_exists, bool *_supported)
+{
+    int status, trace_id;
+    scl_rc ret;
+
+    if (*scld_fd != -1) {
+        if (scld_query(*scld_fd, colname, modulepath, &status, delta)) {
+
+            *_exists = status != SCLD_NOT_INSTALLED;
+            *_supported = status == SCLD_DELTA;
+            return EOK;
+        }
+
+        /* Daemon went away, compute everything in this process */
+        close(*scld_fd);
+        *scld_fd = -1;
+    }
+
+    ret = ctx_collection_exists(ctx, colname, _exists);
+    if (ret != EOK || !*_exists) {
         return ret;
     }
 
+    trace_id = trace_begin("module_delta", colname);
+    ret = get_module_delta(colname, modulepath, delta, _supported);
+    trace_end(trace_id);
+
+    return ret;
+}
+
+/*
+ * Compute environment base with collections colnames enabled. The builder
+ * is initialized even if the function fails and has to be released by the
+ * caller.
+ */
+static scl_rc compute_env(struct scl_ctx *ctx, char * const colnames[],
+    char *const base[], struct env_builder *env)
+{
+    struct arena arena = ARENA_INIT;
+    char **pending;
+    char *modulepath;
+    int pending_count = 0;
+    struct env_delta delta = {NULL, 0, 0};
+    bool exists, supported;
+    int scld_fd = -1, trace_id;
+    scl_rc ret = EOK;
+
+    trace_id = trace_begin("compute_env", NULL);
+
+    /*
+     * Environment of the command is prepared apart from the environment of
+     * this process and handed over to the command at once.
+     */
+    env_builder_init(env, base);
+    if (add_modulepath(env) != EOK) {
+        ret = EMEM;
+        goto exit;
+    }
+    modulepath = arena_strdup(&arena, env_builder_get(env, "MODULEPATH"));
+    pending = arena_alloc(&arena,
+        (string_array_len(colnames) + 1) * sizeof(*pending));
+    if (modulepath == NULL || pending == NULL) {
+        ret = EMEM;
+        goto exit;
+    }
+    scld_fd = scld_connect();
+
     while (*colnames != NULL) {
-        if (fallback_is_collection_enabled(*colnames)) {
+        if (fallback_is_collection_enabled_in(env_builder_get(env, "X_SCLS"),
+            *colnames)) {
+
             colnames++;
             continue;
         }
 
-        ret = collection_exists(*colnames, &exists);
+        ret = lookup_collection(ctx, &scld_fd, *colnames, modulepath, &delta,
+            &exists, &supported);
         if (ret != EOK) {
             goto exit;
         }
@@ -307,40 +1111,79 @@ scl_rc run_command(char * const colnames[], const char *cmd, bool exec)
             goto exit;
         }
 
-        ret = get_env_vars(*colnames, &envs);
+        if (!supported) {
+            pending[pending_count++] = *colnames;
+            colnames++;
+            continue;
+        }
+
+        /* Collections have to be enabled in the given order */
+        ret = enable_pending(pending, pending_count, env);
         if (ret != EOK) {
+            env_delta_free(&delta);
             goto exit;
         }
+        pending_count = 0;
 
-        for (int i = 0; envs[i] != NULL; i++) {
-            env = xstrdup(envs[i]);
-            if(putenv(env) != 0) {
-                env = _free(env);
-                debug("Impossible to create environment variable %s: %s\n",
-                    envs[i]);
-                ret = ESYS;
-                goto exit;
-            }
+        ret = env_delta_apply(&delta, env);
+        env_delta_free(&delta);
+        if (ret != EOK) {
+            goto exit;
         }
-        envs = free_string_array(envs);
         colnames++;
     }
 
-    if (exec) {
-        /* Use function system */
+    ret = enable_pending(pending, pending_count, env);
+    if (ret != EOK) {
+        goto exit;
+    }
+
+    compact_paths(env);
+    if (env->failed) {
+        ret = EMEM;
+    }
 
+exit:
+    if (scld_fd != -1) {
+        close(scld_fd);
+    }
+    arena_release(&arena);
+    trace_end(trace_id);
+
+    return ret;
+}
+
+scl_rc run_command(char * const colnames[], const char *cmd, bool exec)
+{
+    char **argv = NULL;
+    struct env_builder env;
+    char **orig_environ = environ;
+    scl_rc ret = EOK;
+    int status, trace_id;
+
+    PROBE2(run_command_entry, colnames[0], cmd);
+    ret = compute_env(&default_ctx, colnames, environ, &env);
+    if (ret != EOK) {
+        goto exit;
+    }
+
+    if (exec) {
         ret = prepare_args(cmd, &argv);
         if (ret != EOK) {
             goto exit;
         }
-        execvp(argv[0], argv);
+        exec_command(argv, &env);
         debug("Problem with executing program %s: %s\n", argv[0], strerror(errno));
         ret = ERUN;
 
     } else {
-        /* Use function system */
+        /* Use function system, it runs the command with environ */
 
+        environ = (char **) env_builder_envp(&env);
+        trace_id = trace_begin("command", cmd);
         status = system(cmd);
+        trace_end(trace_id);
+        environ = orig_environ;
         if (status == -1 || !WIFEXITED(status)) {
             if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
                 goto exit;
@@ -354,7 +1197,263 @@ scl_rc run_command(char * const colnames[], const char *cmd, bool exec)
 
 exit:
     argv = free_string_array(argv);
-    envs = free_string_array(envs);
+    env_builder_free(&env);
+    PROBE2(run_command_return, colnames[0], ret);
+
+    return ret;
+}
+
+/*
+ * Print value quoted for sh or csh. Single quotes protect everything in
+ * sh, csh additionally needs to escape history substitution and newlines.
+ */
+static void print_quoted(const char *value, bool csh)
+{
+    putchar('\'');
+    for (; *value != '\0'; value++) {
+        if (*value == '\'') {
+            fputs("'\\''", stdout);
+        } else if (csh && *value == '!') {
+            fputs("\\!", stdout);
+        } else if (csh && *value == '\n') {
+            fputs("\\\n", stdout);
+        } else {
+            putchar(*value);
+        }
+    }
+    putchar('\'');
+}
+
+/*
+ * Return length of valid UTF-8 sequence at s, 0 if there is none.
+ */
+static int utf8_sequence_len(const unsigned char *s)
+{
+    unsigned int code;
+    int len;
+
+    if (s[0] < 0x80) {
+        return 1;
+    } else if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        code = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        code = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        code = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+
+    /* The terminating NUL is not a continuation byte */
+    for (int i = 1; i < len; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        code = (code << 6) | (s[i] & 0x3f);
+    }
+
+    /* Overlong forms, surrogates and code points beyond Unicode */
+    if ((len == 3 && code < 0x800) || (len == 4 && code < 0x10000) ||
+        (code >= 0xd800 && code <= 0xdfff) || code > 0x10ffff) {
+
+        return 0;
+    }
+
+    return len;
+}
+
+static bool is_utf8(const char *str)
+{
+    int len;
+
+    for (; *str != '\0'; str += len) {
+        len = utf8_sequence_len((const unsigned char *) str);
+        if (len == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Print JSON string, str has to be valid UTF-8.
+ */
+static void print_json_string(const char *str)
+{
+    int len;
+
+    putchar('"');
+    for (; *str != '\0'; str++) {
+        len = utf8_sequence_len((const unsigned char *) str);
+        if (len > 1) {
+            fwrite(str, len, 1, stdout);
+            str += len - 1;
+            continue;
+        }
+
+        switch (*str) {
+            case '"':
+                fputs("\\\"", stdout);
+                break;
+            case '\\':
+                fputs("\\\\", stdout);
+                break;
+            case '\n':
+                fputs("\\n", stdout);
+                break;
+            case '\t':
+                fputs("\\t", stdout);
+                break;
+            default:
+                if ((unsigned char) *str < 0x20) {
+                    printf("\\u%04x", *str);
+                } else {
+                    putchar(*str);
+                }
+        }
+    }
+    putchar('"');
+}
+
+/*
+ * Print assignment of variable name, NULL value means the variable is
+ * unset. Returns false and prints nothing if the variable can't be
+ * expressed in the format.
+ */
+static bool print_var(const char *name, const char *value, int format,
+    bool first)
+{
+    switch (format) {
+        case ENV_FORMAT_SH:
+            if (value != NULL) {
+                printf("export %s=", name);
+                print_quoted(value, false);
+                putchar('\n');
+            } else {
+                printf("unset %s\n", name);
+            }
+            break;
+        case ENV_FORMAT_CSH:
+            if (value != NULL) {
+                printf("setenv %s ", name);
+                print_quoted(value, true);
+                putchar('\n');
+            } else {
+                printf("unsetenv %s\n", name);
+            }
+            break;
+        case ENV_FORMAT_JSON:
+            /*
+             * Values of variables are bytes, JSON strings are Unicode. No
+             * escape of a byte which isn't a part of valid UTF-8 would be
+             * told apart from the code point of the same value.
+             */
+            if (!is_utf8(name) || (value != NULL && !is_utf8(value))) {
+                return false;
+            }
+            printf(first ? "{\n    " : ",\n    ");
+            print_json_string(name);
+            printf(": ");
+            if (value != NULL) {
+                print_json_string(value);
+            } else {
+                printf("null");
+            }
+            break;
+        case ENV_FORMAT_ENV:
+            /*
+             * Docker takes values literally, while systemd interprets
+             * quotes and backslashes and strips surrounding whitespace.
+             * Only values meaning the same for both are printed, there is
+             * no way to unset variable either.
+             */
+            if (value == NULL || value[strcspn(value, "\n\\\"'$")] != '\0' ||
+                isspace((unsigned char) value[0]) || (value[0] != '\0' &&
+                isspace((unsigned char) value[strlen(value) - 1]))) {
+
+                return false;
+            }
+            printf("%s=%s\n", name, value);
+            break;
+    }
+
+    return true;
+}
+
+scl_rc print_env(char * const colnames[], int format)
+{
+    struct env_builder orig, env;
+    struct env_entry *e;
+    const char *value;
+    char *name = NULL;
+    bool first = true, complete = true;
+    scl_rc ret = EOK;
+
+    env_builder_init(&orig, environ);
+
+    if (has_old_collection(colnames)) {
+        ret = fallback_get_env(colnames, &env);
+        if (ret != EOK) {
+            env_builder_free(&orig);
+            return ret;
+        }
+    } else {
+        ret = compute_env(&default_ctx, colnames, environ, &env);
+        if (ret != EOK) {
+            goto exit;
+        }
+    }
+
+    /* Changed variables in the order of the new environment... */
+    for (int i = 0; i < env.count; i++) {
+        e = &env.entries[i];
+        if (e->unset) {
+            continue;
+        }
+        xasprintf(&name, "%.*s", e->name_len, e->var);
+        value = env_builder_get(&orig, name);
+        if (value == NULL || strcmp(value, e->var + e->name_len + 1)) {
+            if (print_var(name, e->var + e->name_len + 1, format, first)) {
+                first = false;
+            } else {
+                debug("Variable %s can't be expressed in this format\n", name);
+                complete = false;
+            }
+        }
+        name = _free(name);
+    }
+
+    /* ...followed by removed ones */
+    for (int i = 0; i < orig.count; i++) {
+        e = &orig.entries[i];
+        xasprintf(&name, "%.*s", e->name_len, e->var);
+        if (env_builder_get(&env, name) == NULL) {
+            if (print_var(name, NULL, format, first)) {
+                first = false;
+            } else {
+                debug("Variable %s can't be unset in this format\n", name);
+                complete = false;
+            }
+        }
+        name = _free(name);
+    }
+
+    if (format == ENV_FORMAT_JSON) {
+        printf(first ? "{}\n" : "\n}\n");
+    }
+
+    /* Whatever reads the output mustn't take it for the whole environment */
+    if (!complete) {
+        ret = EINPUT;
+    }
+
+exit:
+    env_builder_free(&orig);
+    env_builder_free(&env);
 
     return ret;
 }
@@ -372,29 +1471,41 @@ scl_rc list_packages_in_collection(const char *colname, char ***_pkgnames)
     scl_rc ret = EOK;
     bool exists;
     const char *srpm;
+    int trace_id, headers = 0;
 
+    PROBE1(list_packages_entry, colname);
     ret = fallback_collection_exists(colname, &exists);
     if (ret != EOK) {
-        return ret;
+        goto exit;
     }
 
     if (!exists) {
         debug("Collection %s doesn't exists!\n", colname);
-        return EINPUT;
+        ret = EINPUT;
+        goto exit;
     }
 
+    trace_id = trace_begin("rpm_config", NULL);
     if (rpmReadConfigFiles(NULL, NULL) == -1) {
         debug("Error occurred in rpmlib!\n");
-        return ERPMLIB;
+        trace_end(trace_id);
+        ret = ERPMLIB;
+        goto exit;
     }
+    trace_end(trace_id);
 
+    trace_id = trace_begin("rpmdb", colname);
     srpms = xmalloc(srpms_allocated * sizeof(*srpms));
 
     xasprintf(&provide, "scl-package(%s)", colname);
 
     ts = rpmtsCreate();
+    if (scl_config_get()->root[0] != '\0') {
+        rpmtsSetRootDir(ts, scl_config_get()->root);
+    }
     mi = rpmtsInitIterator(ts, RPMDBI_PROVIDENAME, provide, 0);
     while ((h = rpmdbNextIterator(mi)) != NULL) {
+        headers++;
 
         srpms[srpms_count++] = headerGetAsString(h, RPMTAG_SOURCERPM);
 
@@ -410,6 +1521,7 @@ scl_rc list_packages_in_collection(const char *colname, char ***_pkgnames)
     rpms = xmalloc(rpms_allocated * sizeof(*rpms));
     mi = rpmtsInitIterator(ts, RPMDBI_PACKAGES, NULL, 0);
     while ((h = rpmdbNextIterator(mi)) != NULL) {
+        headers++;
 
         srpm = headerGetString(h, RPMTAG_SOURCERPM);
 
@@ -429,20 +1541,26 @@ scl_rc list_packages_in_collection(const char *colname, char ***_pkgnames)
     mi = rpmdbFreeIterator(mi);
     ts = rpmtsFree(ts);
     srpms = free_string_array(srpms);
+    trace_end(trace_id);
 
     *_pkgnames = rpms;
+
+exit:
+    PROBE3(list_packages_return, colname, headers, ret);
     return ret;
 }
 
 static scl_rc run_scriptlet(const char *program_dir, const char *program_name)
 {
     char *program = NULL;
-    int status, pid = 0;
+    int status, pid = 0, trace_id = -1;
     scl_rc ret = EOK;
 
     xasprintf(&program, "%s/%s", program_dir, program_name);
+    PROBE1(run_scriptlet_entry, program);
 
     if (!access(program, F_OK)) {
+        trace_id = trace_begin("scriptlet", program);
         pid = fork();
         if (pid == -1) {
             ret = ERUN;
@@ -467,6 +1585,8 @@ static scl_rc run_scriptlet(const char *program_dir, const char *program_name)
     }
 
 exit:
+    trace_end(trace_id);
+    PROBE3(run_scriptlet_return, program, pid, ret);
     program = _free(program);
     return ret;
 }
@@ -474,23 +1594,24 @@ exit:
 scl_rc register_collection(const char *_colpath)
 {
     scl_rc ret = EOK;
-    char *colname, *colpath = NULL, *colroot = NULL;
-    char *module_file = NULL, *module_file_link = NULL;
-    char *enable_script = NULL, *conf_file = NULL;
+    struct arena arena = ARENA_INIT;
+    char *colname, *colpath, *colroot;
+    char *module_file, *module_file_link;
+    char *enable_script, *conf_file;
     char *prefix = NULL;
     FILE *f = NULL;
     bool exists;
 
-    colpath = xstrdup(_colpath);
+    colpath = arena_strdup(&arena, _colpath);
     strip_trailing_chars(colpath, '/');
     colname = basename(colpath);
     prefix = directory_name(colpath);
 
-    xasprintf(&module_file, "%s/%s", colpath, colname);
-    xasprintf(&enable_script, "%s/enable", colpath);
-    xasprintf(&module_file_link, SCL_MODULES_PATH "/%s", colname);
-    xasprintf(&conf_file, SCL_CONF_DIR "/%s", colname);
-    xasprintf(&colroot, "%s/root", colpath);
+    module_file = arena_asprintf(&arena, "%s/%s", colpath, colname);
+    enable_script = arena_asprintf(&arena, "%s/enable", colpath);
+    module_file_link = modulefile_path(&arena, colname);
+    conf_file = conf_file_path(&arena, colname);
+    colroot = arena_asprintf(&arena, "%s/root", colpath);
 
     if (access(enable_script, F_OK) == -1 || access(colroot, F_OK) == -1) {
         debug("Collection %s is not valid! File %s or file %s doesn't exists: %s\n",
@@ -554,10 +1675,7 @@ exit:
         fclose(f);
         f = NULL;
     }
-    colpath = _free(colpath);
-    module_file = _free(module_file);
-    module_file_link = _free(module_file_link);
-    enable_script = _free(enable_script);
+    arena_release(&arena);
     prefix = _free(prefix);
 
     return ret;
@@ -567,13 +1685,18 @@ static scl_rc owned_by_package(const char *file_path, bool *_owned)
 {
     rpmts ts;
     rpmdbMatchIterator mi;
+    int trace_id;
     scl_rc ret = EOK;
 
+    trace_id = trace_begin("rpm_config", NULL);
     if (rpmReadConfigFiles(NULL, NULL) == -1) {
         debug("Error occurred in rpmlib!\n");
+        trace_end(trace_id);
         return ERPMLIB;
     }
+    trace_end(trace_id);
 
+    trace_id = trace_begin("rpmdb", file_path);
     ts = rpmtsCreate();
     mi = rpmtsInitIterator(ts, RPMDBI_INSTFILENAMES, file_path, 0);
 
@@ -581,6 +1704,7 @@ static scl_rc owned_by_package(const char *file_path, bool *_owned)
 
     mi = rpmdbFreeIterator(mi);
     ts = rpmtsFree(ts);
+    trace_end(trace_id);
 
     return ret;
 }
@@ -589,7 +1713,8 @@ scl_rc deregister_collection(const char *colname, bool force)
 {
     bool exists;
     scl_rc ret = EOK;
-    char *module_file_link = NULL, *conf_file = NULL;
+    struct arena arena = ARENA_INIT;
+    char *module_file_link, *conf_file;
     bool conf_file_owned = false, module_file_owned = false;
     char *colpath;
 
@@ -607,8 +1732,8 @@ scl_rc deregister_collection(const char *colname, bool force)
         return ret;
     }
 
-    xasprintf(&module_file_link, SCL_MODULES_PATH "/%s", colname);
-    xasprintf(&conf_file, SCL_CONF_DIR "/%s", colname);
+    module_file_link = modulefile_path(&arena, colname);
+    conf_file = conf_file_path(&arena, colname);
 
     if (!force) {
         ret = owned_by_package(conf_file, &conf_file_owned);
@@ -653,7 +1778,7 @@ scl_rc deregister_collection(const char *colname, bool force)
     }
 
 exit:
-    module_file_link = _free(module_file_link);
+    arena_release(&arena);
     colpath = _free(colpath);
     return ret;
 }
@@ -702,5 +1827,152 @@ const char* get_version() {
 
 void release_scllib_cache()
 {
-    installed_collections = free_string_array(installed_collections);
+    struct collection_list *list;
+
+    pthread_mutex_lock(&default_ctx.lock);
+    list = default_ctx.collections;
+    default_ctx.collections = NULL;
+    pthread_mutex_unlock(&default_ctx.lock);
+
+    put_collections(&default_ctx, list);
+    xmalloc_report(stderr);
+}
+
+scl_rc scl_ctx_new(scl_ctx **_ctx)
+{
+    scl_ctx *ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        return EMEM;
+    }
+
+    if (pthread_mutex_init(&ctx->lock, NULL) != 0) {
+        free(ctx);
+        return ESYS;
+    }
+
+    *_ctx = ctx;
+    return EOK;
+}
+
+void scl_ctx_free(scl_ctx *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+
+    put_collections(ctx, ctx->collections);
+    pthread_mutex_destroy(&ctx->lock);
+    free(ctx);
+}
+
+static scl_rc ctx_list_collections(scl_ctx *ctx, char ***_colnames)
+{
+    struct collection_list *list;
+    char **colnames;
+    int count;
+    scl_rc ret;
+
+    ret = get_collections(ctx, &list);
+    if (ret != EOK) {
+        return ret;
+    }
+
+    count = string_array_len(list->names);
+    colnames = xcalloc(count + 1, sizeof(*colnames));
+    for (int i = 0; i < count && colnames != NULL; i++) {
+        colnames[i] = xstrdup(list->names[i]);
+        if (colnames[i] == NULL) {
+            colnames = free_string_array(colnames);
+        }
+    }
+    put_collections(ctx, list);
+    if (colnames == NULL) {
+        return EMEM;
+    }
+
+    *_colnames = colnames;
+    return EOK;
+}
+
+/*
+ * Entry points let allocations of the calling thread fail, every function
+ * they call reports a failed allocation as EMEM and releases what it holds.
+ */
+scl_rc scl_ctx_list_collections(scl_ctx *ctx, char ***_colnames)
+{
+    bool prev = xmalloc_allow_failure(true);
+    scl_rc ret;
+
+    ret = ctx_list_collections(ctx, _colnames);
+    xmalloc_allow_failure(prev);
+
+    return ret;
+}
+
+scl_rc scl_ctx_collection_exists(scl_ctx *ctx, const char *colname,
+    bool *_exists)
+{
+    bool prev = xmalloc_allow_failure(true);
+    scl_rc ret;
+
+    ret = ctx_collection_exists(ctx, colname, _exists);
+    xmalloc_allow_failure(prev);
+
+    return ret;
+}
+
+static scl_rc ctx_get_env(scl_ctx *ctx, char *const colnames[],
+    char *const base[], char ***_envp)
+{
+    struct env_builder env;
+    char *const *vars;
+    char **envp = NULL;
+    int count;
+    scl_rc ret;
+
+    ret = compute_env(ctx, colnames, base, &env);
+    if (ret != EOK) {
+        goto exit;
+    }
+
+    vars = env_builder_envp(&env);
+    if (vars != NULL) {
+        count = string_array_len(vars);
+        envp = xcalloc(count + 1, sizeof(*envp));
+    }
+    for (int i = 0; envp != NULL && i < count; i++) {
+        envp[i] = xstrdup(vars[i]);
+        if (envp[i] == NULL) {
+            envp = free_string_array(envp);
+        }
+    }
+    if (envp == NULL) {
+        ret = EMEM;
+        goto exit;
+    }
+    *_envp = envp;
+
+exit:
+    env_builder_free(&env);
+
+    return ret;
+}
+
+scl_rc scl_ctx_get_env(scl_ctx *ctx, char *const colnames[],
+    char *const base[], char ***_envp)
+{
+    bool prev = xmalloc_allow_failure(true);
+    scl_rc ret;
+
+    ret = ctx_get_env(ctx, colnames, base, _envp);
+    xmalloc_allow_failure(prev);
+
+    return ret;
+}
+
+void scl_free_strv(char **strv)
+{
+    free_string_array(strv);
 }
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include "errors.h"
+#include "sclmalloc.h"
 
 /*
  * Runs specified command.
@@ -12,12 +13,30 @@
  */
 scl_rc run_command(char *const colname[], const char *cmd, bool exec);
 
+#define ENV_FORMAT_SH 0
+#define ENV_FORMAT_CSH 1
+#define ENV_FORMAT_JSON 2
+#define ENV_FORMAT_ENV 3
+
+/*
+ * Print variables changed by enabling collections without running any
+ * command.
+ * @param[in] colnames      Collections to enable.
+ * @param[in] format        One of ENV_FORMAT_* constants.
+ * @return                  EOK on succes otherwise err code, EINPUT if some
+ *                          variables can't be expressed in the format and
+ *                          were left out of the output
+ */
+scl_rc print_env(char *const colnames[], int format);
+
 /*
  * Get collections enabled in current environment.
+ * @param[in] arena                 Arena the result is allocated from.
  * @param[out] enabled_collections  NULL-terminated array of char*
  * @return                          EOK on succes otherwise err code
  */
-scl_rc get_enabled_collections(char ***enabled_collections);
+scl_rc get_enabled_collections(struct arena *arena,
+    char ***enabled_collections);
 
 /*
  * Created array of installed collections.
@@ -26,6 +45,36 @@ scl_rc get_enabled_collections(char ***enabled_collections);
  */
 scl_rc get_installed_collections(char *const **colnames);
 
+/*
+ * Evaluate modulefiles of all installed collections and store their
+ * environment changes to the cache, as runs with the current MODULEPATH
+ * would do. Collections of old type and collections whose modulefiles
+ * need modulecmd can't be cached.
+ * @param[out] _cached      NULL-terminated array of cached collections
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc build_cache(char ***_cached);
+
+/*
+ * Write environment changes of all installed collections to bundle file,
+ * together with hashes of files they were computed from. Valid cache is
+ * used, other collections are evaluated like build_cache() does.
+ * @param[in] file          Bundle file to write.
+ * @param[out] _exported    NULL-terminated array of exported collections
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc export_cache(const char *file, char ***_exported);
+
+/*
+ * Store environment changes from bundle file written by export_cache() to
+ * the cache. Only collections which are installed and whose files have
+ * the same contents as on the exporting host are imported.
+ * @param[in] file          Bundle file to read.
+ * @param[out] _imported    NULL-terminated array of imported collections
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc import_cache(const char *file, char ***_imported);
+
 /*
  * Creates array of package names.
  * @param[in] colname       Name of inspected collection.
@@ -57,6 +106,14 @@ scl_rc deregister_collection(const char *colname, bool force);
  */
 scl_rc show_man(const char *colname);
 
+/*
+ * Find out whether collection is installed.
+ * @param[in] colname       Name of collection.
+ * @param[out] _exists      true if the collection is installed
+ * @return                  EOK on succes otherwise err code
+ */
+scl_rc collection_exists(const char *colname, bool *_exists);
+
 /*
  * Get path where collection is located.
  * @param[in] colname       Name of collection.
@@ -2,68 +2,497 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "debug.h"
+#include "sclmalloc.h"
 
+static __thread bool allow_failure = false;
+
+bool xmalloc_allow_failure(bool allow)
+{
+    bool prev = allow_failure;
+
+    allow_failure = allow;
+    return prev;
+}
+
+/*
+ * Returns only if the calling thread allowed failures.
+ */
 inline static void vmefail()
 {
     debug("Memory allocation failed.\n");
-    exit(EXIT_FAILURE);
+    if (!allow_failure) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+#ifdef SCL_ALLOC_ACCOUNTING
+#define MAX_SITES 1024
+#define LIVE_BUCKETS 4096
+
+struct alloc_site {
+    const char *name;           /* "file:line" */
+    size_t calls;
+    size_t bytes;               /* requested by all calls */
+    size_t live;                /* allocations not released by _free() */
+};
+
+struct live_alloc {
+    void *ptr;
+    size_t usable;              /* malloc_usable_size() of ptr */
+    struct alloc_site *site;    /* NULL if sites are exhausted */
+    struct live_alloc *next;
+};
+
+/*
+ * Everything below is protected by sites_lock. Only allocations found in
+ * live_allocs are counted by _free(), memory from malloc(), strdup() or
+ * getline() of libc doesn't disturb the stats.
+ */
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct alloc_site sites[MAX_SITES];
+static int site_count = 0;
+static struct live_alloc *live_allocs[LIVE_BUCKETS];
+static struct xmalloc_stats stats = {0, 0, 0, 0};
+
+static struct alloc_site *find_site(const char *name)
+{
+    unsigned int i, hash = 5381;
+
+    for (const char *p = name; *p != '\0'; p++) {
+        hash = hash * 33 + *p;
+    }
+
+    /* Equal names from different objects may have different addresses */
+    for (i = hash % MAX_SITES; sites[i].name != NULL; i = (i + 1) % MAX_SITES) {
+        if (sites[i].name == name || !strcmp(sites[i].name, name)) {
+            return &sites[i];
+        }
+    }
+
+    if (site_count == MAX_SITES - 1) {
+        return NULL;
+    }
+    site_count++;
+    sites[i].name = name;
+
+    return &sites[i];
+}
+
+static struct live_alloc **live_bucket(void *ptr)
+{
+    return &live_allocs[((uintptr_t) ptr >> 4) % LIVE_BUCKETS];
+}
+
+/*
+ * Track ptr allocated at call site name. Failed reallocation re-tracks the
+ * kept pointer with new_alloc unset, so that it doesn't count as another
+ * allocation.
+ */
+static void account_site(const char *name, void *ptr, size_t size,
+    bool new_alloc)
+{
+    struct alloc_site *site;
+    struct live_alloc *alloc, **bucket;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&sites_lock);
+    site = find_site(name);
+    if (site != NULL && new_alloc) {
+        site->calls++;
+        site->bytes += size;
+    }
+
+    alloc = malloc(sizeof(*alloc));
+    if (alloc != NULL) {
+        bucket = live_bucket(ptr);
+        alloc->ptr = ptr;
+        alloc->usable = malloc_usable_size(ptr);
+        alloc->site = site;
+        alloc->next = *bucket;
+        *bucket = alloc;
+        if (site != NULL) {
+            site->live++;
+        }
+
+        if (new_alloc) {
+            stats.allocs++;
+        }
+        stats.bytes += alloc->usable;
+        if (stats.bytes > stats.peak_bytes) {
+            stats.peak_bytes = stats.bytes;
+        }
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+/*
+ * Stop tracking ptr. Reallocation passes release unset, it isn't counted
+ * as a free.
+ */
+static void account_site_free(void *ptr, bool release)
+{
+    struct live_alloc *alloc, **prev;
+
+    pthread_mutex_lock(&sites_lock);
+    for (prev = live_bucket(ptr); *prev != NULL; prev = &(*prev)->next) {
+        alloc = *prev;
+        if (alloc->ptr == ptr) {
+            *prev = alloc->next;
+            if (alloc->site != NULL) {
+                alloc->site->live--;
+            }
+            if (release) {
+                stats.frees++;
+            }
+            stats.bytes -= alloc->usable;
+            free(alloc);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+    const struct alloc_site *x = *(struct alloc_site *const *) a;
+    const struct alloc_site *y = *(struct alloc_site *const *) b;
+
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
 }
+#endif
 
-void *xmalloc(size_t size)
+void xmalloc_report(FILE *out)
+{
+#ifdef SCL_ALLOC_ACCOUNTING
+    struct alloc_site *sorted[MAX_SITES];
+    const char *name;
+    int count = 0;
+
+    pthread_mutex_lock(&sites_lock);
+    for (int i = 0; i < MAX_SITES; i++) {
+        if (sites[i].name != NULL) {
+            sorted[count++] = &sites[i];
+        }
+    }
+    qsort(sorted, count, sizeof(*sorted), compare_sites);
+
+    fprintf(out, "%10s %14s %10s  %s\n", "calls", "bytes", "live", "site");
+    for (int i = 0; i < count; i++) {
+        name = strrchr(sorted[i]->name, '/');
+        fprintf(out, "%10zu %14zu %10zu  %s\n", sorted[i]->calls,
+            sorted[i]->bytes, sorted[i]->live,
+            name != NULL ? name + 1 : sorted[i]->name);
+    }
+    pthread_mutex_unlock(&sites_lock);
+#else
+    (void) out;
+#endif
+}
+
+void xmalloc_get_stats(struct xmalloc_stats *_stats)
+{
+#ifdef SCL_ALLOC_ACCOUNTING
+    pthread_mutex_lock(&sites_lock);
+    *_stats = stats;
+    pthread_mutex_unlock(&sites_lock);
+#else
+    memset(_stats, 0, sizeof(*_stats));
+#endif
+}
+
+void xmalloc_reset_stats()
+{
+#ifdef SCL_ALLOC_ACCOUNTING
+    pthread_mutex_lock(&sites_lock);
+    stats.allocs = stats.frees = 0;
+    stats.peak_bytes = stats.bytes;
+    pthread_mutex_unlock(&sites_lock);
+#endif
+}
+
+/*
+ * Names are parenthesized, so that macros of accounting build don't
+ * replace them.
+ */
+void *(xmalloc)(size_t size)
 {
     register void *value;
     value = malloc(size);
-    if (value == NULL)
+    if (value == NULL) {
         vmefail();
+    }
     return value;
 }
 
-void *xcalloc(size_t nmemb, size_t size)
+void *(xcalloc)(size_t nmemb, size_t size)
 {
     register void *value;
     value = calloc(nmemb, size);
-    if (value == NULL)
+    if (value == NULL) {
         vmefail();
+    }
     return value;
 }
 
-void *xrealloc(void *ptr, size_t size)
+void *(xrealloc)(void *ptr, size_t size)
 {
     register void *value;
+
+    /* ptr is kept when it fails */
     value = realloc(ptr, size);
-    if (value == NULL)
+    if (value == NULL) {
         vmefail();
+    }
     return value;
 }
 
-char *xstrdup(const char *str)
+char *(xstrdup)(const char *str)
 {
     size_t size = strlen(str) + 1;
     char *newstr = (char *) malloc(size);
-    if (newstr == NULL)
+    if (newstr == NULL) {
         vmefail();
-    strcpy(newstr, str);
+        return NULL;
+    }
+    memcpy(newstr, str, size);
     return newstr;
 }
 
-int xasprintf(char **strp, const char *fmt, ...)
+char *(xstrndup)(const char *str, size_t len)
+{
+    char *newstr = strndup(str, len);
+    if (newstr == NULL) {
+        vmefail();
+    }
+    return newstr;
+}
+
+static int xvasprintf(char **strp, const char *fmt, va_list args)
 {
-    va_list args;
     int ret;
 
-    va_start(args, fmt);
     ret = vasprintf(strp, fmt, args);
-    if (ret == -1)
+    if (ret == -1) {
+        *strp = NULL;
         vmefail();
+    }
+
+    return ret;
+}
+
+int (xasprintf)(char **strp, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = xvasprintf(strp, fmt, args);
+    va_end(args);
+
+    return ret;
+}
+
+#ifdef SCL_ALLOC_ACCOUNTING
+void *xmalloc_at(const char *site, size_t size)
+{
+    void *value = (xmalloc)(size);
+
+    account_site(site, value, size, true);
+    return value;
+}
+
+void *xcalloc_at(const char *site, size_t nmemb, size_t size)
+{
+    void *value = (xcalloc)(nmemb, size);
+
+    account_site(site, value, nmemb * size, true);
+    return value;
+}
+
+void *xrealloc_at(const char *site, void *ptr, size_t size)
+{
+    void *value;
+
+    account_site_free(ptr, false);
+    value = (xrealloc)(ptr, size);
+    if (value != NULL) {
+        account_site(site, value, size, true);
+    } else {
+        /* ptr is still allocated */
+        account_site(site, ptr, 0, false);
+    }
+    return value;
+}
+
+char *xstrdup_at(const char *site, const char *str)
+{
+    char *value = (xstrdup)(str);
+
+    account_site(site, value, strlen(str) + 1, true);
+    return value;
+}
+
+char *xstrndup_at(const char *site, const char *str, size_t len)
+{
+    char *value = (xstrndup)(str, len);
+
+    account_site(site, value, value != NULL ? strlen(value) + 1 : 0, true);
+    return value;
+}
+
+int xasprintf_at(const char *site, char **strp, const char *fmt, ...)
+{
+    va_list args;
+    int ret;
+
+    va_start(args, fmt);
+    ret = xvasprintf(strp, fmt, args);
     va_end(args);
+    account_site(site, *strp, ret + 1, true);
 
     return ret;
 }
+#endif
 
 void *_free(void *ptr)
 {
+#ifdef SCL_ALLOC_ACCOUNTING
+    if (ptr != NULL) {
+        account_site_free(ptr, true);
+    }
+#endif
     free(ptr);
     return NULL;
 }
+
+/* Same alignment as malloc() guarantees */
+#define ARENA_ALIGNMENT __alignof__(long double)
+#define ARENA_ALIGN(size) (((size) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1))
+
+/* Leave room for the chunk header and malloc bookkeeping in 4 KiB */
+#define ARENA_CHUNK_SIZE ARENA_ALIGN(4096 - 128)
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+    char data[] __attribute__ ((aligned(ARENA_ALIGNMENT)));
+};
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_chunk *chunk = arena->chunk, *new_chunk;
+
+    size = ARENA_ALIGN(size > 0 ? size : 1);
+    if (chunk != NULL && chunk->size - chunk->used >= size) {
+        chunk->used += size;
+        return chunk->data + chunk->used - size;
+    }
+
+    /* Big allocations get their own chunk, the current one is kept */
+    if (size > ARENA_CHUNK_SIZE / 4) {
+        new_chunk = xmalloc(sizeof(*new_chunk) + size);
+        if (new_chunk == NULL) {
+            return NULL;
+        }
+        new_chunk->size = new_chunk->used = size;
+        if (chunk != NULL) {
+            new_chunk->prev = chunk->prev;
+            chunk->prev = new_chunk;
+        } else {
+            new_chunk->prev = NULL;
+            arena->chunk = new_chunk;
+        }
+        return new_chunk->data;
+    }
+
+    new_chunk = xmalloc(sizeof(*new_chunk) + ARENA_CHUNK_SIZE);
+    if (new_chunk == NULL) {
+        return NULL;
+    }
+    new_chunk->size = ARENA_CHUNK_SIZE;
+    new_chunk->used = size;
+    new_chunk->prev = chunk;
+    arena->chunk = new_chunk;
+
+    return new_chunk->data;
+}
+
+char *arena_strndup(struct arena *arena, const char *str, size_t len)
+{
+    char *newstr;
+
+    len = strnlen(str, len);
+    newstr = arena_alloc(arena, len + 1);
+    if (newstr == NULL) {
+        return NULL;
+    }
+    memcpy(newstr, str, len);
+    newstr[len] = '\0';
+
+    return newstr;
+}
+
+char *arena_strdup(struct arena *arena, const char *str)
+{
+    return arena_strndup(arena, str, strlen(str));
+}
+
+char *arena_asprintf(struct arena *arena, const char *fmt, ...)
+{
+    struct arena_chunk *chunk = arena->chunk;
+    va_list args;
+    size_t avail = 0;
+    char *str = NULL;
+    int len;
+
+    /* Try to print directly behind the last allocation first */
+    if (chunk != NULL) {
+        avail = chunk->size - chunk->used;
+        str = chunk->data + chunk->used;
+    }
+
+    va_start(args, fmt);
+    len = vsnprintf(str, avail, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        vmefail();
+        return NULL;
+    }
+
+    if ((size_t) len < avail) {
+        chunk->used += ARENA_ALIGN(len + 1);
+        return str;
+    }
+
+    str = arena_alloc(arena, len + 1);
+    if (str == NULL) {
+        return NULL;
+    }
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+
+    return str;
+}
+
+void arena_release(struct arena *arena)
+{
+    struct arena_chunk *chunk = arena->chunk, *prev;
+
+    while (chunk != NULL) {
+        prev = chunk->prev;
+        chunk = _free(chunk);
+        chunk = prev;
+    }
+    arena->chunk = NULL;
+}
@@ -1,11 +1,97 @@
 #ifndef __SCLMALLOC_H__
 #define __SCLMALLOC_H__
 
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+
 void *xmalloc(size_t size);
 void *xcalloc(size_t nmemb, size_t size);
 void *xrealloc(void *ptr, size_t size);
 void *_free(void *ptr);
 char *xstrdup(const char *str);
+char *xstrndup(const char *str, size_t len);
 int xasprintf(char **strp, const char *fmt, ...);
 
+/*
+ * Accounting build (cmake -DALLOC_ACCOUNTING=ON) attributes calls of the
+ * functions above to the file and line they are called from, so that
+ * xmalloc_report() can tell which call sites allocate most.
+ */
+#ifdef SCL_ALLOC_ACCOUNTING
+#define ALLOC_STR(x) #x
+#define ALLOC_SITE_(file, line) file ":" ALLOC_STR(line)
+#define ALLOC_SITE ALLOC_SITE_(__FILE__, __LINE__)
+
+void *xmalloc_at(const char *site, size_t size);
+void *xcalloc_at(const char *site, size_t nmemb, size_t size);
+void *xrealloc_at(const char *site, void *ptr, size_t size);
+char *xstrdup_at(const char *site, const char *str);
+char *xstrndup_at(const char *site, const char *str, size_t len);
+int xasprintf_at(const char *site, char **strp, const char *fmt, ...);
+
+#define xmalloc(size) xmalloc_at(ALLOC_SITE, size)
+#define xcalloc(nmemb, size) xcalloc_at(ALLOC_SITE, nmemb, size)
+#define xrealloc(ptr, size) xrealloc_at(ALLOC_SITE, ptr, size)
+#define xstrdup(str) xstrdup_at(ALLOC_SITE, str)
+#define xstrndup(str, len) xstrndup_at(ALLOC_SITE, str, len)
+#define xasprintf(...) xasprintf_at(ALLOC_SITE, __VA_ARGS__)
+#endif
+
+/*
+ * Print number of calls, allocated bytes and allocations not yet released
+ * by _free() of every call site to out, ordered by the bytes. Does nothing
+ * unless this is accounting build.
+ */
+void xmalloc_report(FILE *out);
+
+/*
+ * Allocation failure terminates the program unless the calling thread
+ * allowed failures. The functions above and arena_*() return NULL then,
+ * xasprintf() returns -1, and the caller has to report EMEM. Code shared
+ * with libscl checks for it, see libscl.h. Returns the previous setting.
+ */
+bool xmalloc_allow_failure(bool allow);
+
+/*
+ * Counters of the functions above, shared by all threads. They are kept by
+ * the accounting build only, otherwise xmalloc_get_stats() returns zeros.
+ * Tests and bench_lib_common are always built with accounting.
+ * _free() of memory not allocated by the functions above isn't counted.
+ */
+struct xmalloc_stats {
+    size_t allocs;              /* successful allocations and reallocations */
+    size_t frees;               /* _free() calls releasing counted allocations */
+    size_t bytes;               /* currently allocated bytes */
+    size_t peak_bytes;          /* maximum of bytes since the last reset */
+};
+
+void xmalloc_get_stats(struct xmalloc_stats *stats);
+
+/*
+ * Zero the counters and set peak_bytes to the current bytes.
+ */
+void xmalloc_reset_stats();
+
+/*
+ * Bump allocator for memory which lives only as long as one request. All
+ * memory of the arena is released at once by arena_release(), single
+ * allocations can't be freed. Arena is initialized by ARENA_INIT and is
+ * not thread safe.
+ */
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *chunk;
+};
+
+#define ARENA_INIT {NULL}
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *str);
+char *arena_strndup(struct arena *arena, const char *str, size_t len);
+char *arena_asprintf(struct arena *arena, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+void arena_release(struct arena *arena);
+
 #endif
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "errors.h"
+#include "debug.h"
+#include "sclmalloc.h"
+#include "trace.h"
+#include "stats.h"
+
+/*
+ * Longer records are not written, so that one write() always writes the
+ * whole record.
+ */
+#define MAX_RECORD 4096
+#define MAX_PHASES 32
+
+static bool enabled = false;
+static bool done = false;
+static bool fallback = false;
+static char path[4096];
+static const char *action = "none";
+static char *const *collections = NULL;
+
+struct record {
+    char data[MAX_RECORD];
+    size_t len;
+};
+
+void stats_init(const char *_path)
+{
+    enabled = _path != NULL && *_path != '\0';
+    done = false;
+    fallback = false;
+    action = "none";
+    collections = NULL;
+    if (!enabled) {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s", _path);
+    trace_collect();
+}
+
+void stats_begin(const char *_action, char *const colnames[])
+{
+    action = _action;
+    collections = colnames;
+}
+
+void stats_fallback()
+{
+    fallback = true;
+}
+
+static void append(struct record *r, const char *format, ...)
+{
+    va_list ap;
+    int len;
+
+    if (r->len >= sizeof(r->data)) {
+        return;
+    }
+
+    va_start(ap, format);
+    len = vsnprintf(r->data + r->len, sizeof(r->data) - r->len, format, ap);
+    va_end(ap);
+    r->len += len;
+}
+
+static void append_string(struct record *r, const char *str)
+{
+    append(r, "\"");
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            append(r, "\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            append(r, "\\u%04x", *str);
+        } else {
+            append(r, "%c", *str);
+        }
+    }
+    append(r, "\"");
+}
+
+void stats_finish(int rc, bool exec)
+{
+    struct record r;
+    struct timespec ts;
+    const char *phases[MAX_PHASES];
+    int64_t durations[MAX_PHASES];
+    int count, fd;
+
+    if (!enabled || done) {
+        return;
+    }
+    done = true;
+
+    r.len = 0;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    append(&r, "{\"time\":%lld.%03ld,\"pid\":%d,\"action\":",
+        (long long) ts.tv_sec, ts.tv_nsec / 1000000, (int) getpid());
+    append_string(&r, action);
+
+    append(&r, ",\"collections\":[");
+    for (int i = 0; collections != NULL && collections[i] != NULL; i++) {
+        /* Leave space for the rest of the record */
+        if (r.len > MAX_RECORD / 2) {
+            break;
+        }
+        if (i > 0) {
+            append(&r, ",");
+        }
+        append_string(&r, collections[i]);
+    }
+
+    append(&r, "],\"fallback\":%s,\"exec\":%s,\"rc\":%d,\"total_ms\":%.3f,"
+        "\"phases\":{", fallback ? "true" : "false", exec ? "true" : "false",
+        rc, trace_elapsed() / 1e6);
+    count = trace_totals(phases, durations, MAX_PHASES);
+    for (int i = 0; i < count; i++) {
+        append(&r, "%s", i > 0 ? "," : "");
+        append_string(&r, phases[i]);
+        append(&r, ":%.3f", durations[i] / 1e6);
+    }
+    append(&r, "}}\n");
+
+    if (r.len >= sizeof(r.data)) {
+        debug("Statistics record is too long!\n");
+        return;
+    }
+
+    fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        debug("Unable to open statistics file %s\n", path);
+        return;
+    }
+    if (write(fd, r.data, r.len) != (ssize_t) r.len) {
+        debug("Unable to write statistics to %s\n", path);
+    }
+    close(fd);
+}
+
+/*
+ * Durations of one action, collection or phase.
+ */
+struct series {
+    char *name;
+    double *values;
+    int count;
+    int alloced;
+};
+
+struct summary {
+    struct series *series;
+    int count;
+    int alloced;
+    int records;
+    int fallback;
+    int exec;
+    int failed;
+};
+
+static void add_value(struct summary *s, const char *kind, const char *name,
+    double value)
+{
+    struct series *series = NULL;
+    char *full_name = NULL;
+
+    xasprintf(&full_name, "%s %s", kind, name);
+    for (int i = 0; i < s->count; i++) {
+        if (!strcmp(s->series[i].name, full_name)) {
+            series = &s->series[i];
+            full_name = _free(full_name);
+            break;
+        }
+    }
+
+    if (series == NULL) {
+        if (s->count == s->alloced) {
+            s->alloced = s->alloced ? s->alloced << 1 : 16;
+            s->series = xrealloc(s->series, s->alloced * sizeof(*s->series));
+        }
+        series = &s->series[s->count++];
+        series->name = full_name;
+        series->values = NULL;
+        series->count = series->alloced = 0;
+    }
+
+    if (series->count == series->alloced) {
+        series->alloced = series->alloced ? series->alloced << 1 : 64;
+        series->values = xrealloc(series->values,
+            series->alloced * sizeof(*series->values));
+    }
+    series->values[series->count++] = value;
+}
+
+/*
+ * Parse JSON string at p to buf, returns position after the string or NULL
+ * if there is no string. Escaped control characters are replaced by '?'.
+ */
+static const char *parse_string(const char *p, char *buf, size_t size)
+{
+    size_t len = 0;
+
+    if (*p++ != '"') {
+        return NULL;
+    }
+
+    for (; *p != '"'; p++) {
+        if (*p == '\0') {
+            return NULL;
+        }
+        if (*p == '\\') {
+            p++;
+            if (*p == 'u' && strlen(p) >= 5) {
+                p += 4;
+                if (len < size - 1) {
+                    buf[len++] = '?';
+                }
+                continue;
+            } else if (*p == '\0') {
+                return NULL;
+            }
+        }
+        if (len < size - 1) {
+            buf[len++] = *p;
+        }
+    }
+    buf[len] = '\0';
+
+    return p + 1;
+}
+
+/*
+ * Position of value of key in record, keys can't be confused with strings
+ * inside of values because quotes in them are escaped.
+ */
+static const char *find_value(const char *line, const char *key)
+{
+    char pattern[32];
+    const char *p;
+
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    p = strstr(line, pattern);
+
+    return p != NULL ? p + strlen(pattern) : NULL;
+}
+
+static bool parse_record(struct summary *s, const char *line)
+{
+    char action_name[256], name[256];
+    const char *p, *colls;
+    double total, duration;
+    char *end;
+
+    p = find_value(line, "action");
+    if (p == NULL || parse_string(p, action_name, sizeof(action_name)) == NULL) {
+        return false;
+    }
+    p = find_value(line, "total_ms");
+    if (p == NULL) {
+        return false;
+    }
+    total = strtod(p, &end);
+    if (end == p) {
+        return false;
+    }
+
+    s->records++;
+    add_value(s, "action", action_name, total);
+
+    p = find_value(line, "fallback");
+    s->fallback += p != NULL && !strncmp(p, "true", 4);
+    p = find_value(line, "exec");
+    s->exec += p != NULL && !strncmp(p, "true", 4);
+    p = find_value(line, "rc");
+    s->failed += p != NULL && strtol(p, NULL, 10) != 0;
+
+    colls = find_value(line, "collections");
+    if (colls != NULL && *colls++ == '[') {
+        while ((colls = parse_string(colls, name, sizeof(name))) != NULL) {
+            add_value(s, "collection", name, total);
+            if (*colls++ != ',') {
+                break;
+            }
+        }
+    }
+
+    p = find_value(line, "phases");
+    if (p != NULL && *p++ == '{') {
+        while ((p = parse_string(p, name, sizeof(name))) != NULL &&
+            *p++ == ':') {
+
+            duration = strtod(p, &end);
+            if (end == p) {
+                break;
+            }
+            add_value(s, "phase", name, duration);
+            p = end;
+            if (*p++ != ',') {
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+static int compare_series(const void *a, const void *b)
+{
+    return strcmp(((const struct series *) a)->name,
+        ((const struct series *) b)->name);
+}
+
+/*
+ * Nearest-rank percentile of sorted values.
+ */
+static double percentile(const struct series *series, int p)
+{
+    int rank = (series->count * p + 99) / 100;
+
+    return series->values[rank > 0 ? rank - 1 : 0];
+}
+
+scl_rc stats_summary(const char *_path, FILE *out)
+{
+    struct summary s = {0};
+    struct series *series;
+    char *line = NULL;
+    size_t size = 0;
+    int skipped = 0;
+    FILE *f;
+
+    f = fopen(_path, "re");
+    if (f == NULL) {
+        debug("Unable to open statistics file %s\n", _path);
+        return EDISK;
+    }
+
+    while (getline(&line, &size, f) != -1) {
+        if (!parse_record(&s, line)) {
+            skipped++;
+        }
+    }
+    free(line);
+    fclose(f);
+
+    fprintf(out, "%d runs, %d with collections of old type, %d ended by exec, "
+        "%d failed", s.records, s.fallback, s.exec, s.failed);
+    if (skipped > 0) {
+        fprintf(out, ", %d malformed lines skipped", skipped);
+    }
+    fprintf(out, "\n\n%-40s %8s %10s %10s %10s %10s\n", "duration [ms]",
+        "count", "p50", "p90", "p99", "max");
+
+    qsort(s.series, s.count, sizeof(*s.series), compare_series);
+    for (int i = 0; i < s.count; i++) {
+        series = &s.series[i];
+        qsort(series->values, series->count, sizeof(*series->values),
+            compare_doubles);
+        fprintf(out, "%-40s %8d %10.3f %10.3f %10.3f %10.3f\n", series->name,
+            series->count, percentile(series, 50), percentile(series, 90),
+            percentile(series, 99), series->values[series->count - 1]);
+        series->name = _free(series->name);
+        series->values = _free(series->values);
+    }
+    s.series = _free(s.series);
+
+    return EOK;
+}
@@ -0,0 +1,43 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include "errors.h"
+
+/*
+ * Statistics log enabled by variable SCL_STATS=<file>. Every run appends
+ * one JSON line to the file:
+ *   {"time":1500000000.123,"pid":42,"action":"enable",
+ *    "collections":["foo","bar"],"fallback":false,"exec":true,"rc":0,
+ *    "total_ms":12.345,"phases":{"compute_env":10.123,"spawn":9.876}}
+ * Phases are summed durations of phases recorded by trace.h. A record is
+ * written by a single write() to the file opened with O_APPEND, so records
+ * of concurrent runs don't need any locking and are never mixed.
+ */
+void stats_init(const char *path);
+
+/*
+ * Tell what the run does, colnames (may be NULL) have to be valid until
+ * the record is written.
+ */
+void stats_begin(const char *action, char *const colnames[]);
+
+/*
+ * Note that collections of old type are enabled.
+ */
+void stats_fallback();
+
+/*
+ * Write the record, only the first call in a run writes it. exec tells
+ * that the process is going to be replaced by the command.
+ */
+void stats_finish(int rc, bool exec);
+
+/*
+ * Print count and percentiles of duration of runs by action, collection
+ * and phase from the log at path to out.
+ */
+scl_rc stats_summary(const char *path, FILE *out);
+
+#endif
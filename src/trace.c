@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "debug.h"
+#include "trace.h"
+
+#define MAX_EVENTS 1024
+#define MAX_ARG 128
+
+struct trace_event {
+    const char *phase;
+    char arg[MAX_ARG];
+    int64_t start;      /* ns since trace_init() */
+    int64_t end;        /* -1 while running, equal to start for marks */
+    int tid;
+};
+
+static bool enabled = false;
+static bool output = false;     /* trace file is written */
+static bool registered = false;
+static bool json = false;
+static char path[4096];
+static int64_t origin;
+static struct trace_event events[MAX_EVENTS];
+static int event_count = 0;
+
+static int64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec - origin;
+}
+
+void trace_init(const char *spec)
+{
+    const char *p;
+    size_t len = 0;
+
+    enabled = false;
+    output = false;
+    __atomic_store_n(&event_count, 0, __ATOMIC_RELAXED);
+    if (spec == NULL || *spec == '\0') {
+        return;
+    }
+
+    json = !strncmp(spec, "json:", 5);
+    if (json) {
+        spec += 5;
+    }
+
+    for (p = spec; *p != '\0' && len < sizeof(path) - 32; p++) {
+        if (p[0] == '%' && p[1] == 'p') {
+            len += sprintf(path + len, "%d", (int) getpid());
+            p++;
+        } else {
+            path[len++] = *p;
+        }
+    }
+    path[len] = '\0';
+
+    origin = 0;
+    origin = now();
+    enabled = true;
+    output = true;
+
+    if (!registered) {
+        atexit(trace_flush);
+        registered = true;
+    }
+}
+
+static struct trace_event *add_event(const char *phase, const char *arg,
+    int *_id)
+{
+    struct trace_event *event;
+    int id;
+
+    /* Threads of libscl users take distinct slots */
+    id = __atomic_fetch_add(&event_count, 1, __ATOMIC_RELAXED);
+    if (id >= MAX_EVENTS) {
+        return NULL;
+    }
+
+    event = &events[id];
+    event->phase = phase;
+    snprintf(event->arg, sizeof(event->arg), "%s", arg != NULL ? arg : "");
+    event->tid = syscall(SYS_gettid);
+    event->end = -1;
+    event->start = now();
+    *_id = id;
+
+    return event;
+}
+
+void trace_collect()
+{
+    if (!enabled) {
+        origin = 0;
+        origin = now();
+        enabled = true;
+    }
+}
+
+int64_t trace_elapsed()
+{
+    return enabled ? now() : 0;
+}
+
+int trace_totals(const char **phases, int64_t *durations, int max)
+{
+    int count, n = 0, i2;
+    struct trace_event *e;
+
+    count = __atomic_load_n(&event_count, __ATOMIC_RELAXED);
+    if (count > MAX_EVENTS) {
+        count = MAX_EVENTS;
+    }
+
+    for (int i = 0; i < count; i++) {
+        e = &events[i];
+        if (e->end <= e->start) {
+            continue;
+        }
+
+        /* Phases are string literals, but compare them by content anyway */
+        for (i2 = 0; i2 < n && strcmp(phases[i2], e->phase); i2++);
+        if (i2 == n) {
+            if (n == max) {
+                continue;
+            }
+            phases[n] = e->phase;
+            durations[n++] = 0;
+        }
+        durations[i2] += e->end - e->start;
+    }
+
+    return n;
+}
+
+int trace_begin(const char *phase, const char *arg)
+{
+    int id = -1;
+
+    if (enabled) {
+        add_event(phase, arg, &id);
+    }
+    return id;
+}
+
+void trace_end(int id)
+{
+    if (id >= 0 && id < MAX_EVENTS) {
+        events[id].end = now();
+    }
+}
+
+void trace_mark(const char *phase, const char *arg)
+{
+    struct trace_event *event;
+    int id;
+
+    if (enabled && (event = add_event(phase, arg, &id)) != NULL) {
+        event->end = event->start;
+    }
+}
+
+static void write_json_string(FILE *f, const char *str)
+{
+    fputc('"', f);
+    for (; *str != '\0'; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(f, "\\%c", *str);
+        } else if ((unsigned char) *str < 0x20) {
+            fprintf(f, "\\u%04x", *str);
+        } else {
+            fputc(*str, f);
+        }
+    }
+    fputc('"', f);
+}
+
+static void write_json(FILE *f, int count, int64_t total, long rss,
+    long children_rss)
+{
+    struct trace_event *e;
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int i = 0; i < count; i++) {
+        e = &events[i];
+        fprintf(f, "{\"name\":");
+        write_json_string(f, e->phase);
+        if (e->end == e->start) {
+            fprintf(f, ",\"ph\":\"i\",\"s\":\"p\"");
+        } else {
+            fprintf(f, ",\"ph\":\"X\",\"dur\":%.3f",
+                ((e->end >= 0 ? e->end : total) - e->start) / 1000.0);
+        }
+        fprintf(f, ",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":",
+            e->start / 1000.0, (int) getpid(), e->tid);
+        write_json_string(f, e->arg);
+        fprintf(f, "}},\n");
+    }
+    fprintf(f, "{\"name\":\"peak_rss\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+        "\"args\":{\"self_kb\":%ld,\"children_kb\":%ld}}\n",
+        total / 1000.0, (int) getpid(), rss, children_rss);
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+static void write_summary(FILE *f, int count, int64_t total, long rss,
+    long children_rss)
+{
+    struct trace_event *e;
+    int64_t duration;
+
+    fprintf(f, "scl pid %d: %.3f ms, peak RSS %ld kB, children %ld kB\n",
+        (int) getpid(), total / 1e6, rss, children_rss);
+    for (int i = 0; i < count; i++) {
+        e = &events[i];
+        duration = (e->end >= 0 ? e->end : total) - e->start;
+        fprintf(f, "%10.3f ms %10.3f ms  %-16s %s\n", e->start / 1e6,
+            duration / 1e6, e->phase, e->arg);
+    }
+}
+
+void trace_flush()
+{
+    struct rusage self, children;
+    int count;
+    int64_t total;
+    FILE *f;
+
+    if (!output) {
+        return;
+    }
+
+    count = __atomic_load_n(&event_count, __ATOMIC_RELAXED);
+    if (count > MAX_EVENTS) {
+        count = MAX_EVENTS;
+    }
+    total = now();
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+
+    f = fopen(path, "we");
+    if (f == NULL) {
+        debug("Unable to write trace to %s\n", path);
+        return;
+    }
+    if (json) {
+        write_json(f, count, total, self.ru_maxrss, children.ru_maxrss);
+    } else {
+        write_summary(f, count, total, self.ru_maxrss, children.ru_maxrss);
+    }
+    fclose(f);
+}
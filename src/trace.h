@@ -0,0 +1,50 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * Timing trace of phases of one scl run, enabled by variable SCL_TRACE:
+ *   SCL_TRACE=<file>        summary of phases
+ *   SCL_TRACE=json:<file>   Chrome trace event JSON (chrome://tracing)
+ * "%p" in the file name is replaced by pid. When tracing is disabled,
+ * the functions below only test a flag.
+ */
+void trace_init(const char *spec);
+
+/*
+ * Record phases even if no trace file is written, so that they can be
+ * summed up by trace_totals().
+ */
+void trace_collect();
+
+/*
+ * Nanoseconds since tracing started, 0 when phases are not recorded.
+ */
+int64_t trace_elapsed();
+
+/*
+ * Sum durations of finished phases by their names, at most max phases are
+ * stored. Returns number of the phases.
+ */
+int trace_totals(const char **phases, int64_t *durations, int max);
+
+/*
+ * Start phase, arg (may be NULL) tells e. g. which collection it is about.
+ * Returns id of the phase for trace_end().
+ */
+int trace_begin(const char *phase, const char *arg);
+void trace_end(int id);
+
+/*
+ * Record point in time, e. g. the final exec.
+ */
+void trace_mark(const char *phase, const char *arg);
+
+/*
+ * Write the trace file. Called at exit and before exec, later calls
+ * rewrite the file with all phases recorded so far.
+ */
+void trace_flush();
+
+#endif
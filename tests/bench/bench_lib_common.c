@@ -0,0 +1,232 @@
+/*
+ * Microbenchmarks of string functions of lib_common.c on realistic and
+ * extreme inputs. Every line of the output is a JSON object describing one
+ * benchmark:
+ *   {"bench":"split","input":"modulecmd_100k","bytes":102400,"ops":1234,
+ *    "ns_per_op":81234.5,"allocs_per_op":1.00}
+ * Only the operation itself is timed, copying of the input which it
+ * modifies is not.
+ *
+ * usage: bench_lib_common [<seconds per benchmark>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../../src/lib_common.h"
+#include "../../src/sclmalloc.h"
+
+#define INPUT_SIZE (100 * 1024)
+#define X_SCLS_ENTRIES 500
+
+static double seconds = 0.2;
+
+struct input {
+    const char *name;
+    char *data;         /* original content */
+    char *copy;         /* content the operation works on */
+    size_t len;
+    char delim;
+    char **array1;      /* merge_string_arrays() and string_array_len() */
+    char **array2;
+};
+
+typedef void (*operation)(struct input *input);
+
+static int64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Keeps results alive, so that the compiler doesn't drop operations */
+static volatile size_t sink;
+
+static void op_split(struct input *input)
+{
+    char **parts = split(input->copy, input->delim);
+
+    sink += parts[0] != NULL;
+    parts = _free(parts);
+}
+
+static void op_count_words(struct input *input)
+{
+    sink += count_words(input->copy, input->delim);
+}
+
+static void op_unescape_string(struct input *input)
+{
+    unescape_string(input->copy);
+    sink += input->copy[0];
+}
+
+static void op_tokenizer(struct input *input)
+{
+    struct tokenizer tok;
+    struct strview token;
+
+    tokenizer_init(&tok, input->copy, input->len, input->delim);
+    while (tokenizer_next(&tok, &token)) {
+        sink += token.len;
+    }
+}
+
+static void op_merge_string_arrays(struct input *input)
+{
+    char **merged = merge_string_arrays(input->array1, input->array2);
+
+    sink += merged != NULL;
+    free(merged);
+}
+
+static void op_string_array_len(struct input *input)
+{
+    sink += string_array_len(input->array1);
+}
+
+/*
+ * Run op repeatedly for the given time. If the op modifies the input, the
+ * input is restored before every run.
+ */
+static void measure(const char *bench, struct input *input, operation op,
+    bool modifies)
+{
+    struct xmalloc_stats before, after;
+    int64_t start, elapsed = 0, deadline;
+    long ops = 0;
+
+    /* Warm up caches */
+    memcpy(input->copy, input->data, input->len + 1);
+    op(input);
+
+    xmalloc_get_stats(&before);
+    deadline = now() + seconds * 1e9;
+    do {
+        if (modifies || ops == 0) {
+            memcpy(input->copy, input->data, input->len + 1);
+        }
+        start = now();
+        op(input);
+        elapsed += now() - start;
+        ops++;
+    } while (now() < deadline);
+    xmalloc_get_stats(&after);
+
+    printf("{\"bench\":\"%s\",\"input\":\"%s\",\"bytes\":%zu,\"ops\":%ld,"
+        "\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n", bench, input->name,
+        input->len, ops, (double) elapsed / ops,
+        (double) (after.allocs - before.allocs) / ops);
+    fflush(stdout);
+}
+
+static void init_input(struct input *input, const char *name, char *data,
+    size_t len, char delim)
+{
+    input->name = name;
+    input->data = data;
+    input->len = len;
+    input->copy = xmalloc(len + 1);
+    input->delim = delim;
+    input->array1 = input->array2 = NULL;
+}
+
+/*
+ * Output of "modulecmd sh add" of many collections, values contain escaped
+ * spaces.
+ */
+static char *modulecmd_output(size_t size, size_t *_len)
+{
+    char *data = xmalloc(size + 256);
+    size_t len = 0;
+
+    for (int i = 0; len < size; i++) {
+        len += sprintf(data + len,
+            "PATH=/opt/rh/collection%03d/root/usr/bin:/usr/bin ;export PATH;\n"
+            "X_SCLS=collection%03d\\ other ;export X_SCLS;\n", i, i);
+    }
+    *_len = len;
+
+    return data;
+}
+
+static char *repeated(char ch, size_t size)
+{
+    char *data = xmalloc(size + 1);
+
+    memset(data, ch, size);
+    data[size] = '\0';
+
+    return data;
+}
+
+/*
+ * Sorted collection names first..first+count-1.
+ */
+static char **collection_array(int first, int count)
+{
+    char **array = xcalloc(count + 1, sizeof(*array));
+
+    for (int i = 0; i < count; i++) {
+        xasprintf(&array[i], "collection%04d", first + i);
+    }
+
+    return array;
+}
+
+int main(int argc, char *argv[])
+{
+    struct input modulecmd, x_scls, delims, backslashes, overlap, same;
+    char *data;
+    size_t len = 0;
+
+    if (argc > 1) {
+        seconds = atof(argv[1]);
+    }
+
+    data = modulecmd_output(INPUT_SIZE, &len);
+    init_input(&modulecmd, "modulecmd_100k", data, len, ';');
+
+    data = xmalloc(X_SCLS_ENTRIES * 16);
+    len = 0;
+    for (int i = 0; i < X_SCLS_ENTRIES; i++) {
+        len += sprintf(data + len, "collection%04d ", i);
+    }
+    init_input(&x_scls, "x_scls_500", data, len, ' ');
+    x_scls.array1 = collection_array(0, X_SCLS_ENTRIES);
+
+    init_input(&delims, "delimiters_100k", repeated(';', INPUT_SIZE),
+        INPUT_SIZE, ';');
+    init_input(&backslashes, "backslashes_100k", repeated('\\', INPUT_SIZE),
+        INPUT_SIZE, ';');
+
+    /* Enabled lists of new and old collections overlap by 90 % */
+    init_input(&overlap, "enabled_500_overlap_90", xstrdup(""), 0, ' ');
+    overlap.array1 = collection_array(0, X_SCLS_ENTRIES);
+    overlap.array2 = collection_array(X_SCLS_ENTRIES / 10, X_SCLS_ENTRIES);
+    init_input(&same, "enabled_500_same", xstrdup(""), 0, ' ');
+    same.array1 = collection_array(0, X_SCLS_ENTRIES);
+    same.array2 = collection_array(0, X_SCLS_ENTRIES);
+
+    measure("split", &modulecmd, op_split, true);
+    measure("split", &x_scls, op_split, true);
+    measure("split", &delims, op_split, true);
+    measure("tokenizer", &modulecmd, op_tokenizer, false);
+    measure("tokenizer", &x_scls, op_tokenizer, false);
+    measure("tokenizer", &delims, op_tokenizer, false);
+    measure("count_words", &modulecmd, op_count_words, false);
+    measure("count_words", &x_scls, op_count_words, false);
+    measure("count_words", &delims, op_count_words, false);
+    measure("unescape_string", &modulecmd, op_unescape_string, true);
+    measure("unescape_string", &backslashes, op_unescape_string, true);
+    measure("string_array_len", &x_scls, op_string_array_len, false);
+    measure("merge_string_arrays", &overlap, op_merge_string_arrays, false);
+    measure("merge_string_arrays", &same, op_merge_string_arrays, false);
+
+    return EXIT_SUCCESS;
+}
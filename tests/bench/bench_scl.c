@@ -0,0 +1,239 @@
+/*
+ * Benchmark of scl overhead on the tree of collections of fixture.h.
+ *
+ * Every line of the output is a JSON object describing one benchmark:
+ *   {"bench":"scl_run","type":"mod","collections":4,"iterations":20,
+ *    "mean_us":1234.5,"min_us":1100.2,"p50_us":1200.3,"p99_us":1500.0}
+ *
+ * usage: bench_scl [<iterations>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "../../src/errors.h"
+#include "../../src/scllib.h"
+#include "../../src/fallback.h"
+#include "../../src/sclmalloc.h"
+#include "../../src/lib_common.h"
+#include "fixture.h"
+
+/* Numbers of collections run_command() and fallback_run_command() get */
+static const int api_counts[] = {1, 4, 16, 32};
+
+static int64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(const char *bench, const char *type, int count,
+    int64_t *samples, int iterations)
+{
+    int64_t sum = 0;
+
+    qsort(samples, iterations, sizeof(*samples), compare_samples);
+    for (int i = 0; i < iterations; i++) {
+        sum += samples[i];
+    }
+
+    printf("{\"bench\":\"%s\",\"type\":\"%s\",\"collections\":%d,"
+        "\"iterations\":%d,\"mean_us\":%.1f,\"min_us\":%.1f,\"p50_us\":%.1f,"
+        "\"p99_us\":%.1f}\n", bench, type, count, iterations,
+        sum / 1e3 / iterations, samples[0] / 1e3,
+        samples[(iterations - 1) / 2] / 1e3,
+        samples[(iterations * 99 + 99) / 100 - 1] / 1e3);
+    fflush(stdout);
+}
+
+static void fail(const char *bench, const char *type, int count)
+{
+    fprintf(stderr, "Benchmark %s of %d collections of type %s failed\n",
+        bench, count, type);
+    exit(EXIT_FAILURE);
+}
+
+static char **collection_names(const char *type, int count)
+{
+    char **names = xcalloc(count + 1, sizeof(*names));
+
+    for (int i = 0; i < count; i++) {
+        xasprintf(&names[i], "%s%02d", type, i);
+    }
+
+    return names;
+}
+
+static bool run_program(char *const argv[])
+{
+    pid_t pid;
+    int status;
+
+    if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+        return false;
+    }
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/*
+ * "scl run <collections> -- true" and plain "true" for comparison.
+ */
+static void bench_scl_run(int iterations)
+{
+    int64_t samples[iterations], start;
+    char *argv[MAX_COLLECTIONS + 6];
+    char *true_argv[] = {"/bin/true", NULL};
+    char **names;
+    int argc;
+
+    for (int i = -1; i < iterations; i++) {
+        start = now();
+        if (!run_program(true_argv)) {
+            fail("spawn_true", "none", 0);
+        }
+        if (i >= 0) {
+            samples[i] = now() - start;
+        }
+    }
+    report("spawn_true", "none", 0, samples, iterations);
+
+    for (int t = 0; t < COLLECTION_TYPES; t++) {
+        for (int count = 1; count <= MAX_COLLECTIONS; count++) {
+            names = collection_names(collection_types[t], count);
+            argc = 0;
+            argv[argc++] = BENCH_SCL;
+            argv[argc++] = "run";
+            for (int i = 0; i < count; i++) {
+                argv[argc++] = names[i];
+            }
+            argv[argc++] = "--";
+            argv[argc++] = "true";
+            argv[argc] = NULL;
+
+            /* The first run fills caches */
+            for (int i = -1; i < iterations; i++) {
+                start = now();
+                if (!run_program(argv)) {
+                    fail("scl_run", collection_types[t], count);
+                }
+                if (i >= 0) {
+                    samples[i] = now() - start;
+                }
+            }
+            report("scl_run", collection_types[t], count, samples, iterations);
+            names = free_string_array(names);
+        }
+    }
+}
+
+static void bench_run_command(int iterations)
+{
+    int64_t samples[iterations], start;
+    const char *bench;
+    char **names;
+    int count;
+    scl_rc ret;
+
+    for (int t = 0; t < COLLECTION_TYPES; t++) {
+        bench = strcmp(collection_types[t], "old") ? "run_command" :
+            "fallback_run_command";
+        for (int c = 0; c < sizeof(api_counts) / sizeof(*api_counts); c++) {
+            count = api_counts[c];
+            names = collection_names(collection_types[t], count);
+            for (int i = -1; i < iterations; i++) {
+                start = now();
+                if (strcmp(collection_types[t], "old")) {
+                    ret = run_command(names, "true", false);
+                } else {
+                    ret = fallback_run_command(names, "true", false);
+                }
+                if (ret != EOK) {
+                    fail(bench, collection_types[t], count);
+                }
+                if (i >= 0) {
+                    samples[i] = now() - start;
+                }
+            }
+            report(bench, collection_types[t], count, samples, iterations);
+            names = free_string_array(names);
+        }
+    }
+}
+
+static void bench_installed_collections(int iterations)
+{
+    int64_t samples[iterations], start;
+    char *const *installed;
+    char **fallback_installed;
+
+    /* Nothing is cached between calls */
+    for (int i = -1; i < iterations; i++) {
+        release_scllib_cache();
+        start = now();
+        if (get_installed_collections(&installed) != EOK) {
+            fail("get_installed_collections", "all", 0);
+        }
+        if (i >= 0) {
+            samples[i] = now() - start;
+        }
+    }
+    report("get_installed_collections", "all", string_array_len(installed),
+        samples, iterations);
+    release_scllib_cache();
+
+    for (int i = -1; i < iterations; i++) {
+        start = now();
+        if (fallback_get_installed_collections(&fallback_installed) != EOK) {
+            fail("fallback_get_installed_collections", "all", 0);
+        }
+        if (i >= 0) {
+            samples[i] = now() - start;
+        }
+        if (i < iterations - 1) {
+            fallback_installed = free_string_array(fallback_installed);
+        }
+    }
+    report("fallback_get_installed_collections", "all",
+        string_array_len(fallback_installed), samples, iterations);
+    fallback_installed = free_string_array(fallback_installed);
+}
+
+int main(int argc, char *argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+
+    if (iterations < 1) {
+        fprintf(stderr, "usage: %s [<iterations>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Nothing may be enabled already */
+    unsetenv("X_SCLS");
+    unsetenv("_LMFILES_");
+    unsetenv("LOADEDMODULES");
+
+    create_tree();
+    bench_installed_collections(iterations * 50);
+    bench_run_command(iterations);
+    bench_scl_run(iterations);
+
+    return EXIT_SUCCESS;
+}
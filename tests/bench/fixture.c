@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "../../src/sclmalloc.h"
+#include "fixture.h"
+
+const char *collection_types[COLLECTION_TYPES] = {"mod", "cmd", "old"};
+
+static void write_file(const char *path, const char *content, mode_t mode)
+{
+    FILE *f = fopen(path, "w");
+
+    if (f == NULL || fputs(content, f) == EOF || fclose(f) != 0 ||
+        chmod(path, mode) != 0) {
+
+        fprintf(stderr, "Unable to write %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void make_dir(const char *path)
+{
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void create_collection(const char *type, const char *name)
+{
+    struct arena arena = ARENA_INIT;
+    const char *bindir;
+
+    bindir = arena_asprintf(&arena, BENCH_ROOT "/opt/%s/root/usr/bin", name);
+    make_dir(arena_asprintf(&arena, BENCH_ROOT "/opt/%s", name));
+    make_dir(arena_asprintf(&arena, BENCH_ROOT "/opt/%s/root", name));
+    write_file(arena_asprintf(&arena, BENCH_ROOT "/conf/%s", name),
+        BENCH_ROOT "/opt\n", 0644);
+    write_file(arena_asprintf(&arena, BENCH_ROOT "/opt/%s/enable", name),
+        arena_asprintf(&arena,
+            "export PATH=%s${PATH:+:${PATH}}\n"
+            "export X_%s=1\n", bindir, name), 0644);
+
+    if (strcmp(type, "old")) {
+        /* conflict makes scl run modulecmd */
+        write_file(arena_asprintf(&arena, BENCH_ROOT "/modulefiles/%s", name),
+            arena_asprintf(&arena,
+                "#%%Module1.0\n"
+                "module-whatis \"Benchmark collection %s\"\n"
+                "%s"
+                "prepend-path PATH %s\n"
+                "prepend-path MANPATH " BENCH_ROOT "/opt/%s/root/usr/share/man\n"
+                "setenv X_%s 1\n", name,
+                strcmp(type, "cmd") ? "" : "conflict other\n", bindir, name,
+                name), 0644);
+    }
+
+    arena_release(&arena);
+}
+
+void create_tree()
+{
+    char name[16];
+
+    make_dir(BENCH_ROOT);
+    make_dir(BENCH_ROOT "/conf");
+    make_dir(BENCH_ROOT "/modulefiles");
+    make_dir(BENCH_ROOT "/opt");
+    make_dir(BENCH_ROOT "/cache");
+
+    /* Settings of the host must not leak in */
+    setenv("SCL_CONFIG", BENCH_ROOT "/scl.conf", 1);
+    setenv("SCL_CONF_DIR", BENCH_ROOT "/conf", 1);
+    setenv("SCL_MODULES_PATH", BENCH_ROOT "/modulefiles", 1);
+    setenv("SCL_MODULE_CMD", BENCH_ROOT "/modulecmd", 1);
+    setenv("SCL_CACHE_DIR", BENCH_ROOT "/cache", 1);
+    unsetenv("SCLD_SOCKET");
+    unsetenv("SCL_STATS");
+
+    /* Output of "modulecmd sh add <collection>..." */
+    write_file(BENCH_ROOT "/modulecmd",
+        "#!/bin/sh\n"
+        "shift 2\n"
+        "for c; do\n"
+        "    PATH=" BENCH_ROOT "/opt/$c/root/usr/bin:$PATH\n"
+        "    printf 'PATH=%s ;export PATH;\\nX_%s=1 ;export X_%s;\\n' "
+        "\"$PATH\" \"$c\" \"$c\"\n"
+        "done\n", 0755);
+
+    for (int t = 0; t < COLLECTION_TYPES; t++) {
+        for (int i = 0; i < MAX_COLLECTIONS; i++) {
+            snprintf(name, sizeof(name), "%s%02d", collection_types[t], i);
+            create_collection(collection_types[t], name);
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef __FIXTURE_H__
+#define __FIXTURE_H__
+
+/*
+ * Synthetic tree of collections in BENCH_ROOT. There are MAX_COLLECTIONS
+ * collections named <type><nn> of each type:
+ *   mod - modulefile evaluated in process
+ *   cmd - modulefile which needs modulecmd, a shell script stub is used
+ *   old - collection of old type enabled by its enable script
+ */
+#define MAX_COLLECTIONS 32
+#define COLLECTION_TYPES 3
+
+extern const char *collection_types[COLLECTION_TYPES];
+
+/*
+ * Create the tree, existing files are rewritten, and set variables of
+ * environment, so that this process and scl (BENCH_SCL) run from it use
+ * the tree instead of the system one. Exits on failure.
+ */
+void create_tree();
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Load test of concurrent scl runs on the tree of collections of
+ * fixture.h. For every load N = 1, 2, 4, ... up to the maximal load, N
+ * processes are forked, they wait until all of them exist and then all of
+ * them run scl at once, like cron jobs or CI jobs starting at the same
+ * second. The runs take turns in enabling collections of new type
+ * evaluated in process (mod), by modulecmd (cmd), collections of old type
+ * (old) and both new and old ones (mixed), which goes through the
+ * fallback, so they contend for modulecmd, the delta cache and temporary
+ * files in /var/tmp.
+ *
+ * Every line of the output is a JSON object describing runs of one type
+ * (or all of them) at one load:
+ *   {"load":64,"type":"all","runs":192,"failures":0,"wall_ms":150.2,
+ *    "runs_per_s":1278.3,"p50_ms":40.1,"p99_ms":120.5,"max_ms":130.0}
+ * Latency of a run is measured from the start of all runs to its exit.
+ *
+ * usage: load_scl [<maximal load> [<rounds>]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../../src/sclmalloc.h"
+#include "fixture.h"
+
+#define RUN_TYPES 4
+
+static const char *run_types[RUN_TYPES] = {"mod", "cmd", "old", "mixed"};
+
+static char *const run_argv[RUN_TYPES][8] = {
+    {BENCH_SCL, "run", "mod00", "mod01", "mod02", "--", "true", NULL},
+    {BENCH_SCL, "run", "cmd00", "cmd01", "cmd02", "--", "true", NULL},
+    {BENCH_SCL, "run", "old00", "old01", "old02", "--", "true", NULL},
+    {BENCH_SCL, "run", "mod00", "cmd00", "old00", "--", "true", NULL},
+};
+
+struct samples {
+    int64_t *values;
+    int count;
+    int failures;
+};
+
+static int64_t now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void report(int load, const char *type, struct samples *s,
+    int64_t wall)
+{
+    int64_t *v = s->values;
+    int n = s->count;
+
+    if (n == 0) {
+        return;
+    }
+
+    qsort(v, n, sizeof(*v), compare_samples);
+    printf("{\"load\":%d,\"type\":\"%s\",\"runs\":%d,\"failures\":%d,"
+        "\"wall_ms\":%.1f,\"runs_per_s\":%.1f,\"p50_ms\":%.2f,"
+        "\"p99_ms\":%.2f,\"max_ms\":%.2f}\n", load, type, n, s->failures,
+        wall / 1e6, n / (wall / 1e9), v[(n - 1) / 2] / 1e6,
+        v[(n * 99 + 99) / 100 - 1] / 1e6, v[n - 1] / 1e6);
+    fflush(stdout);
+}
+
+static void child(int gate, int type)
+{
+    char ch;
+    int null_fd;
+
+    /* Wait until the parent closes the other end */
+    while (read(gate, &ch, 1) == -1 && errno == EINTR);
+    close(gate);
+
+    null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    execv(run_argv[type][0], run_argv[type]);
+    _exit(127);
+}
+
+/*
+ * Start load runs at once and add their latencies to samples. Returns time
+ * when all of them finished.
+ */
+static int64_t run_round(int load, struct samples *all,
+    struct samples *by_type)
+{
+    pid_t *pids = xcalloc(load, sizeof(*pids));
+    int gate[2];
+    int64_t start, elapsed = 0;
+    int status, type, i;
+    pid_t pid;
+
+    if (pipe(gate) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < load; i++) {
+        pids[i] = fork();
+        if (pids[i] == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        } else if (pids[i] == 0) {
+            close(gate[1]);
+            child(gate[0], i % RUN_TYPES);
+        }
+    }
+    close(gate[0]);
+
+    start = now();
+    close(gate[1]);
+
+    for (int reaped = 0; reaped < load; reaped++) {
+        while ((pid = wait(&status)) == -1 && errno == EINTR);
+        if (pid == -1) {
+            perror("wait");
+            exit(EXIT_FAILURE);
+        }
+        elapsed = now() - start;
+
+        for (i = 0; i < load && pids[i] != pid; i++);
+        type = i % RUN_TYPES;
+        all->values[all->count++] = elapsed;
+        by_type[type].values[by_type[type].count++] = elapsed;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            all->failures++;
+            by_type[type].failures++;
+        }
+    }
+
+    pids = _free(pids);
+    return elapsed;
+}
+
+static void samples_init(struct samples *s, int size)
+{
+    s->values = xcalloc(size, sizeof(*s->values));
+    s->count = s->failures = 0;
+}
+
+/*
+ * Run rounds of load concurrent runs, print results if requested.
+ */
+static void run_load(int load, int rounds, bool print)
+{
+    struct samples all, by_type[RUN_TYPES];
+    int64_t wall = 0;
+
+    samples_init(&all, load * rounds);
+    for (int t = 0; t < RUN_TYPES; t++) {
+        samples_init(&by_type[t], load * rounds);
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        wall += run_round(load, &all, by_type);
+    }
+
+    if (print) {
+        report(load, "all", &all, wall);
+    }
+    all.values = _free(all.values);
+    for (int t = 0; t < RUN_TYPES; t++) {
+        if (print) {
+            report(load, run_types[t], &by_type[t], wall);
+        }
+        by_type[t].values = _free(by_type[t].values);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int max_load = argc > 1 ? atoi(argv[1]) : 256;
+    int rounds = argc > 2 ? atoi(argv[2]) : 3;
+
+    if (max_load < 1 || rounds < 1) {
+        fprintf(stderr, "usage: %s [<maximal load> [<rounds>]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    /* Nothing may be enabled already */
+    unsetenv("X_SCLS");
+    unsetenv("_LMFILES_");
+    unsetenv("LOADEDMODULES");
+
+    create_tree();
+
+    /* Fill the delta cache, so that the first load isn't special */
+    run_load(RUN_TYPES, 1, false);
+
+    for (int load = 1; load < max_load; load *= 2) {
+        run_load(load, rounds, true);
+    }
+    run_load(max_load, rounds, true);
+
+    return EXIT_SUCCESS;
+}
@@ -238,6 +238,126 @@ static void test_scl_args_get_run_command(void **state)
     scl_args_free(args);
 }
 
+static void test_scl_args_get_env(void **state)
+{
+    (void) state; /* unused */
+    int argc;
+    char **argv;
+    struct scl_args *args;
+    scl_rc ret;
+
+    /* test env without defining collection, it should return EINPUT */
+    argv = (char *[]) {"scl", "env", "--format=json"};
+    argc = 3;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EINPUT);
+
+    /* test env with default format */
+    argv = (char *[]) {"scl", "env", "collection1", "collection2"};
+    argc = 4;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_ENV);
+    assert_int_equal(args->env_format, ENV_FORMAT_SH);
+    assert_true(compare_string_arrays(args->collections,
+        (char *[]) {"collection1", "collection2", NULL}));
+    scl_args_free(args);
+
+    /* test env with format given as separate argument */
+    argv = (char *[]) {"scl", "env", "collection1", "--format", "csh"};
+    argc = 5;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_ENV);
+    assert_int_equal(args->env_format, ENV_FORMAT_CSH);
+    assert_true(compare_string_arrays(args->collections,
+        (char *[]) {"collection1", NULL}));
+    scl_args_free(args);
+
+    /* test env with unknown format, it should return EINPUT */
+    argv = (char *[]) {"scl", "env", "--format=xml", "collection1"};
+    argc = 4;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EINPUT);
+}
+
+static void test_scl_args_get_root(void **state)
+{
+    (void) state; /* unused */
+    int argc;
+    char **argv;
+    struct scl_args *args;
+    scl_rc ret;
+
+    /* test cache build */
+    argv = (char *[]) {"scl", "cache", "build"};
+    argc = 3;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_CACHE_BUILD);
+    assert_null(args->root);
+    scl_args_free(args);
+
+    /* test --root given as separate argument */
+    argv = (char *[]) {"scl", "--root", "/image", "list-packages",
+        "collection"};
+    argc = 5;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_LIST_PACKAGES);
+    assert_string_equal(args->root, "/image");
+    assert_true(compare_string_arrays(args->collections,
+        (char *[]) {"collection", NULL}));
+    scl_args_free(args);
+
+    /* test --root=<dir> */
+    argv = (char *[]) {"scl", "--root=/image", "list-collections"};
+    argc = 3;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_LIST_COLLECTIONS);
+    assert_string_equal(args->root, "/image");
+    scl_args_free(args);
+
+    /* test cache export with --root */
+    argv = (char *[]) {"scl", "--root", "/image", "cache", "export",
+        "/tmp/bundle"};
+    argc = 6;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_CACHE_EXPORT);
+    assert_string_equal(args->root, "/image");
+    assert_string_equal(args->bundle_file, "/tmp/bundle");
+    scl_args_free(args);
+
+    /* test cache import */
+    argv = (char *[]) {"scl", "cache", "import", "bundle"};
+    argc = 4;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EOK);
+    assert_int_equal(args->action, ACTION_CACHE_IMPORT);
+    assert_string_equal(args->bundle_file, "bundle");
+    scl_args_free(args);
+
+    /* test cache import without a file, it should return EINPUT */
+    argv = (char *[]) {"scl", "cache", "import"};
+    argc = 3;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EINPUT);
+
+    /* test relative root, it should return EINPUT */
+    argv = (char *[]) {"scl", "--root", "image", "cache", "build"};
+    argc = 5;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EINPUT);
+
+    /* test --root with an action running commands, it should return EINPUT */
+    argv = (char *[]) {"scl", "--root", "/image", "run", "collection",
+        "command"};
+    argc = 6;
+    ret = scl_args_get(argc, argv, &args);
+    assert_int_equal(ret, EINPUT);
+}
 
 int main(void)
 {
@@ -245,6 +365,8 @@ int main(void)
         cmocka_unit_test(test_scl_args_get_basic_args),
         cmocka_unit_test(test_scl_args_get_register_deregister),
         cmocka_unit_test(test_scl_args_get_run_command),
+        cmocka_unit_test(test_scl_args_get_env),
+        cmocka_unit_test(test_scl_args_get_root),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
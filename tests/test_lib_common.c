@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "../src/lib_common.h"
+#include "../src/sclmalloc.h"
+#include "../src/trace.h"
+#include "../src/stats.h"
+
+/*
+ * Byte by byte implementations the vectorized functions have to be
+ * equivalent to.
+ */
+static int ref_count_words(const char *str, char ch)
+{
+    int count = 0;
+    bool inside_word = false;
+
+    while (*str != '\0') {
+        if (*str != ch) {
+            if (!inside_word) {
+                count++;
+            }
+            inside_word = true;
+        } else {
+            inside_word = false;
+        }
+        str++;
+    }
+
+    return count;
+}
+
+static void ref_strip_trailing_chars(char *str, char char_to_strip)
+{
+    for (int i = strlen(str) - 1; i >=0; i--) {
+        if (str[i] == char_to_strip) {
+            str[i] = '\0';
+        } else {
+            break;
+        }
+    }
+}
+
+static void ref_unescape_string(char *str)
+{
+    int str_len = strlen(str);
+    int si, ti = 0;
+
+    for (si = 0; si < str_len; si++) {
+        if (str[si] == '\\') {
+            si++;
+            if (si == str_len) {
+                break;
+            }
+        }
+
+        str[ti++] = str[si];
+    }
+    str[ti] = '\0';
+}
+
+static char **ref_split(char *str, char delim)
+{
+    char **parts, *p, *saveptr;
+    int i = 0;
+    char delim_str[2] = {delim, '\0'};
+
+    parts = xmalloc((ref_count_words(str, delim) + 1) * sizeof(*parts));
+
+    p = strtok_r(str, delim_str, &saveptr);
+    while (p != NULL) {
+        parts[i++] = p;
+        p = strtok_r(NULL, delim_str, &saveptr);
+    }
+    parts[i] = NULL;
+
+    return parts;
+}
+
+#define MAX_LEN 300
+
+/*
+ * Fill buf with random string from a small alphabet, so delimiters form
+ * runs and appear at both ends of vectors. buf is placed at random offset
+ * to try unaligned loads.
+ */
+static char *random_string(char *buf)
+{
+    static const char alphabet[] = "::  \\\\;\n/ab";
+    char *str = buf + rand() % 32;
+    int len = rand() % MAX_LEN;
+
+    for (int i = 0; i < len; i++) {
+        str[i] = alphabet[rand() % (sizeof(alphabet) - 1)];
+    }
+    str[len] = '\0';
+
+    return str;
+}
+
+static void test_simd_equivalence(void **state)
+{
+    (void) state; /* unused */
+    static const char delims[] = {':', ' ', '\\', ';', '\n', '/'};
+    char buf[MAX_LEN + 32], copy[MAX_LEN + 32], ref[MAX_LEN + 32];
+    char **parts, **ref_parts;
+    char *str, delim;
+    int i2;
+
+    srand(2017);
+
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX2; level++) {
+        if (simd_select(level) != level) {
+            continue;
+        }
+
+        for (int i = 0; i < 20000; i++) {
+            str = random_string(buf);
+            delim = delims[rand() % sizeof(delims)];
+
+            assert_int_equal(count_words(str, delim),
+                ref_count_words(str, delim));
+
+            strcpy(copy, str);
+            strcpy(ref, str);
+            strip_trailing_chars(copy, delim);
+            ref_strip_trailing_chars(ref, delim);
+            assert_string_equal(copy, ref);
+
+            strcpy(copy, str);
+            strcpy(ref, str);
+            unescape_string(copy);
+            ref_unescape_string(ref);
+            assert_string_equal(copy, ref);
+
+            /* Both split the string in place, compare offsets of parts */
+            strcpy(copy, str);
+            strcpy(ref, str);
+            parts = split(copy, delim);
+            ref_parts = ref_split(ref, delim);
+            for (i2 = 0; ref_parts[i2] != NULL; i2++) {
+                assert_non_null(parts[i2]);
+                assert_int_equal(parts[i2] - copy, ref_parts[i2] - ref);
+                assert_string_equal(parts[i2], ref_parts[i2]);
+            }
+            assert_null(parts[i2]);
+            assert_memory_equal(copy, ref, strlen(str) + 1);
+            parts = _free(parts);
+            ref_parts = _free(ref_parts);
+        }
+    }
+
+    simd_select(SIMD_AVX2);
+}
+
+static char *read_file(const char *path)
+{
+    static char buf[8192];
+    FILE *f = fopen(path, "r");
+    size_t len;
+
+    assert_non_null(f);
+    len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+
+    return buf;
+}
+
+static void test_trace(void **state)
+{
+    (void) state; /* unused */
+    char path[] = "/tmp/scl_trace_XXXXXX";
+    char spec[64];
+    char *content;
+    int id;
+
+    /* Disabled tracing doesn't record anything */
+    trace_init(NULL);
+    assert_int_equal(trace_begin("args", NULL), -1);
+
+    close(mkstemp(path));
+    snprintf(spec, sizeof(spec), "json:%s", path);
+    trace_init(spec);
+    id = trace_begin("spawn", "/usr/bin/\"modulecmd\"");
+    assert_true(id >= 0);
+    trace_end(id);
+    trace_mark("exec", "true");
+    trace_flush();
+
+    content = read_file(path);
+    assert_non_null(strstr(content, "{\"traceEvents\":["));
+    assert_non_null(strstr(content, "\"name\":\"spawn\",\"ph\":\"X\""));
+    assert_non_null(strstr(content, "\"arg\":\"/usr/bin/\\\"modulecmd\\\"\""));
+    assert_non_null(strstr(content, "\"name\":\"exec\",\"ph\":\"i\""));
+    assert_non_null(strstr(content, "\"self_kb\":"));
+
+    /* Summary lists phases with their arguments */
+    trace_init(path);
+    trace_end(trace_begin("collection_path", "scl1"));
+    trace_flush();
+    content = read_file(path);
+    assert_non_null(strstr(content, "peak RSS"));
+    assert_non_null(strstr(content, "collection_path  scl1"));
+    assert_null(strstr(content, "spawn"));
+
+    trace_init(NULL);
+    unlink(path);
+}
+
+static void test_stats(void **state)
+{
+    (void) state; /* unused */
+    char path[] = "/tmp/scl_stats_XXXXXX";
+    char summary_path[] = "/tmp/scl_stats_summary_XXXXXX";
+    char *colls[] = {"foo", "b\"ar", NULL};
+    char *content;
+    FILE *f;
+
+    close(mkstemp(path));
+    close(mkstemp(summary_path));
+
+    trace_init(NULL);
+    stats_init(path);
+    stats_begin("enable", colls);
+    trace_end(trace_begin("compute_env", NULL));
+    stats_fallback();
+    stats_finish(0, true);
+    /* Only the first call writes the record */
+    stats_finish(1, false);
+
+    content = read_file(path);
+    assert_non_null(strstr(content, "\"action\":\"enable\","
+        "\"collections\":[\"foo\",\"b\\\"ar\"],\"fallback\":true,"
+        "\"exec\":true,\"rc\":0,"));
+    assert_non_null(strstr(content, "\"phases\":{\"compute_env\":"));
+    assert_int_equal(strchr(content, '\n') - content, strlen(content) - 1);
+
+    trace_init(NULL);
+    stats_init(path);
+    stats_begin("env", colls + 1);
+    stats_finish(3, false);
+
+    /* Garbage is skipped */
+    f = fopen(path, "a");
+    fprintf(f, "{\"pid\":1}\n");
+    fclose(f);
+
+    f = fopen(summary_path, "w");
+    assert_int_equal(stats_summary(path, f), EOK);
+    fclose(f);
+    content = read_file(summary_path);
+    assert_non_null(strstr(content, "2 runs, 1 with collections of old type, "
+        "1 ended by exec, 1 failed, 1 malformed lines skipped"));
+    assert_non_null(strstr(content, "action enable     "));
+    assert_non_null(strstr(content, "collection b\"ar     "));
+    assert_non_null(strstr(content, "phase compute_env "));
+    assert_true(strstr(content, "action env ") < strstr(content, "collection foo "));
+
+    assert_int_equal(stats_summary("/nonexistent/scl_stats", stdout), EDISK);
+
+    stats_init(NULL);
+    unlink(path);
+    unlink(summary_path);
+}
+
+static void test_alloc_report(void **state)
+{
+    (void) state; /* unused */
+    char path[] = "/tmp/scl_alloc_XXXXXX";
+    char *kept, *str = NULL, *content;
+    char line[64];
+    int site_line;
+    FILE *f;
+
+    close(mkstemp(path));
+
+    /* One site keeps its allocation, the other one releases both */
+    kept = xmalloc(100);
+    for (int i = 0; i < 2; i++) {
+        site_line = __LINE__ + 1;
+        xasprintf(&str, "%d", i);
+        str = _free(str);
+        snprintf(line, sizeof(line), "2              4          0  "
+            "test_lib_common.c:%d\n", site_line);
+    }
+
+    f = fopen(path, "w");
+    xmalloc_report(f);
+    fclose(f);
+    content = read_file(path);
+    assert_non_null(strstr(content, line));
+    assert_non_null(strstr(content, "1            100          1  "
+        "test_lib_common.c:"));
+
+    kept = _free(kept);
+    unlink(path);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_simd_equivalence),
+        cmocka_unit_test(test_trace),
+        cmocka_unit_test(test_stats),
+        cmocka_unit_test(test_alloc_report),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
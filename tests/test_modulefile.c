@@ -0,0 +1,774 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "../src/modulefile.h"
+#include "../src/cache.h"
+#include "../src/envbuilder.h"
+#include "../src/lib_common.h"
+#include "../src/errors.h"
+#include "../src/sclconfig.h"
+
+extern char *__real_getenv();
+
+char *__wrap_getenv(const char *name)
+{
+    return __real_getenv(name);
+}
+
+typedef struct {
+    char *modulefile; /* content of modulefile of module "scl1" */
+    char *env_path; /* value of PATH before the module is loaded */
+    char **expected_vars; /* expected variables set by env_delta_apply() */
+    bool supported; /* expected evaluation result */
+} modulefile_testcase;
+
+static char system_dir[] = "/tmp/scl_system_XXXXXX";
+static char system_cache_dir[sizeof(system_dir) + 6];
+
+/*
+ * Keep the tests away from caches and configuration of the host. The
+ * cache directory of root doesn't exist unless a test creates it.
+ */
+static int setup(void **state)
+{
+    if (mkdtemp(system_dir) == NULL) {
+        return -1;
+    }
+    snprintf(system_cache_dir, sizeof(system_cache_dir), "%s/cache",
+        system_dir);
+    setenv("SCL_CACHE_DIR", system_cache_dir, 1);
+    setenv("SCL_CONFIG", "/nonexistent/scl.conf", 1);
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    rmdir(system_dir);
+    return 0;
+}
+
+static void write_module(const char *dir, const char *name, const char *content)
+{
+    char path[256];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fp = fopen(path, "w");
+    assert_non_null(fp);
+    fputs(content, fp);
+    fclose(fp);
+}
+
+static void test_modulefile_eval(void **state)
+{
+    (void) state; /* unused */
+    char dir[] = "/tmp/scl_test_XXXXXX";
+    char path[256];
+    struct env_delta delta = {NULL, 0, 0};
+    struct env_builder env;
+    char *var;
+    bool supported;
+    scl_rc ret;
+
+    modulefile_testcase testcases[] = {
+        /* Simple collection */
+        {
+            .modulefile =
+                "#%Module1.0\n"
+                "# comment\n"
+                "set prefix /opt/rh/scl1\n"
+                "prepend-path PATH $prefix/root/usr/bin\n"
+                "setenv SCL1_HOME \"${prefix}/root\"\n",
+
+            .env_path = "/usr/bin:/bin",
+            .expected_vars = (char *[]) {
+                (char []) {"PATH=/opt/rh/scl1/root/usr/bin:/usr/bin:/bin"},
+                (char []) {"SCL1_HOME=/opt/rh/scl1/root"},
+                (char []) {"LOADEDMODULES=scl1"},
+                NULL,
+            },
+            .supported = true,
+        },
+
+        /* Element already present is moved, other module is loaded first */
+        {
+            .modulefile =
+                "#%Module1.0\n"
+                "proc ModulesHelp { } {\n"
+                "    puts stderr \"help\"\n"
+                "}\n"
+                "module-whatis {Collection scl1}\n"
+                "module load scl2\n"
+                "append-path -d { } X_LIST a b\n"
+                "prepend-path PATH /bin\n",
+
+            .env_path = "/usr/bin:/bin",
+            .expected_vars = (char *[]) {
+                (char []) {"PATH=/bin:/opt/rh/scl2/root/usr/bin:/usr/bin"},
+                (char []) {"LOADEDMODULES=scl2:scl1"},
+                (char []) {"X_LIST=a b"},
+                NULL,
+            },
+            .supported = true,
+        },
+
+        /* Several values keep their order in both directions */
+        {
+            .modulefile =
+                "#%Module1.0\n"
+                "prepend-path PATH /opt/a/bin /opt/b/bin\n"
+                "append-path -d { } X_LIST a b\n"
+                "prepend-path -d { } X_LIST c d\n",
+
+            .env_path = "/usr/bin",
+            .expected_vars = (char *[]) {
+                (char []) {"PATH=/opt/a/bin:/opt/b/bin:/usr/bin"},
+                (char []) {"X_LIST=c d a b"},
+                NULL,
+            },
+            .supported = true,
+        },
+
+        /* Environment dependent values are left to modulecmd */
+        {
+            .modulefile =
+                "#%Module1.0\n"
+                "setenv FOO $env(HOME)\n",
+
+            .supported = false,
+        },
+
+        /* Command substitution is left to modulecmd */
+        {
+            .modulefile =
+                "#%Module1.0\n"
+                "setenv FOO [exec uname]\n",
+
+            .supported = false,
+        },
+
+        /* File without magic cookie is not a modulefile */
+        {
+            .modulefile = "setenv FOO bar\n",
+            .supported = false,
+        },
+    };
+
+    int tc_count = sizeof(testcases) / sizeof(testcases[0]);
+
+    assert_non_null(mkdtemp(dir));
+    write_module(dir, "scl2",
+        "#%Module1.0\n"
+        "prepend-path PATH /opt/rh/scl2/root/usr/bin\n");
+
+    for (int i = 0; i < tc_count; i++) {
+        write_module(dir, "scl1", testcases[i].modulefile);
+        unsetenv("LOADEDMODULES");
+        unsetenv("_LMFILES_");
+        unsetenv("X_LIST");
+        if (testcases[i].env_path) {
+            setenv("PATH", testcases[i].env_path, 1);
+        }
+
+        ret = modulefile_eval("scl1", dir, &delta, &supported);
+        assert_int_equal(ret, EOK);
+        assert_int_equal(supported, testcases[i].supported);
+        if (!supported) {
+            continue;
+        }
+
+        env_builder_init(&env, environ);
+        env_delta_apply(&delta, &env);
+        env_delta_free(&delta);
+
+        for (int i2 = 0; testcases[i].expected_vars[i2] != NULL; i2++) {
+            var = testcases[i].expected_vars[i2];
+            *strchr(var, '=') = '\0';
+            assert_non_null(env_builder_get(&env, var));
+            assert_string_equal(env_builder_get(&env, var),
+                var + strlen(var) + 1);
+            var[strlen(var)] = '=';
+        }
+
+        snprintf(path, sizeof(path), "%s/scl1", dir);
+        assert_true(strstr(env_builder_get(&env, "_LMFILES_"), path) != NULL);
+        env_builder_free(&env);
+    }
+
+    snprintf(path, sizeof(path), "%s/scl1", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/scl2", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void test_env_cache(void **state)
+{
+    (void) state; /* unused */
+    char dir[] = "/tmp/scl_test_XXXXXX";
+    char cache_dir[] = "/tmp/scl_cache_XXXXXX";
+    char path[256];
+    struct env_cache_key key;
+    struct env_delta delta = {NULL, 0, 0}, cached = {NULL, 0, 0};
+    bool supported;
+
+    assert_non_null(mkdtemp(dir));
+    assert_non_null(mkdtemp(cache_dir));
+    setenv("XDG_RUNTIME_DIR", cache_dir, 1);
+    write_module(dir, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO bar\n"
+        "unsetenv BAR\n");
+
+    /* Nothing is cached yet */
+    env_cache_key_init(&key, "scl1", dir);
+    assert_false(env_cache_load(&key, &cached));
+
+    assert_int_equal(modulefile_eval("scl1", dir, &delta, &supported), EOK);
+    assert_true(supported);
+    env_cache_store(&key, &delta);
+
+    assert_true(env_cache_load(&key, &cached));
+    assert_int_equal(cached.count, delta.count);
+    for (int i = 0; i < delta.count; i++) {
+        assert_int_equal(cached.ops[i].type, delta.ops[i].type);
+        assert_string_equal(cached.ops[i].name, delta.ops[i].name);
+        assert_true((cached.ops[i].value == NULL) ==
+            (delta.ops[i].value == NULL));
+    }
+    env_delta_free(&cached);
+    env_cache_key_free(&key);
+
+    /* Different modulepath means different key */
+    env_cache_key_init(&key, "scl1", "/nonexistent");
+    assert_false(env_cache_load(&key, &cached));
+    env_cache_key_free(&key);
+
+    /* Changed modulefile invalidates the cache */
+    write_module(dir, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO bar baz\n");
+    env_cache_key_init(&key, "scl1", dir);
+    assert_false(env_cache_load(&key, &cached));
+    env_cache_key_free(&key);
+
+    /* New modulefile in the directory invalidates the cache */
+    env_cache_key_init(&key, "scl1", dir);
+    env_cache_store(&key, &delta);
+    env_cache_key_free(&key);
+    write_module(dir, "scl2", "#%Module1.0\n");
+    env_cache_key_init(&key, "scl1", dir);
+    assert_false(env_cache_load(&key, &cached));
+    env_cache_key_free(&key);
+    env_delta_free(&delta);
+
+    unsetenv("XDG_RUNTIME_DIR");
+    snprintf(path, sizeof(path), "%s/scl1", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/scl2", dir);
+    unlink(path);
+    rmdir(dir);
+    snprintf(path, sizeof(path), "%s/scl/env-scl1-%016llx", cache_dir,
+        (unsigned long long) hash_bytes(dir, strlen(dir),
+        hash_bytes("scl1", 5, HASH_INIT)));
+    assert_int_equal(unlink(path), 0);
+    snprintf(path, sizeof(path), "%s/scl", cache_dir);
+    rmdir(path);
+    rmdir(cache_dir);
+}
+
+/*
+ * Create tree <root>/mods/scl1 with fixed modification times.
+ */
+static void create_root(char *root)
+{
+    struct timeval times[2] = {{1000000000, 0}, {1000000000, 0}};
+    char path[256];
+
+    assert_non_null(mkdtemp(root));
+    snprintf(path, sizeof(path), "%s/mods", root);
+    assert_int_equal(mkdir(path, 0755), 0);
+    write_module(path, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO bar\n");
+    assert_int_equal(utimes(path, times), 0);
+    snprintf(path, sizeof(path), "%s/mods/scl1", root);
+    assert_int_equal(utimes(path, times), 0);
+}
+
+static void remove_root(const char *root)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/mods/scl1", root);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/mods", root);
+    rmdir(path);
+    rmdir(root);
+}
+
+static void test_env_cache_shadowed(void **state)
+{
+    (void) state; /* unused */
+    char dir[] = "/tmp/scl_test_XXXXXX";
+    char cache_dir[] = "/tmp/scl_cache_XXXXXX";
+    char path[256], *data;
+    struct env_cache_key key;
+    struct env_delta delta = {NULL, 0, 0}, cached = {NULL, 0, 0};
+    bool supported;
+    size_t len;
+    FILE *fp;
+
+    assert_string_equal(scl_config_get()->cache_dir, system_cache_dir);
+    assert_non_null(mkdtemp(dir));
+    assert_non_null(mkdtemp(cache_dir));
+    assert_int_equal(mkdir(system_cache_dir, 0755), 0);
+    setenv("XDG_RUNTIME_DIR", cache_dir, 1);
+
+    /* Root caches the module */
+    write_module(dir, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO bar\n");
+    env_cache_key_init(&key, "scl1", dir);
+    assert_int_equal(modulefile_eval("scl1", dir, &delta, &supported), EOK);
+    assert_true(env_cache_store(&key, &delta));
+    env_delta_free(&delta);
+    env_cache_key_free(&key);
+
+    /* The modulefile changes and the user caches the new version */
+    write_module(dir, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO user\n");
+    env_cache_key_init(&key, "scl1", dir);
+    assert_int_equal(modulefile_eval("scl1", dir, &delta, &supported), EOK);
+    assert_true(supported);
+    env_cache_encode(&key, &delta, &data, &len);
+    env_delta_free(&delta);
+    snprintf(path, sizeof(path), "%s/scl", cache_dir);
+    assert_int_equal(mkdir(path, 0700), 0);
+    snprintf(path, sizeof(path), "%s/scl/%s", cache_dir, key.name);
+    fp = fopen(path, "w");
+    assert_non_null(fp);
+    assert_int_equal(fwrite(data, len, 1, fp), 1);
+    fclose(fp);
+    data = _free(data);
+
+    /* Stale file of root doesn't hide the valid file of the user */
+    assert_true(env_cache_load(&key, &cached));
+    assert_string_equal(cached.ops[1].name, "FOO");
+    assert_string_equal(cached.ops[1].value, "user");
+    env_delta_free(&cached);
+
+    unsetenv("XDG_RUNTIME_DIR");
+    assert_int_equal(unlink(path), 0);
+    snprintf(path, sizeof(path), "%s/%s", system_cache_dir, key.name);
+    assert_int_equal(unlink(path), 0);
+    env_cache_key_free(&key);
+    snprintf(path, sizeof(path), "%s/scl", cache_dir);
+    rmdir(path);
+    rmdir(cache_dir);
+    rmdir(system_cache_dir);
+    snprintf(path, sizeof(path), "%s/scl1", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void test_env_cache_root(void **state)
+{
+    (void) state; /* unused */
+    char image[] = "/tmp/scl_image_XXXXXX";
+    char copy[] = "/tmp/scl_copy_XXXXXX";
+    char path[256], *data;
+    struct env_cache_key key;
+    struct env_delta delta = {NULL, 0, 0}, cached = {NULL, 0, 0};
+    bool supported;
+    size_t len;
+
+    create_root(image);
+    create_root(copy);
+
+    /* Paths inside the tree are recorded */
+    scl_config_set_root(image);
+    env_cache_key_init(&key, "scl1", "/mods");
+    assert_int_equal(modulefile_eval("scl1", "/mods", &delta, &supported),
+        EOK);
+    assert_true(supported);
+    assert_string_equal(delta.ops[0].value, "/mods/scl1");
+    env_cache_encode(&key, &delta, &data, &len);
+    env_cache_key_free(&key);
+    env_delta_free(&delta);
+
+    /* The cache is valid for a copy of the tree with other inodes */
+    scl_config_set_root(copy);
+    env_cache_key_init(&key, "scl1", "/mods");
+    assert_true(env_cache_decode(&key, data, len, true, &cached));
+    cached.ops = _free(cached.ops);
+    env_cache_key_free(&key);
+
+    /* But not when the modulefile of the copy differs */
+    snprintf(path, sizeof(path), "%s/mods", copy);
+    write_module(path, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO bar baz\n");
+    env_cache_key_init(&key, "scl1", "/mods");
+    assert_false(env_cache_decode(&key, data, len, true, &cached));
+    env_cache_key_free(&key);
+
+    scl_config_set_root("/");
+    data = _free(data);
+    remove_root(image);
+    remove_root(copy);
+}
+
+/*
+ * Set byte off of operation op of the first entry of bundle file to value.
+ * Encoded operations of 12 bytes precede the pool of strings, which starts
+ * with the module name and modulepath.
+ */
+static void corrupt_bundle_op(const char *file, const char *modname,
+    const char *modulepath, int op_count, int op, size_t off,
+    unsigned char value)
+{
+    char data[4096], pattern[256];
+    size_t len, pattern_len;
+    char *pool;
+    FILE *fp;
+
+    fp = fopen(file, "r+");
+    assert_non_null(fp);
+    len = fread(data, 1, sizeof(data), fp);
+
+    pattern_len = snprintf(pattern, sizeof(pattern), "%s%c%s", modname, '\0',
+        modulepath) + 1;
+    pool = memmem(data, len, pattern, pattern_len);
+    assert_non_null(pool);
+
+    assert_int_equal(fseek(fp, pool - data - 12 * (op_count - op) + off,
+        SEEK_SET), 0);
+    assert_int_equal(fputc(value, fp), value);
+    fclose(fp);
+}
+
+static void test_cache_bundle(void **state)
+{
+    (void) state; /* unused */
+    char dir[] = "/tmp/scl_test_XXXXXX";
+    char file[] = "/tmp/scl_bundle_XXXXXX";
+    char path[256];
+    struct env_cache_key key;
+    struct env_delta delta = {NULL, 0, 0};
+    struct cache_bundle bundle = {NULL, 0, 0, NULL};
+    struct cache_bundle_entry entry;
+    struct stat st;
+    bool supported, found;
+    size_t pos = 0;
+    int fd;
+
+    assert_non_null(mkdtemp(dir));
+    fd = mkstemp(file);
+    assert_int_not_equal(fd, -1);
+    close(fd);
+    write_module(dir, "scl1",
+        "#%Module1.0\n"
+        "setenv FOO bar\n"
+        "unsetenv BAR\n");
+
+    /* Bundle without entries */
+    assert_true(cache_bundle_write(&bundle, file));
+    assert_int_equal(cache_bundle_open(&bundle, file), EOK);
+    assert_int_equal(cache_bundle_next(&bundle, &pos, &entry, &found), EOK);
+    assert_false(found);
+    cache_bundle_free(&bundle);
+
+    env_cache_key_init(&key, "scl1", dir);
+    assert_int_equal(modulefile_eval("scl1", dir, &delta, &supported), EOK);
+    assert_int_equal(cache_bundle_add(&bundle, 42, &key, &delta), EOK);
+    assert_true(cache_bundle_write(&bundle, file));
+    cache_bundle_free(&bundle);
+    env_cache_key_free(&key);
+
+    /* Entries come back with their keys and hashes */
+    assert_int_equal(cache_bundle_open(&bundle, file), EOK);
+    pos = 0;
+    assert_int_equal(cache_bundle_next(&bundle, &pos, &entry, &found), EOK);
+    assert_true(found);
+    assert_int_equal(entry.hash, 42);
+    assert_string_equal(entry.key.modname, "scl1");
+    assert_string_equal(entry.key.modulepath, dir);
+    assert_int_equal(entry.delta.count, delta.count);
+    for (int i = 0; i < delta.count; i++) {
+        assert_int_equal(entry.delta.ops[i].type, delta.ops[i].type);
+        assert_string_equal(entry.delta.ops[i].name, delta.ops[i].name);
+    }
+    cache_bundle_entry_free(&entry);
+    assert_int_equal(cache_bundle_next(&bundle, &pos, &entry, &found), EOK);
+    assert_false(found);
+    cache_bundle_free(&bundle);
+
+    /*
+     * Entries with unknown operations or without values env_delta_apply()
+     * needs are skipped, the following ones are still imported.
+     */
+    for (int i = 0; i < 2; i++) {
+        env_cache_key_init(&key, "scl1", dir);
+        assert_int_equal(cache_bundle_add(&bundle, 1, &key, &delta), EOK);
+        assert_int_equal(cache_bundle_add(&bundle, 2, &key, &delta), EOK);
+        assert_true(cache_bundle_write(&bundle, file));
+        cache_bundle_free(&bundle);
+        env_cache_key_free(&key);
+
+        if (i == 0) {
+            /* Type of the setenv operation */
+            corrupt_bundle_op(file, "scl1", dir, delta.count, 1, 0, 0x7f);
+        } else {
+            /* Value of the module begin operation */
+            for (size_t off = 8; off < 12; off++) {
+                corrupt_bundle_op(file, "scl1", dir, delta.count, 0, off,
+                    0xff);
+            }
+        }
+
+        assert_int_equal(cache_bundle_open(&bundle, file), EOK);
+        pos = 0;
+        assert_int_equal(cache_bundle_next(&bundle, &pos, &entry, &found),
+            EOK);
+        assert_true(found);
+        assert_int_equal(entry.hash, 2);
+        cache_bundle_entry_free(&entry);
+        assert_int_equal(cache_bundle_next(&bundle, &pos, &entry, &found),
+            EOK);
+        assert_false(found);
+        cache_bundle_free(&bundle);
+    }
+    env_delta_free(&delta);
+
+    /* Truncated bundle is refused as a whole */
+    assert_int_equal(stat(file, &st), 0);
+    assert_int_equal(truncate(file, st.st_size - 8), 0);
+    assert_int_equal(cache_bundle_open(&bundle, file), EINPUT);
+
+    unlink(file);
+    assert_int_equal(cache_bundle_open(&bundle, file), EDISK);
+    snprintf(path, sizeof(path), "%s/scl1", dir);
+    unlink(path);
+    rmdir(dir);
+}
+
+static void test_env_compact_paths(void **state)
+{
+    (void) state; /* unused */
+    char dir[] = "/tmp/scl_test_XXXXXX";
+    char path[256];
+    const char *const names[] = {"PATH", "MANPATH", "UNSET_PATH", NULL};
+    struct env_compact_stats stats;
+    struct env_builder env;
+
+    assert_non_null(mkdtemp(dir));
+    env_builder_init(&env, NULL);
+
+    snprintf(path, sizeof(path), "%s/missing:%s:/usr/bin:%s:bin:bin", dir, dir,
+        dir);
+    env_builder_set(&env, "PATH", path);
+    env_builder_set(&env, "MANPATH", ":/usr/share/man::/usr/share/man");
+    env_builder_compact_paths(&env, names, &stats);
+
+    /* Relative items are kept, the first directory wins */
+    snprintf(path, sizeof(path), "%s:/usr/bin:bin:bin", dir);
+    assert_string_equal(env_builder_get(&env, "PATH"), path);
+    /* Empty items have special meaning for man(1) */
+    assert_string_equal(env_builder_get(&env, "MANPATH"), ":/usr/share/man:");
+    assert_null(env_builder_get(&env, "UNSET_PATH"));
+
+    assert_int_equal(stats.vars, 2);
+    assert_int_equal(stats.duplicates, 2);
+    assert_int_equal(stats.missing, 1);
+
+    /* Nothing to do second time */
+    env_builder_compact_paths(&env, names, &stats);
+    assert_int_equal(stats.vars, 0);
+
+    /* Variables sharing a directory, the first one is changed */
+    snprintf(path, sizeof(path), "%s:%s:%s/missing:/", dir, dir, dir);
+    env_builder_set(&env, "PATH", path);
+    snprintf(path, sizeof(path), "/usr/share/man:%s:%s/missing", dir, dir);
+    env_builder_set(&env, "MANPATH", path);
+    env_builder_compact_paths(&env, names, &stats);
+
+    snprintf(path, sizeof(path), "%s:/", dir);
+    assert_string_equal(env_builder_get(&env, "PATH"), path);
+    snprintf(path, sizeof(path), "/usr/share/man:%s", dir);
+    assert_string_equal(env_builder_get(&env, "MANPATH"), path);
+    assert_int_equal(stats.vars, 2);
+    assert_int_equal(stats.duplicates, 1);
+    assert_int_equal(stats.missing, 2);
+
+    env_builder_free(&env);
+    rmdir(dir);
+}
+
+static void test_tokenizer(void **state)
+{
+    (void) state; /* unused */
+    struct {
+        const char *str;
+        char delim;
+        const char *tokens[5];
+    } testcases[] = {
+        {"", ':', {NULL}},
+        {":::", ':', {NULL}},
+        {"scl1", ' ', {"scl1", NULL}},
+        {" scl1  scl2 ", ' ', {"scl1", "scl2", NULL}},
+        {"A=a b ;export A;\nB=b", ';', {"A=a b ", "export A", "\nB=b", NULL}},
+    };
+    struct tokenizer tok;
+    struct strview token;
+    char buf[64];
+    int count;
+
+    for (size_t i = 0; i < sizeof(testcases) / sizeof(*testcases); i++) {
+        tokenizer_init(&tok, testcases[i].str, strlen(testcases[i].str),
+            testcases[i].delim);
+        count = 0;
+        while (tokenizer_next(&tok, &token)) {
+            assert_non_null(testcases[i].tokens[count]);
+            assert_true(strview_equal(token, testcases[i].tokens[count]));
+            count++;
+        }
+        assert_null(testcases[i].tokens[count]);
+        assert_int_equal(count, count_words(testcases[i].str,
+            testcases[i].delim));
+    }
+
+    /* View doesn't have to end by NUL */
+    tokenizer_init(&tok, "scl1 scl2", 3, ' ');
+    assert_true(tokenizer_next(&tok, &token));
+    assert_true(strview_equal(token, "scl"));
+    assert_false(strview_equal(token, "scl1"));
+    assert_false(tokenizer_next(&tok, &token));
+
+    assert_int_equal(unescape_to(buf, "a\\ b\\\\c\\", 8), 5);
+    assert_string_equal(buf, "a b\\c");
+}
+
+static void test_env_parser(void **state)
+{
+    (void) state; /* unused */
+    struct {
+        const char *output;
+        const char *vars[4];
+    } testcases[] = {
+        {"A=a ;export A ; B=b ;export B;", {"A=a", "B=b", NULL}},
+        /* Tcl based modulecmd separates statements by newlines */
+        {"A=a;\nexport A;\nB=b\nexport B\n", {"A=a", "B=b", NULL}},
+        {"A=a\\ b\\;c\\\\ ;export A", {"A=a b;c\\", NULL}},
+        {"A=a\\\n;B=b\\ ", {"A=a\n", "B=b ", NULL}},
+        {"export A;unset B;\n\n", {NULL}},
+        {"A=a\\", {"A=a", NULL}},
+    };
+    struct env_parser parser;
+    struct env_builder env;
+    size_t len;
+    int count;
+
+    for (size_t i = 0; i < sizeof(testcases) / sizeof(*testcases); i++) {
+        len = strlen(testcases[i].output);
+
+        /* Split the output at every position */
+        for (size_t split = 0; split <= len; split++) {
+            env_builder_init(&env, NULL);
+            env_parser_init(&parser);
+            env_parser_feed(&parser, testcases[i].output, split);
+            env_parser_feed(&parser, testcases[i].output + split, len - split);
+            env_parser_apply(&parser, &env);
+            env_parser_free(&parser);
+
+            for (count = 0; testcases[i].vars[count] != NULL; count++) {
+                assert_string_equal(env_builder_envp(&env)[count],
+                    testcases[i].vars[count]);
+            }
+            assert_null(env_builder_envp(&env)[count]);
+            env_builder_free(&env);
+        }
+    }
+}
+
+static void test_exec_cache(void **state)
+{
+    (void) state; /* unused */
+    char dir1[] = "/tmp/scl_test_XXXXXX";
+    char dir2[] = "/tmp/scl_test_XXXXXX";
+    char cache_dir[] = "/tmp/scl_cache_XXXXXX";
+    char path[256], prog1[256], prog2[256];
+    char *file;
+
+    assert_non_null(mkdtemp(dir1));
+    assert_non_null(mkdtemp(dir2));
+    assert_non_null(mkdtemp(cache_dir));
+    setenv("XDG_RUNTIME_DIR", cache_dir, 1);
+    snprintf(path, sizeof(path), "%s:%s", dir1, dir2);
+    snprintf(prog1, sizeof(prog1), "%s/prog", dir1);
+    snprintf(prog2, sizeof(prog2), "%s/prog", dir2);
+
+    write_module(dir2, "prog", "#!/bin/sh\n");
+    assert_null(exec_cache_resolve(path, "prog"));
+    chmod(prog2, 0755);
+
+    /* The first call fills the cache, the second one uses it */
+    for (int i = 0; i < 2; i++) {
+        file = exec_cache_resolve(path, "prog");
+        assert_non_null(file);
+        assert_string_equal(file, prog2);
+        free(file);
+    }
+
+    /* Executable in an earlier directory wins */
+    write_module(dir1, "prog", "#!/bin/sh\n");
+    chmod(prog1, 0755);
+    file = exec_cache_resolve(path, "prog");
+    assert_string_equal(file, prog1);
+    free(file);
+
+    unlink(prog1);
+    file = exec_cache_resolve(path, "prog");
+    assert_string_equal(file, prog2);
+    free(file);
+
+    /* Relative directories are not cached */
+    assert_null(exec_cache_resolve("bin:/usr/bin", "prog"));
+
+    unsetenv("XDG_RUNTIME_DIR");
+    unlink(prog2);
+    rmdir(dir1);
+    rmdir(dir2);
+    snprintf(prog1, sizeof(prog1), "%s/scl/exec-%016llx", cache_dir,
+        (unsigned long long) hash_bytes(path, strlen(path), HASH_INIT));
+    assert_int_equal(unlink(prog1), 0);
+    snprintf(path, sizeof(path), "%s/scl", cache_dir);
+    rmdir(path);
+    rmdir(cache_dir);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_modulefile_eval),
+        cmocka_unit_test(test_env_cache),
+        cmocka_unit_test(test_env_cache_shadowed),
+        cmocka_unit_test(test_env_cache_root),
+        cmocka_unit_test(test_cache_bundle),
+        cmocka_unit_test(test_env_compact_paths),
+        cmocka_unit_test(test_env_parser),
+        cmocka_unit_test(test_exec_cache),
+        cmocka_unit_test(test_tokenizer),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
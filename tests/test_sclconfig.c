@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <cmocka.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "../src/sclconfig.h"
+#include "../src/sclmalloc.h"
+
+extern char *__real_getenv();
+
+char *__wrap_getenv(const char *name)
+{
+    return __real_getenv(name);
+}
+
+static char config_file[] = "/tmp/test_sclconfig_XXXXXX";
+
+/*
+ * Configuration is resolved once per process, so all tests share the one
+ * written here.
+ */
+static int setup(void **state)
+{
+    FILE *fp;
+    int fd;
+
+    fd = mkstemp(config_file);
+    if (fd == -1 || (fp = fdopen(fd, "w")) == NULL) {
+        return -1;
+    }
+    fputs("# Tenant collections\n"
+        "conf_dir = /srv/tenant/conf//\n"
+        "  modules_path=/srv/tenant/modulefiles\n"
+        "cache_dir = relative/cache\n"
+        "module_cmd\t=\t/opt/modules/bin/modulecmd  \n"
+        "unknown = /whatever\n"
+        "no value here\n", fp);
+    fclose(fp);
+
+    setenv("SCL_CONFIG", config_file, 1);
+    setenv("SCL_MODULES_PATH", "/srv/other/modulefiles/", 1);
+    setenv("SCL_STATS", "stats.log", 1);
+    unsetenv("SCL_CONF_DIR");
+    unsetenv("SCL_MODULE_CMD");
+    unsetenv("SCL_CACHE_DIR");
+    unsetenv("SCLD_SOCKET");
+
+    return 0;
+}
+
+static int teardown(void **state)
+{
+    unlink(config_file);
+    return 0;
+}
+
+static void test_config_get(void **state)
+{
+    (void) state; /* unused */
+    const struct scl_config *config = scl_config_get();
+
+    /* Environment beats the file, which beats built-in defaults */
+    assert_string_equal(config->conf_dir, "/srv/tenant/conf");
+    assert_string_equal(config->modules_path, "/srv/other/modulefiles");
+    assert_string_equal(config->module_cmd, "/opt/modules/bin/modulecmd");
+    assert_string_equal(config->stats_file, "stats.log");
+
+    /* Relative directories are ignored */
+    assert_string_equal(config->cache_dir, SCL_CACHE_DIR);
+
+    /* The default daemon doesn't know these directories */
+    assert_null(config->scld_socket);
+
+    /* Variables changed later don't matter */
+    setenv("SCL_CONF_DIR", "/elsewhere", 1);
+    assert_ptr_equal(scl_config_get(), config);
+    assert_string_equal(config->conf_dir, "/srv/tenant/conf");
+    unsetenv("SCL_CONF_DIR");
+}
+
+static void test_config_paths(void **state)
+{
+    (void) state; /* unused */
+    struct arena arena = ARENA_INIT;
+
+    assert_string_equal(conf_file_path(&arena, "scl1"),
+        "/srv/tenant/conf/scl1");
+    assert_string_equal(modulefile_path(&arena, "scl1"),
+        "/srv/other/modulefiles/scl1");
+    arena_release(&arena);
+}
+
+static void test_config_root(void **state)
+{
+    (void) state; /* unused */
+    char root[] = "/tmp/test_sclconfig_root_XXXXXX";
+    char path[PATH_MAX], expected[PATH_MAX];
+    const struct scl_config *config;
+    struct arena arena = ARENA_INIT;
+    FILE *fp;
+
+    /* Configuration file named by SCL_CONFIG is the host's own */
+    assert_non_null(mkdtemp(root));
+    scl_config_set_root(root);
+    config = scl_config_get();
+    snprintf(expected, sizeof(expected), "%s/srv/tenant/conf", root);
+    assert_string_equal(config->conf_dir, expected);
+    snprintf(expected, sizeof(expected), "%s/srv/other/modulefiles", root);
+    assert_string_equal(config->modules_path, expected);
+    assert_string_equal(config->module_cmd, "/opt/modules/bin/modulecmd");
+    snprintf(expected, sizeof(expected), "%s/opt/rh/scl1/root", root);
+    assert_string_equal(root_path(&arena, "/opt/rh/scl1/root"), expected);
+
+    /* The file of the tree can't choose the modulecmd the host runs */
+    snprintf(path, sizeof(path), "%s%s", root, SCL_CONFIG_FILE);
+    for (char *p = strchr(path + strlen(root) + 1, '/'); p != NULL;
+        p = strchr(p + 1, '/')) {
+
+        *p = '\0';
+        assert_int_equal(mkdir(path, 0755), 0);
+        *p = '/';
+    }
+    fp = fopen(path, "w");
+    assert_non_null(fp);
+    fputs("conf_dir = /etc/tenant\n"
+        "module_cmd = /image/bin/modulecmd\n", fp);
+    fclose(fp);
+
+    unsetenv("SCL_CONFIG");
+    scl_config_set_root(root);
+    snprintf(expected, sizeof(expected), "%s/etc/tenant", root);
+    assert_string_equal(config->conf_dir, expected);
+    assert_string_equal(config->module_cmd, MODULE_CMD);
+    assert_null(config->scld_socket);
+
+    setenv("SCL_CONFIG", config_file, 1);
+    scl_config_set_root("/");
+    assert_string_equal(config->conf_dir, "/srv/tenant/conf");
+    assert_string_equal(config->module_cmd, "/opt/modules/bin/modulecmd");
+
+    unlink(path);
+    for (char *p = strrchr(path, '/'); p > path + strlen(root);
+        p = strrchr(path, '/')) {
+
+        *p = '\0';
+        rmdir(path);
+    }
+    rmdir(root);
+    arena_release(&arena);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_config_get),
+        cmocka_unit_test(test_config_paths),
+        cmocka_unit_test(test_config_root),
+    };
+
+    return cmocka_run_group_tests(tests, setup, teardown);
+}
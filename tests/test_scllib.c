@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <setjmp.h>
 #include <cmocka.h>
 #include <string.h>
@@ -7,11 +8,21 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
 
 #include "test_common.h"
 #include "dict.h"
 #include "../src/scllib.h"
+#include "../src/libscl.h"
+#include "../src/sclmalloc.h"
+#include "../src/fallback.h"
+#include "../src/lib_common.h"
 #include "../src/errors.h"
+#include "../src/sclconfig.h"
+
+/* Nothing is installed there, so collections come from mocked modulecmd */
+#define TEST_MODULES_PATH "/nonexistent/scl_test/modulefiles"
 
 extern int __real_putenv();
 extern char *__real_getenv();
@@ -32,11 +43,70 @@ char *__wrap_getenv(const char *name)
     return __real_getenv(name);
 }
 
-char *__wrap_get_command_output(const char *path, char *const argv[], int fileno)
+extern void *__real_malloc(size_t size);
+extern void *__real_calloc(size_t nmemb, size_t size);
+extern void *__real_realloc(void *ptr, size_t size);
+extern char *__real_strndup(const char *str, size_t len);
+extern int __real_vasprintf(char **strp, const char *fmt, va_list args);
+
+/* Number of the allocation which fails, counted from 0, -1 for none */
+static int failing_alloc = -1;
+
+static bool alloc_fails()
+{
+    return failing_alloc >= 0 && failing_alloc-- == 0;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    return alloc_fails() ? NULL : __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    return alloc_fails() ? NULL : __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    return alloc_fails() ? NULL : __real_realloc(ptr, size);
+}
+
+char *__wrap_strndup(const char *str, size_t len)
+{
+    return alloc_fails() ? NULL : __real_strndup(str, len);
+}
+
+int __wrap_vasprintf(char **strp, const char *fmt, va_list args)
+{
+    return alloc_fails() ? -1 : __real_vasprintf(strp, fmt, args);
+}
+
+char *__wrap_get_command_output(const char *path, char *const argv[],
+    char *const envp[], int fileno)
 {
     return mock_ptr_type(char *);
 }
 
+bool __wrap_stream_command_output(const char *path, char *const argv[],
+    char *const envp[], int fileno, output_consumer consume, void *arg)
+{
+    const char *output = mock_ptr_type(const char *);
+
+    if (output == NULL) {
+        return false;
+    }
+
+    /* Output comes byte by byte, so values are split between reads */
+    for (size_t i = 0; output[i] != '\0'; i++) {
+        if (!consume(output + i, 1, arg)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 typedef struct {
     char *cmd_output; /* value that will be set as return value of get_command_output() */
     char **expected_colnames; /* expected output value from get_installed_collections() */
@@ -59,7 +129,7 @@ static void test_get_installed_collections(void **state)
                 "modulename1\n"
                 "modulename2\n"
                 "modulename3\n"
-                "/etc/scl/modulefiles:\n"
+                TEST_MODULES_PATH ":\n"
                 "scl1\n"
                 "scl2\n"
                 "scl3\n"
@@ -83,7 +153,7 @@ static void test_get_installed_collections(void **state)
                 "modulename1\n"
                 "modulename2\n"
                 "modulename3\n"
-                "/etc/scl/modulefiles:\n"
+                TEST_MODULES_PATH ":\n"
                 "sclA\n"
                 "sclB\n"
                 "sclC\n"
@@ -104,7 +174,7 @@ static void test_get_installed_collections(void **state)
         /* Collections are in the beginning of output */
         {
             .cmd_output =
-                "/etc/scl/modulefiles:\n"
+                TEST_MODULES_PATH ":\n"
                 "sclX\n"
                 "sclY\n"
                 "/etc/modulefiles:\n"
@@ -127,7 +197,7 @@ static void test_get_installed_collections(void **state)
                 "modulename1\n"
                 "modulename2\n"
                 "modulename3\n"
-                "/etc/scl/modulefiles:\n",
+                TEST_MODULES_PATH ":\n",
 
             .expected_colnames = (char *[]){
                 NULL,
@@ -153,7 +223,7 @@ static void test_get_installed_collections(void **state)
         release_scllib_cache();
 
         if (testcases[i].cmd_output != NULL) {
-            output_allocated = malloc(strlen(testcases[i].cmd_output) + 1);
+            output_allocated = xmalloc(strlen(testcases[i].cmd_output) + 1);
             strcpy(output_allocated, testcases[i].cmd_output);
         } else {
             output_allocated = NULL;
@@ -171,6 +241,67 @@ static void test_get_installed_collections(void **state)
     }
 }
 
+static void write_file(const char *root, const char *name,
+    const char *content)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s" TEST_MODULES_PATH "/%s", root, name);
+    fp = fopen(path, "w");
+    assert_non_null(fp);
+    fputs(content, fp);
+    fclose(fp);
+}
+
+static void test_scan_modulefiles(void **state)
+{
+    (void) state; /* unused */
+    char root[] = "/tmp/scl_test_XXXXXX";
+    const char *dirs[] = {"/nonexistent", "/nonexistent/scl_test",
+        TEST_MODULES_PATH, TEST_MODULES_PATH "/ver",
+        TEST_MODULES_PATH "/ver/nested", NULL};
+    const char *files[] = {"scl1", ".hidden", "readme", "ver/1.0",
+        "ver/.2.0", "ver/nested/x", NULL};
+    char *const *colnames;
+    char path[PATH_MAX];
+
+    assert_non_null(mkdtemp(root));
+    for (int i = 0; dirs[i] != NULL; i++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        assert_int_equal(mkdir(path, 0755), 0);
+    }
+    write_file(root, "scl1", "#%Module1.0\n");
+    write_file(root, ".hidden", "#%Module1.0\n");
+    write_file(root, "readme", "Not a modulefile\n");
+    write_file(root, "ver/1.0", "#%Module\n");
+    write_file(root, "ver/.2.0", "#%Module\n");
+    write_file(root, "ver/nested/x", "#%Module\n");
+
+    /*
+     * Modulefiles are found without modulecmd. Hidden files, other files
+     * and directories deeper than one level are skipped.
+     */
+    scl_config_set_root(root);
+    release_scllib_cache();
+    assert_int_equal(get_installed_collections(&colnames), EOK);
+    assert_true(compare_string_arrays(colnames,
+        (char *[]) {"scl1", "ver/1.0", NULL}));
+    release_scllib_cache();
+    scl_config_set_root("/");
+
+    for (int i = 0; files[i] != NULL; i++) {
+        snprintf(path, sizeof(path), "%s" TEST_MODULES_PATH "/%s", root,
+            files[i]);
+        unlink(path);
+    }
+    for (int i = 4; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        rmdir(path);
+    }
+    rmdir(root);
+}
+
 int  __wrap_system(const char *command)
 {
     char *env_path;
@@ -203,7 +334,7 @@ static void test_run_command(void **state)
                 "modulename1\n"
                 "modulename2\n"
                 "modulename3\n"
-                "/etc/scl/modulefiles:\n"
+                TEST_MODULES_PATH ":\n"
                 "scl1\n"
                 "scl2\n"
                 "scl3\n"
@@ -218,7 +349,7 @@ static void test_run_command(void **state)
         /* Newlines in module(1) output are stripped */
         {
             .col_list =
-                "/etc/scl/modulefiles:\n"
+                TEST_MODULES_PATH ":\n"
                 "scl1\n",
 
             .env_vars =
@@ -230,6 +361,35 @@ static void test_run_command(void **state)
             .ret = EOK,
         },
 
+        /* All collections are enabled by a single module(1) run */
+        {
+            .col_list =
+                TEST_MODULES_PATH ":\n"
+                "scl1\n"
+                "scl2\n",
+
+            .env_vars =
+                "PATH=/opt/rh/scl2/root/usr/bin:/opt/rh/scl1/root/usr/bin; export PATH;\n",
+
+            .expected_env_path = "/opt/rh/scl2/root/usr/bin",
+            .collections = (char *[]) {"scl1", "scl2", NULL},
+            .ret = EOK,
+        },
+
+        /* Escaped separators and spaces are part of values */
+        {
+            .col_list =
+                TEST_MODULES_PATH ":\n"
+                "scl1\n",
+
+            .env_vars =
+                "PATH=/opt/rh/scl\\ 1/root/usr/bin\\;/usr/bin\\  ;export PATH",
+
+            .expected_env_path = "/opt/rh/scl 1/root/usr/bin;/usr/bin ",
+            .collections = (char *[]) {"scl1", NULL},
+            .ret = EOK,
+        },
+
         /* Try to enable non-existing collection */
         {
             .col_list =
@@ -237,7 +397,7 @@ static void test_run_command(void **state)
                 "modulename1\n"
                 "modulename2\n"
                 "modulename3\n"
-                "/etc/scl/modulefiles:\n"
+                TEST_MODULES_PATH ":\n"
                 "scl1\n"
                 "scl2\n"
                 "scl3\n"
@@ -257,10 +417,10 @@ static void test_run_command(void **state)
         release_scllib_cache();
 
         if (testcases[i].col_list)
-            will_return(__wrap_get_command_output, strdup(testcases[i].col_list));
+            will_return(__wrap_get_command_output, xstrdup(testcases[i].col_list));
 
         if (testcases[i].env_vars)
-            will_return(__wrap_get_command_output, strdup(testcases[i].env_vars));
+            will_return(__wrap_stream_command_output, testcases[i].env_vars);
 
         if (testcases[i].expected_env_path)
             will_return(__wrap_system, testcases[i].expected_env_path);
@@ -269,16 +429,345 @@ static void test_run_command(void **state)
         ret = run_command(testcases[i].collections, "test_cmd", false);
         assert_int_equal(ret, testcases[i].ret);
         dict_free(env);
+        env = NULL;
     }
 
 }
 
+static void test_ctx(void **state)
+{
+    (void) state; /* unused */
+    scl_ctx *ctx;
+    char **colnames, **envp;
+    char *base[] = {"PATH=/usr/bin", "MODULEPATH=/usr/share/modulefiles", NULL};
+    bool exists;
+
+    env = dict_init();
+    assert_int_equal(scl_ctx_new(&ctx), EOK);
+
+    will_return(__wrap_get_command_output, xstrdup(
+        "/usr/share/Modules/modulefiles:\n"
+        "modulename1\n"
+        TEST_MODULES_PATH ":\n"
+        "scl1\n"
+        "scl2\n"));
+    assert_int_equal(scl_ctx_list_collections(ctx, &colnames), EOK);
+    assert_true(compare_string_arrays(colnames,
+        (char *[]) {"scl1", "scl2", NULL}));
+    scl_free_strv(colnames);
+
+    /* The list is kept in the context */
+    assert_int_equal(scl_ctx_collection_exists(ctx, "scl2", &exists), EOK);
+    assert_true(exists);
+    assert_int_equal(scl_ctx_collection_exists(ctx, "scl3", &exists), EOK);
+    assert_false(exists);
+
+    /* The environment is computed from base, not from environ */
+    will_return(__wrap_stream_command_output,
+        "PATH=/opt/rh/scl1/root/usr/bin:/usr/bin ;export PATH");
+    assert_int_equal(scl_ctx_get_env(ctx, (char *[]) {"scl1", NULL}, base,
+        &envp), EOK);
+    assert_true(compare_string_arrays(envp, (char *[]) {
+        "PATH=/opt/rh/scl1/root/usr/bin:/usr/bin",
+        "MODULEPATH=" TEST_MODULES_PATH ":/usr/share/modulefiles",
+        NULL}));
+    scl_free_strv(envp);
+    assert_string_equal(base[1], "MODULEPATH=/usr/share/modulefiles");
+
+    assert_int_equal(scl_ctx_collection_exists(ctx, "scl5", &exists), EOK);
+    assert_false(exists);
+    scl_ctx_free(ctx);
+    dict_free(env);
+    env = NULL;
+}
+
+static void test_alloc_failure(void **state)
+{
+    (void) state; /* unused */
+    char root[] = "/tmp/scl_test_XXXXXX";
+    const char *dirs[] = {"/nonexistent", "/nonexistent/scl_test",
+        TEST_MODULES_PATH, NULL};
+    char *base[] = {"PATH=/usr/bin", "SCL_COMPACT_PATHS=1", NULL};
+    char *expected_env[] = {"PATH=/usr/bin", "SCL_COMPACT_PATHS=1",
+        "MODULEPATH=" TEST_MODULES_PATH, "LOADEDMODULES=scl1:scl2",
+        "_LMFILES_=" TEST_MODULES_PATH "/scl1:" TEST_MODULES_PATH "/scl2",
+        "SCL2=yes", NULL};
+    char path[PATH_MAX], **envp, **colnames;
+    scl_ctx *ctx;
+    bool prev, failed;
+    int n;
+    scl_rc ret;
+
+    /* Failures are allowed per thread */
+    prev = xmalloc_allow_failure(true);
+    assert_null(xmalloc(SIZE_MAX));
+    xmalloc_allow_failure(prev);
+
+    assert_non_null(mkdtemp(root));
+    for (int i = 0; dirs[i] != NULL; i++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        assert_int_equal(mkdir(path, 0755), 0);
+    }
+    write_file(root, "scl1", "#%Module1.0\n"
+        "prepend-path PATH /opt/rh/scl1/root/usr/bin\n");
+    write_file(root, "scl2", "#%Module1.0\n"
+        "set root /opt/rh/scl2/root\n"
+        "module load scl1\n"
+        "prepend-path PATH $root/usr/bin\n"
+        "setenv SCL2 yes\n");
+    scl_config_set_root(root);
+
+    /*
+     * Fail allocations of the calls one by one until the calls don't
+     * allocate that many times. Failures of caches are not errors, all
+     * other ones are reported as EMEM.
+     */
+    n = 0;
+    do {
+        assert_int_equal(scl_ctx_new(&ctx), EOK);
+        failing_alloc = n++;
+        ret = scl_ctx_get_env(ctx, (char *[]) {"scl2", NULL}, base, &envp);
+        failed = failing_alloc == -1;
+        failing_alloc = -1;
+        scl_ctx_free(ctx);
+
+        if (ret == EOK) {
+            assert_true(compare_string_arrays(envp, expected_env));
+            scl_free_strv(envp);
+        } else {
+            assert_true(failed);
+            assert_int_equal(ret, EMEM);
+        }
+    } while (failed);
+    assert_int_equal(ret, EOK);
+
+    n = 0;
+    do {
+        assert_int_equal(scl_ctx_new(&ctx), EOK);
+        failing_alloc = n++;
+        ret = scl_ctx_list_collections(ctx, &colnames);
+        failed = failing_alloc == -1;
+        failing_alloc = -1;
+        scl_ctx_free(ctx);
+
+        if (ret == EOK) {
+            assert_true(compare_string_arrays(colnames,
+                (char *[]) {"scl1", "scl2", NULL}));
+            scl_free_strv(colnames);
+        } else {
+            assert_true(failed);
+            assert_int_equal(ret, EMEM);
+        }
+    } while (failed);
+    assert_int_equal(ret, EOK);
+    scl_config_set_root("/");
+
+    for (int i = 1; i <= 2; i++) {
+        snprintf(path, sizeof(path), "%s" TEST_MODULES_PATH "/scl%d", root, i);
+        unlink(path);
+    }
+    for (int i = 2; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        rmdir(path);
+    }
+    rmdir(root);
+}
+
+/*
+ * Print environment of colname in format to a file, the content of the
+ * file is returned in output.
+ */
+static scl_rc capture_env(const char *colname, int format, char *output,
+    size_t size)
+{
+    char path[] = "/tmp/scl_test_env_XXXXXX";
+    int fd, saved;
+    ssize_t len;
+    scl_rc ret;
+
+    fd = mkstemp(path);
+    assert_true(fd != -1);
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    ret = print_env((char *[]) {(char *) colname, NULL}, format);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    len = pread(fd, output, size - 1, 0);
+    assert_true(len >= 0);
+    output[len] = '\0';
+    close(fd);
+    unlink(path);
+
+    return ret;
+}
+
+static void test_print_env(void **state)
+{
+    (void) state; /* unused */
+    char root[] = "/tmp/scl_test_XXXXXX";
+    const char *dirs[] = {"/nonexistent", "/nonexistent/scl_test",
+        TEST_MODULES_PATH, NULL};
+    char path[PATH_MAX], output[4096];
+
+    assert_non_null(mkdtemp(root));
+    for (int i = 0; dirs[i] != NULL; i++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        assert_int_equal(mkdir(path, 0755), 0);
+    }
+    write_file(root, "scl1", "#%Module1.0\n"
+        "setenv SCL1_NAME caf\xc3\xa9\n"
+        "setenv SCL1_BYTES caf\xe9\n");
+    write_file(root, "scl2", "#%Module1.0\n"
+        "setenv SCL2 yes\n"
+        "unsetenv SCL2_GONE\n");
+    setenv("SCL2_GONE", "1", 1);
+    scl_config_set_root(root);
+
+    /*
+     * UTF-8 is kept as it is. Other bytes can't be told apart from code
+     * points in JSON, such value is left out and reported.
+     */
+    assert_int_equal(capture_env("scl1", ENV_FORMAT_JSON, output,
+        sizeof(output)), EINPUT);
+    assert_non_null(strstr(output, "\"SCL1_NAME\": \"caf\xc3\xa9\""));
+    assert_null(strstr(output, "SCL1_BYTES"));
+    assert_string_equal(output + strlen(output) - 3, "\n}\n");
+
+    /* Bytes are taken literally from an environment file */
+    assert_int_equal(capture_env("scl1", ENV_FORMAT_ENV, output,
+        sizeof(output)), EOK);
+    assert_non_null(strstr(output, "\nSCL1_BYTES=caf\xe9\n"));
+
+    /* Removed variable can't be expressed in an environment file */
+    assert_int_equal(capture_env("scl2", ENV_FORMAT_SH, output,
+        sizeof(output)), EOK);
+    assert_non_null(strstr(output, "export SCL2='yes'\n"));
+    assert_non_null(strstr(output, "unset SCL2_GONE\n"));
+    assert_int_equal(capture_env("scl2", ENV_FORMAT_ENV, output,
+        sizeof(output)), EINPUT);
+    assert_non_null(strstr(output, "SCL2=yes\n"));
+    assert_null(strstr(output, "SCL2_GONE"));
+
+    unsetenv("SCL2_GONE");
+    scl_config_set_root("/");
+    for (int i = 1; i <= 2; i++) {
+        snprintf(path, sizeof(path), "%s" TEST_MODULES_PATH "/scl%d", root, i);
+        unlink(path);
+    }
+    for (int i = 2; i >= 0; i--) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        rmdir(path);
+    }
+    rmdir(root);
+}
+
+static void test_arena(void **state)
+{
+    (void) state; /* unused */
+    struct arena arena = ARENA_INIT;
+    struct xmalloc_stats before, stats;
+    char *strs[100], expected[64], *big, *small;
+
+    xmalloc_reset_stats();
+    xmalloc_get_stats(&before);
+
+    /* Short strings are allocated from a single chunk */
+    for (int i = 0; i < 100; i++) {
+        strs[i] = arena_asprintf(&arena, "/opt/rh/scl%d/root", i);
+    }
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.allocs, 1);
+
+    /* Big allocation doesn't waste the rest of the current chunk */
+    big = arena_alloc(&arena, 10000);
+    memset(big, 'x', 10000);
+    small = arena_strndup(&arena, "scl1/root", 4);
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.allocs, 2);
+    assert_true(stats.peak_bytes >= before.bytes + 10000);
+
+    for (int i = 0; i < 100; i++) {
+        snprintf(expected, sizeof(expected), "/opt/rh/scl%d/root", i);
+        assert_string_equal(strs[i], expected);
+    }
+    assert_string_equal(small, "scl1");
+
+    arena_release(&arena);
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.frees, stats.allocs);
+    assert_int_equal(stats.bytes, before.bytes);
+
+    /* Memory from libc doesn't disturb the counters */
+    _free(strdup("/opt/rh/scl1/root"));
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.frees, stats.allocs);
+    assert_int_equal(stats.bytes, before.bytes);
+}
+
+static void test_get_enabled_collections(void **state)
+{
+    (void) state; /* unused */
+    struct arena arena = ARENA_INIT;
+    struct xmalloc_stats stats;
+    char **colnames;
+
+    env = dict_init();
+    dict_put(&env, strdup("_LMFILES_=" TEST_MODULES_PATH "/scl1:"
+        TEST_MODULES_PATH "/scl2:" TEST_MODULES_PATH "/scl3:"
+        TEST_MODULES_PATH "/scl4:" TEST_MODULES_PATH "/scl5"));
+
+    /* Number of allocations doesn't grow with number of collections */
+    xmalloc_reset_stats();
+    assert_int_equal(get_enabled_collections(&arena, &colnames), EOK);
+    assert_true(compare_string_arrays(colnames,
+        (char *[]) {"scl1", "scl2", "scl3", "scl4", "scl5", NULL}));
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.allocs, 1);
+
+    arena_release(&arena);
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.frees, stats.allocs);
+    dict_free(env);
+    env = NULL;
+
+    /* Looking up X_SCLS doesn't allocate at all */
+    xmalloc_reset_stats();
+    assert_true(fallback_is_collection_enabled_in(" scl1 scl2 ", "scl2"));
+    assert_false(fallback_is_collection_enabled_in(" scl1 scl2 ", "scl"));
+    xmalloc_get_stats(&stats);
+    assert_int_equal(stats.allocs, 0);
+}
+
+/*
+ * Keep the tests away from collections, configuration and caches of the
+ * host.
+ */
+static int setup(void **state)
+{
+    setenv("SCL_CONFIG", "/nonexistent/scl_test/scl.conf", 1);
+    setenv("SCL_CONF_DIR", "/nonexistent/scl_test/conf", 1);
+    setenv("SCL_MODULES_PATH", TEST_MODULES_PATH, 1);
+    setenv("SCL_CACHE_DIR", "/nonexistent/scl_test_cache", 1);
+    unsetenv("XDG_RUNTIME_DIR");
+
+    return 0;
+}
+
 int main(void)
 {
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_get_installed_collections),
+        cmocka_unit_test(test_scan_modulefiles),
         cmocka_unit_test(test_run_command),
+        cmocka_unit_test(test_ctx),
+        cmocka_unit_test(test_alloc_failure),
+        cmocka_unit_test(test_print_env),
+        cmocka_unit_test(test_arena),
+        cmocka_unit_test(test_get_enabled_collections),
     };
 
-    return cmocka_run_group_tests(tests, NULL, NULL);
+    return cmocka_run_group_tests(tests, setup, NULL);
 }